@@ -564,270 +564,96 @@ void MirrorLinkPeriodicCommands(void) {
   }
 }
 
-// General Status MirrorLink for wifi server
-String MirrorLinkStatusGeneral() {
-	String mirrorLinkInfo;
-	// Encode in JSON message
-  mirrorLinkInfo = "{\"mode\":[";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) {
-    mirrorLinkInfo += "REMOTE";
+// Write a value in hundredths with two decimals (as String(float) does)
+static void MirrorLinkEmitHundredths(BufferFiller &bf, long value) {
+  if (value < 0) {
+    bf.emit_p(PSTR("-"));
+    value = -value;
   }
-  else {
-    mirrorLinkInfo += "STATION";
-  }
-  mirrorLinkInfo += "\"";
-	mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"networkid\":["; 
-	mirrorLinkInfo += "\"";
-	mirrorLinkInfo += String(MirrorLink.status.networkId);
-	mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "]}";
-	return mirrorLinkInfo;
+  bf.emit_p(PSTR("$L.$D$D"), (ulong)(value / 100), (int)((value / 10) % 10), (int)(value % 10));
+}
+
+// General Status MirrorLink for wifi server
+void MirrorLinkStatusGeneral(BufferFiller &bf) {
+  // Encode in JSON message
+  bf.emit_p(PSTR("{\"mode\":[\"$S\"],\"networkid\":[\"$D\"]}"),
+            (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) ? "REMOTE" : "STATION",
+            (int)MirrorLink.status.networkId);
 }
 
 // Radio Status MirrorLink for wifi server
-String MirrorLinkStatusRadio() {
-	String mirrorLinkInfo;
-	// Encode in JSON message
-	mirrorLinkInfo = "{\"frequency\":["; 
-	mirrorLinkInfo += "\"";
-	mirrorLinkInfo += String(MirrorLinkFreqs[MirrorLink.status.channelNumber]);
-	mirrorLinkInfo += "\"";
-	mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"dutycycle\":["; 
-	mirrorLinkInfo += "\"";
-	mirrorLinkInfo += String((MirrorLink.dutyCycle) / 10);
-	mirrorLinkInfo += "\"";
-	mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"powerlevel\":["; 
-	mirrorLinkInfo += "\"";
-  mirrorLinkInfo += String(MirrorLink.powerLevel);
-  mirrorLinkInfo += "\"";
-	mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"rssis\":[";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.link == ML_LINK_UP) {
-    mirrorLinkInfo += String(MirrorLink.rssiLocal[MirrorLink.status.channelNumber]);
-  }
-  else {
-    mirrorLinkInfo += "N.A.";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += ",\r\n";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) {
-    if (MirrorLink.status.link == ML_LINK_UP) {
-      mirrorLinkInfo += String(MirrorLink.rssiRemote[MirrorLink.status.channelNumber]);
-    }
-    else {
-      mirrorLinkInfo += "N.A.";
-    }
-  }
-  else {
-  mirrorLinkInfo += "N.A.";
-  }
-  mirrorLinkInfo += "\"";
-	mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"snrs\":[";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.link == ML_LINK_UP) {
-    mirrorLinkInfo += String(((float)MirrorLink.snrLocal[MirrorLink.status.channelNumber]) / 10);
-  }
-  else {
-    mirrorLinkInfo += "N.A.";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += ",\r\n";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) {
-    if (MirrorLink.status.link == ML_LINK_UP) {
-      mirrorLinkInfo += String(((float)MirrorLink.snrRemote[MirrorLink.status.channelNumber]) / 10);
-    }
-    else {
-      mirrorLinkInfo += "N.A.";
-    }
-  }
-  else {
-    mirrorLinkInfo += "N.A.";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"assocst\":[";
-  mirrorLinkInfo += "\"";
+void MirrorLinkStatusRadio(BufferFiller &bf) {
+  uint8_t ch = MirrorLink.status.channelNumber;
+  bool linkUp = (MirrorLink.status.link == ML_LINK_UP);
+  bool remote = (MirrorLink.status.mirrorLinkStationType == ML_REMOTE);
+  // Encode in JSON message
+  bf.emit_p(PSTR("{\"frequency\":[\""));
+  MirrorLinkEmitHundredths(bf, lroundf(MirrorLinkFreqs[ch] * 100));
+  bf.emit_p(PSTR("\"],\"dutycycle\":[\"$D\"],\"powerlevel\":[\"$D\"],\"rssis\":[\""),
+            (int)(MirrorLink.dutyCycle / 10), (int)MirrorLink.powerLevel);
+  if (linkUp) bf.emit_p(PSTR("$D"), (int)MirrorLink.rssiLocal[ch]);
+  else bf.emit_p(PSTR("N.A."));
+  bf.emit_p(PSTR("\",\r\n\""));
+  if (remote && linkUp) bf.emit_p(PSTR("$D"), (int)MirrorLink.rssiRemote[ch]);
+  else bf.emit_p(PSTR("N.A."));
+  bf.emit_p(PSTR("\"],\"snrs\":[\""));
+  if (linkUp) MirrorLinkEmitHundredths(bf, (long)MirrorLink.snrLocal[ch] * 10);
+  else bf.emit_p(PSTR("N.A."));
+  bf.emit_p(PSTR("\",\r\n\""));
+  if (remote && linkUp) MirrorLinkEmitHundredths(bf, (long)MirrorLink.snrRemote[ch] * 10);
+  else bf.emit_p(PSTR("N.A."));
+  bf.emit_p(PSTR("\"],\"assocst\":[\""));
   switch (MirrorLink.status.comStationState) {
     case ML_LINK_COM_ASSOCIATION:
-      mirrorLinkInfo += "ASSOCIATING";
+      bf.emit_p(PSTR("ASSOCIATING"));
       break;
     case ML_LINK_COM_NONCEUPDATE:
-      mirrorLinkInfo += "NONCE UPDATE";
+      bf.emit_p(PSTR("NONCE UPDATE"));
       break;
     case ML_LINK_COM_NORMAL:
-      mirrorLinkInfo += "ASSOCIATED";
+      bf.emit_p(PSTR("ASSOCIATED"));
       break;
   }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"assocatm\":[";
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += String(MirrorLink.associationAttempts);
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "]}";
-	return mirrorLinkInfo;
+  bf.emit_p(PSTR("\"],\"assocatm\":[\"$D\"]}"), (int)MirrorLink.associationAttempts);
 }
 
 // Packets Status MirrorLink for wifi server
-String MirrorLinkStatusPackets() {
-	String mirrorLinkInfo;
-	// Encode in JSON message
-  mirrorLinkInfo = "{\"buffpackets\":["; 
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) {
-    mirrorLinkInfo += String(MirrorLink.bufferedCommands);
-  }
-  else {
-    mirrorLinkInfo += "N.A.";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"packetstx\":[";
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += String(MirrorLink.packetsSent);
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"packetsrx\":[";
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += String(MirrorLink.packetsReceived);
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"encryption\":[";
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "Speck 64/128 CTR";
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"packettime\":[";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.flagRxTx == ML_RECEIVING) {
-    mirrorLinkInfo += String(MirrorLink.txTime);
-  }
-  else {
-    mirrorLinkInfo += "Calculating...";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"notxtime\":[";
-  mirrorLinkInfo += "\"";
-  if (MirrorLink.status.mirrorLinkStationType == ML_REMOTE) {
-    if (MirrorLink.status.flagRxTx == ML_RECEIVING) {
-      if (MirrorLink.sendTimer >= millis()) {
-        mirrorLinkInfo += String((MirrorLink.sendTimer - millis()) / 1000);
-      }
-      else {
-        mirrorLinkInfo += String((UINT32_MAX - MirrorLink.sendTimer + millis()) / 1000);
-      }
-    }
-    else {
-      mirrorLinkInfo += "Calculating...";
-    }
+void MirrorLinkStatusPackets(BufferFiller &bf) {
+  bool remote = (MirrorLink.status.mirrorLinkStationType == ML_REMOTE);
+  bool receiving = (MirrorLink.status.flagRxTx == ML_RECEIVING);
+  // Encode in JSON message
+  bf.emit_p(PSTR("{\"buffpackets\":[\""));
+  if (remote) bf.emit_p(PSTR("$D"), (int)MirrorLink.bufferedCommands);
+  else bf.emit_p(PSTR("N.A."));
+  bf.emit_p(PSTR("\"],\"packetstx\":[\"$L\"],\"packetsrx\":[\"$L\"],\"encryption\":[\"Speck 64/128 CTR\"],\"packettime\":[\""),
+            (ulong)MirrorLink.packetsSent, (ulong)MirrorLink.packetsReceived);
+  if (receiving) bf.emit_p(PSTR("$L"), (ulong)MirrorLink.txTime);
+  else bf.emit_p(PSTR("Calculating..."));
+  bf.emit_p(PSTR("\"],\"notxtime\":[\""));
+  if (!remote) {
+    bf.emit_p(PSTR("N.A."));
+  }
+  else if (!receiving) {
+    bf.emit_p(PSTR("Calculating..."));
+  }
+  else if (MirrorLink.sendTimer >= millis()) {
+    bf.emit_p(PSTR("$L"), (ulong)((MirrorLink.sendTimer - millis()) / 1000));
   }
   else {
-      mirrorLinkInfo += "N.A.";
+    bf.emit_p(PSTR("$L"), (ulong)((UINT32_MAX - MirrorLink.sendTimer + millis()) / 1000));
   }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "]}";
-	return mirrorLinkInfo;
+  bf.emit_p(PSTR("\"]}"));
 }
 
 // Board Status MirrorLink for wifi server
-String MirrorLinkStatusBoards() {
-	String mirrorLinkInfo;
-	// Encode in JSON message
-  mirrorLinkInfo = "{\"boardnumber\":["; 
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += String((MirrorLink.boardSelected + 1));
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput1\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x1)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput2\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x2)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput3\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x4)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput4\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x8)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput5\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x10)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput6\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x20)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput7\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x40)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "],";
-  mirrorLinkInfo += "\"boardoutput8\":[";
-  mirrorLinkInfo += "\"";
-  if ((MirrorLink.boardStatusBits[MirrorLink.boardSelected] & 0x80)) {
-    mirrorLinkInfo += "ON";
-  }
-  else {
-    mirrorLinkInfo += "OFF";
-  }
-  mirrorLinkInfo += "\"";
-  mirrorLinkInfo += "]}";
-	return mirrorLinkInfo;
+void MirrorLinkStatusBoards(BufferFiller &bf) {
+  uint8_t bits = MirrorLink.boardStatusBits[MirrorLink.boardSelected];
+  // Encode in JSON message
+  bf.emit_p(PSTR("{\"boardnumber\":[\"$D\"]"), (int)(MirrorLink.boardSelected + 1));
+  for (uint8_t i = 0; i < 8; i++) {
+    bf.emit_p(PSTR(",\"boardoutput$D\":[\"$S\"]"), (int)(i + 1), ((bits >> i) & 1) ? "ON" : "OFF");
+  }
+  bf.emit_p(PSTR("}"));
 }
 
 // Return next channel to be selected
@@ -24,6 +24,8 @@
 
 #if defined(ESP32) && defined(MIRRORLINK_ENABLE)
 
+class BufferFiller;
+
 // Special config defines
 //#define DISABLE_ESP32_BROWNOUT
 #define ENABLE_DEBUG_MIRRORLINK
@@ -225,10 +227,10 @@ uint8_t MirrorLinkGetChannel();
 int8_t MirrorLinkGetPower();
 void MirrorLinkInit();
 void MirrorLinkMain();
-String MirrorLinkStatusGeneral();
-String MirrorLinkStatusRadio();
-String MirrorLinkStatusPackets();
-String MirrorLinkStatusBoards();
+void MirrorLinkStatusGeneral(BufferFiller &bf);
+void MirrorLinkStatusRadio(BufferFiller &bf);
+void MirrorLinkStatusPackets(BufferFiller &bf);
+void MirrorLinkStatusBoards(BufferFiller &bf);
 
 #endif // defined(ESP32) && defined(MIRRORLINK_ENABLE)
 
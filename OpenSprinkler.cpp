@@ -26,17 +26,21 @@
 #include "gpio.h"
 #include "testmode.h"
 #include "MirrorLink.h"
+#include "simulation.h"
+#include "logs.h"
 
 /** Declare static data members */
 OSMqtt OpenSprinkler::mqtt;
 NVConData OpenSprinkler::nvdata;
 ConStatus OpenSprinkler::status;
 ConStatus OpenSprinkler::old_status;
+byte OpenSprinkler::config_dirty = 0;
+ulong OpenSprinkler::config_dirty_time = 0;
 byte OpenSprinkler::hw_type;
 byte OpenSprinkler::hw_rev;
 
 byte OpenSprinkler::nboards;
-byte OpenSprinkler::nstations;
+sid_t OpenSprinkler::nstations;
 byte OpenSprinkler::station_bits[MAX_NUM_BOARDS];
 byte OpenSprinkler::engage_booster;
 uint16_t OpenSprinkler::baseline_current;
@@ -67,6 +71,13 @@ byte OpenSprinkler::attrib_igrd[MAX_NUM_BOARDS];
 byte OpenSprinkler::attrib_dis[MAX_NUM_BOARDS];
 byte OpenSprinkler::attrib_seq[MAX_NUM_BOARDS];
 byte OpenSprinkler::attrib_spe[MAX_NUM_BOARDS];
+byte OpenSprinkler::attrib_grp[MAX_NUM_STATIONS];
+byte OpenSprinkler::station_types[MAX_NUM_STATIONS];
+StationLoad OpenSprinkler::station_loads[MAX_NUM_STATIONS];
+#if defined(STATION_TABLE)
+char OpenSprinkler::station_names[MAX_NUM_STATIONS][STATION_NAME_SIZE];
+SpecialStation *OpenSprinkler::station_specials[MAX_NUM_STATIONS];
+#endif
 
 extern char tmp_buffer[];
 extern char ether_buffer[];
@@ -191,6 +202,11 @@ const char iopt_json_names[] PROGMEM =
 	"mldc2"
 	"mltyp"
 #endif //defined(ESP32) && defined(MIRRORLINK_ENABLE)
+	"cpm\0\0"
+	"cpflw"
+	"cpcur"
+	"lgbgt"
+	"lgage"
 	;
 
 // for String options
@@ -301,6 +317,11 @@ const char iopt_prompts[] PROGMEM =
 	"ML DutyCycle 1: "
 	"ML StationType: "
 #endif //defined(ESP32) && defined(MIRRORLINK_ENABLE)
+	"Capacity mode?  "
+	"Max. flow (gpm):"
+	"Max. curr(10mA):"
+	"Log budget(16K):"
+	"Log max age(wk):"
 	;
 
 // string options do not have prompts 
@@ -325,7 +346,7 @@ const byte iopt_max[] PROGMEM = {
 	MAX_EXT_BOARDS,
 	1,
 	255,
-	MAX_NUM_STATIONS,
+	MAX_MASTER_SID,
 	255,
 	255,
 	255,
@@ -344,7 +365,7 @@ const byte iopt_max[] PROGMEM = {
 	255,
 	255,
 	1,
-	MAX_NUM_STATIONS,
+	MAX_MASTER_SID,
 	255,
 	255,
 	0,
@@ -395,8 +416,13 @@ const byte iopt_max[] PROGMEM = {
 	255,
 	1,
 #else
-	1
+	1,
 #endif
+	1,
+	255,
+	255,
+	255,
+	255
 };
 
 // string options do not have maximum values
@@ -496,8 +522,13 @@ byte OpenSprinkler::iopts[] = {
 	10,  // duty cycle byte 2
 	0,   // default station type
 #else
-	0  // reset
+	0,  // reset
 #endif
+	0,	// capacity-aware concurrent scheduling. 0: stagger concurrent stations; 1: pack within flow/current budget
+	0,	// maximum total flow (gpm, same unit as flow sensor readings). 0: no limit
+	0,	// maximum total current (in 10 mA). 0: no limit
+	0,	// log storage budget (in 16 KB). 0: a quarter of the file system on ESP, no limit otherwise
+	0,	// maximum log age (in weeks). 0: no limit
 };
 
 /** String option values (stored in RAM) */
@@ -517,6 +548,18 @@ const char *OpenSprinkler::sopts[] = {
 	DEFAULT_EMPTY_STRING
 };
 
+#if defined(SOPTS_CACHE)
+char *OpenSprinkler::sopts_cache[NUM_SOPTS];
+#endif
+
+#if defined(CHANGE_JOURNAL)
+ulong OpenSprinkler::change_seq = 0;
+ulong OpenSprinkler::change_floor = 0;
+ulong OpenSprinkler::change_boot = 0;
+ChangeRecord OpenSprinkler::changes[CHANGE_JOURNAL_SIZE];
+byte OpenSprinkler::nchanges = 0;
+#endif
+
 /** Weekday strings (stored in PROGMEM to reduce RAM usage) */
 static const char days_str[] PROGMEM =
 	"Mon\0"
@@ -685,10 +728,12 @@ bool OpenSprinkler::network_connected(void) {
 /** Reboot controller */
 void OpenSprinkler::reboot_dev(uint8_t cause) {
 	lcd_print_line_clear_pgm(PSTR("Rebooting..."), 0);
+	log_flush();
 	if(cause) {
 		nvdata.reboot_cause = cause;
 		nvdata_save();
 	}
+	config_flush();
 #if defined(ESP8266) || defined(ESP32)
 	ESP.restart();
 	//ESP.reset();
@@ -714,6 +759,9 @@ byte OpenSprinkler::start_network() {
 	port = 80;
 #endif
 	if(m_server) { delete m_server; m_server = 0; }
+#if defined(DEMO)
+	if (sim_active()) return 0;	// there is no network in simulation mode
+#endif
 
 	m_server = new EthernetServer(port);
 	return m_server->begin();
@@ -756,8 +804,10 @@ bool OpenSprinkler::load_hardware_mac(byte* mac, bool wired) {
 
 /** Reboot controller */
 void OpenSprinkler::reboot_dev(uint8_t cause) {
+	log_flush();
 	nvdata.reboot_cause = cause;
 	nvdata_save();
+	config_flush();
 #if defined(DEMO)
 	// do nothing
 #else
@@ -1068,7 +1118,7 @@ void OpenSprinkler::begin() {
 		lcd.print(F("Init file system"));
 		DEBUG_PRINTLN("Init file system");
 		lcd.setCursor(0,1);
-		if(!SPIFFS.begin()) {
+		if(!FILESYSTEM.begin()) {
 			// !!! flash init failed, stall as we cannot proceed
 			lcd.setCursor(0, 0);
 			lcd_print_pgm(PSTR("Error Code: 0x2D"));
@@ -1142,7 +1192,7 @@ void OpenSprinkler::latch_setallzonepins(byte value) {
 /** Set one zone (for LATCH controller)
  *	This function sets one specified zone pin to a specified value
  */
-void OpenSprinkler::latch_setzonepin(byte sid, byte value) {
+void OpenSprinkler::latch_setzonepin(sid_t sid, byte value) {
 	DEBUG_PRINTLN("latch_setzonepin(byte sid, byte value)");
 	if(sid<8) { // on main controller
 		if(drio->type==IOEXP_TYPE_9555) { // LATCH contorller only uses PCA9555, no other type
@@ -1166,7 +1216,7 @@ void OpenSprinkler::latch_setzonepin(byte sid, byte value) {
 /** LATCH open / close a station
  *
  */
-void OpenSprinkler::latch_open(byte sid) {
+void OpenSprinkler::latch_open(sid_t sid) {
 	DEBUG_PRINTLN("latch_open(byte sid)");
 	latch_boost();	// boost voltage
 	latch_setallzonepins(HIGH);				// set all switches to HIGH, including COM
@@ -1178,7 +1228,7 @@ void OpenSprinkler::latch_open(byte sid) {
 	digitalWriteExt(PIN_BOOST_EN, LOW);  // disable boosted voltage
 }
 
-void OpenSprinkler::latch_close(byte sid) {
+void OpenSprinkler::latch_close(sid_t sid) {
 	DEBUG_PRINTLN("latch_close(byte sid)");
 	latch_boost();	// boost voltage
 	latch_setallzonepins(LOW);				// set all switches to LOW, including COM
@@ -1197,7 +1247,7 @@ void OpenSprinkler::latch_close(byte sid) {
 void OpenSprinkler::latch_apply_all_station_bits() {
 	DEBUG_PRINTLN("llatch_apply_all_station_bits()"); 
 	if(hw_type==HW_TYPE_LATCH && engage_booster) {
-		for(byte i=0;i<nstations;i++) {
+		for(sid_t i=0;i<nstations;i++) {
 			byte bid=i>>3;
 			byte s=i&0x07;
 			byte mask=(byte)1<<s;
@@ -1307,8 +1357,8 @@ void OpenSprinkler::apply_all_station_bits() {
 	if(iopts[IOPT_SPE_AUTO_REFRESH]) {
 		// handle refresh of RF and remote stations
 		// we refresh the station whose index is the current time modulo MAX_NUM_STATIONS
-		static byte last_sid = 0;
-		byte sid = now() % MAX_NUM_STATIONS;
+		static sid_t last_sid = 0;
+		sid_t sid = now() % MAX_NUM_STATIONS;
 		if (sid != last_sid) {	// avoid refreshing the same station twice in a roll
 			last_sid = sid;
 			bid=sid>>3;
@@ -1527,32 +1577,132 @@ uint16_t OpenSprinkler::parse_rfstation_code(RFStationData *data, ulong* on, ulo
 	return v;
 }
 
+/** Decode special station data into an endpoint
+ * HTTP station data is tokenized in place, the endpoint strings point into it.
+ * Returns false if the data is not valid.
+ */
+bool OpenSprinkler::decode_special_station(byte type, byte *sped, SpecialStation *spe) {
+	spe->type = type;
+	switch(type) {
+
+	case STN_TYPE_RF:
+		spe->rf.on = spe->rf.off = 0;
+		spe->rf.timing = parse_rfstation_code((RFStationData *)sped, &spe->rf.on, &spe->rf.off);
+		return true;
+
+	case STN_TYPE_REMOTE: {
+		RemoteStationData *data = (RemoteStationData *)sped;
+		spe->remote.ip = hex2ulong(data->ip, sizeof(data->ip));
+		spe->remote.port = (uint16_t)hex2ulong(data->port, sizeof(data->port));
+		spe->remote.sid = (uint16_t)hex2ulong(data->sid, sizeof(data->sid));
+		return true;
+	}
+
+	case STN_TYPE_GPIO: {
+		GPIOStationData *data = (GPIOStationData *)sped;
+		spe->gpio.pin = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
+		spe->gpio.active = data->active - '0';
+		return true;
+	}
+
+	case STN_TYPE_HTTP: {
+		spe->http.server = strtok((char *)sped, ",");
+		char *port = strtok(NULL, ",");
+		spe->http.on_cmd = strtok(NULL, ",");
+		spe->http.off_cmd = strtok(NULL, ",");
+		if(!spe->http.off_cmd) return false;
+		spe->http.port = atoi(port);
+		return true;
+	}
+	}
+	return false;
+}
+
+#if defined(STATION_TABLE)
+/** Update the type and the decoded endpoint of a station in the station table */
+static void station_table_update(sid_t sid, byte type, const byte *sped) {
+	OpenSprinkler::station_types[sid] = type;
+	SpecialStation *&spe = OpenSprinkler::station_specials[sid];
+	free(spe);
+	spe = NULL;
+	if(type==STN_TYPE_STANDARD) return;
+	// HTTP station data is copied after the endpoint, the endpoint strings point into the copy
+	size_t len = (type==STN_TYPE_HTTP) ? strnlen((const char *)sped, STATION_SPECIAL_DATA_SIZE) : 0;
+	SpecialStation *s = (SpecialStation *)malloc(sizeof(SpecialStation)+len+1);
+	if(!s) return;
+	byte *data = (byte *)sped;
+	if(type==STN_TYPE_HTTP) {
+		data = (byte *)(s+1);
+		memcpy(data, sped, len);
+		data[len] = 0;
+	}
+	if(!OpenSprinkler::decode_special_station(type, data, s)) {
+		free(s);
+		return;
+	}
+	spe = s;
+}
+#endif
+
 /** Get station data */
-void OpenSprinkler::get_station_data(byte sid, StationData* data) {
+void OpenSprinkler::get_station_data(sid_t sid, StationData* data) {
 	file_read_block(STATIONS_FILENAME, data, (uint32_t)sid*sizeof(StationData), sizeof(StationData));
 }
 
 /** Set station data */
-void OpenSprinkler::set_station_data(byte sid, StationData* data) {
+void OpenSprinkler::set_station_data(sid_t sid, StationData* data) {
 	file_write_block(STATIONS_FILENAME, data, (uint32_t)sid*sizeof(StationData), sizeof(StationData));
+	change_note(CHANGE_STATION, sid);
+#if defined(STATION_TABLE)
+	memcpy(station_names[sid], data->name, STATION_NAME_SIZE);
+	station_table_update(sid, data->type, data->sped);
+#else
+	station_types[sid] = data->type;
+#endif
 }
 
 /** Get station name */
-void OpenSprinkler::get_station_name(byte sid, char tmp[]) {
+void OpenSprinkler::get_station_name(sid_t sid, char tmp[]) {
 	tmp[STATION_NAME_SIZE]=0;
+#if defined(STATION_TABLE)
+	memcpy(tmp, station_names[sid], STATION_NAME_SIZE);
+#else
 	file_read_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE); 
+#endif
 }
 
-/** Set station name */
-void OpenSprinkler::set_station_name(byte sid, char tmp[]) {
+/** Set station name
+ * The name is only written if it changed. A caller that records the change
+ * of all stations itself passes note=false.
+ */
+bool OpenSprinkler::set_station_name(sid_t sid, char tmp[], bool note) {
 	// todo: store the right size
 	tmp[STATION_NAME_SIZE]=0;
+	char old[STATION_NAME_SIZE+1];
+	get_station_name(sid, old);
+	if(strncmp(old, tmp, STATION_NAME_SIZE)==0) return false;
 	file_write_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE);
+	if(note) change_note(CHANGE_STATION, sid);
+#if defined(STATION_TABLE)
+	memcpy(station_names[sid], tmp, STATION_NAME_SIZE);
+#endif
+	return true;
 }
 
 /** Get station type */
-byte OpenSprinkler::get_station_type(byte sid) {
-	return file_read_byte(STATIONS_FILENAME, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type));
+byte OpenSprinkler::get_station_type(sid_t sid) {
+	return station_types[sid];
+}
+
+/** Set station type and special data */
+void OpenSprinkler::set_station_special(sid_t sid, const byte *buf) {
+	file_write_block(STATIONS_FILENAME, buf, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), STATION_SPECIAL_DATA_SIZE+1);
+	change_note(CHANGE_STATION, sid);
+#if defined(STATION_TABLE)
+	station_table_update(sid, buf[0], buf+1);
+#else
+	station_types[sid] = buf[0];
+#endif
 }
 
 /** Get station attribute */
@@ -1563,9 +1713,11 @@ byte OpenSprinkler::get_station_type(byte sid) {
 /** Save all station attribs to file (backward compatibility) */
 void OpenSprinkler::attribs_save() {
 	// re-package attribute bits and save
-	byte bid, s, sid=0;
+	byte bid, s;
+	sid_t sid=0;
 	StationAttrib at;
 	byte ty = STN_TYPE_STANDARD;
+	memset(&at, 0, sizeof(StationAttrib));
 	for(bid=0;bid<MAX_NUM_BOARDS;bid++) {
 		for(s=0;s<8;s++,sid++) {
 			at.mas = (attrib_mas[bid]>>s) & 1;
@@ -1575,34 +1727,51 @@ void OpenSprinkler::attribs_save() {
 			at.igrd= (attrib_igrd[bid]>>s) & 1;			 
 			at.dis = (attrib_dis[bid]>>s) & 1;
 			at.seq = (attrib_seq[bid]>>s) & 1;
-			at.gid = 0;
-			file_write_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), 1); // attribte bits are 1 byte long
+			at.gid = attrib_grp[sid];
+			file_write_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), 2); // attribte bits and group id are 2 bytes long
 			if(attrib_spe[bid]>>s==0) {
 				// if station special bit is 0, make sure to write type STANDARD
 				file_write_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1); // attribte bits are 1 byte long
+				#if defined(STATION_TABLE)
+				station_table_update(sid, ty, NULL);
+				#else
+				station_types[sid] = ty;
+				#endif
 			}
 		}
 	}
+	change_note(CHANGE_STATION);
 }
 
-/** Load all station attribs from file (backward compatibility) */
+/** Load all station attribs from file (backward compatibility)
+ * The station file is read in blocks of stations into ether_buffer, which is
+ * not in use at start up. This also loads the station types and the station table.
+ */
 void OpenSprinkler::attribs_load() {
 	// load and re-package attributes
-	byte bid, s, sid=0;
-	StationAttrib at;
-	byte ty;
-	memset(attrib_mas, 0, nboards);
-	memset(attrib_igs, 0, nboards);
-	memset(attrib_mas2, 0, nboards);
-	memset(attrib_igs2, 0, nboards);
-	memset(attrib_igrd, 0, nboards);
-	memset(attrib_dis, 0, nboards);
-	memset(attrib_seq, 0, nboards);
-	memset(attrib_spe, 0, nboards);
+	byte bid, s;
+	sid_t sid=0;
+	StationData *block = (StationData *)ether_buffer;
+	const sid_t nblock = ETHER_BUFFER_SIZE/sizeof(StationData);
+	memset(attrib_mas, 0, MAX_NUM_BOARDS);
+	memset(attrib_igs, 0, MAX_NUM_BOARDS);
+	memset(attrib_mas2, 0, MAX_NUM_BOARDS);
+	memset(attrib_igs2, 0, MAX_NUM_BOARDS);
+	memset(attrib_igrd, 0, MAX_NUM_BOARDS);
+	memset(attrib_dis, 0, MAX_NUM_BOARDS);
+	memset(attrib_seq, 0, MAX_NUM_BOARDS);
+	memset(attrib_spe, 0, MAX_NUM_BOARDS);
+	memset(attrib_grp, 0, MAX_NUM_STATIONS);
 								
 	for(bid=0;bid<MAX_NUM_BOARDS;bid++) {
 		for(s=0;s<8;s++,sid++) {
-			file_read_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib));
+			if(sid%nblock==0) {
+				sid_t n = (MAX_NUM_STATIONS-sid<nblock) ? MAX_NUM_STATIONS-sid : nblock;
+				memset(block, 0, n*sizeof(StationData));	// stations missing from the file read as standard stations
+				file_read_block(STATIONS_FILENAME, block, (uint32_t)sid*sizeof(StationData), (ulong)n*sizeof(StationData));
+			}
+			StationData *data = block+(sid%nblock);
+			StationAttrib &at = data->attrib;
 			attrib_mas[bid] |= (at.mas<<s);
 			attrib_igs[bid] |= (at.igs<<s);
 			attrib_mas2[bid]|= (at.mas2<<s);
@@ -1610,17 +1779,32 @@ void OpenSprinkler::attribs_load() {
 			attrib_igrd[bid]|= (at.igrd<<s);
 			attrib_dis[bid] |= (at.dis<<s);
 			attrib_seq[bid] |= (at.seq<<s);
-			file_read_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1);
-			if(ty!=STN_TYPE_STANDARD) {
+			attrib_grp[sid] = (at.gid<NUM_SEQ_GROUPS) ? at.gid : 0;
+			if(data->type!=STN_TYPE_STANDARD) {
 				attrib_spe[bid] |= (1<<s);
 			}
+			#if defined(STATION_TABLE)
+			memcpy(station_names[sid], data->name, STATION_NAME_SIZE);
+			station_table_update(sid, data->type, data->sped);
+			#else
+			station_types[sid] = data->type;
+			#endif
 		}
 	}
 }
 
 /** verify if a string matches password */
 byte OpenSprinkler::password_verify(char *pw) {
+#if defined(SOPTS_CACHE)
+	// constant time compare: the time does not depend on where the strings differ
+	const char *stored = sopts_cache[SOPT_PASSWORD] ? sopts_cache[SOPT_PASSWORD] : "";
+	size_t n = strlen(stored), len = strlen(pw);
+	byte diff = (len!=n);
+	for(size_t i=0; i<n; i++) diff |= (byte)(((i<len) ? pw[i] : 0) ^ stored[i]);
+	return diff ? 0 : 1;
+#else
 	return (file_cmp_block(SOPTS_FILENAME, pw, SOPT_PASSWORD*MAX_SOPTS_SIZE)==0) ? 1 : 0;
+#endif
 }
 
 // ==================
@@ -1640,31 +1824,41 @@ byte OpenSprinkler::weekday_today() {
 }
 
 /** Switch special station */
-void OpenSprinkler::switch_special_station(byte sid, byte value) {
+void OpenSprinkler::switch_special_station(sid_t sid, byte value) {
+#if defined(STATION_TABLE)
+	// the decoded endpoint is in the station table
+	SpecialStation *spe = station_specials[sid];
+	if(!spe) return;
+#else
 	// check if this is a special station
-	byte stype = get_station_type(sid);
-	if(stype!=STN_TYPE_STANDARD) {
-		// read station data
-		StationData *pdata=(StationData*) tmp_buffer;
-		get_station_data(sid, pdata);
-		switch(stype) {
-		
-		case STN_TYPE_RF:
-			switch_rfstation((RFStationData *)pdata->sped, value);
-			break;
-			
-		case STN_TYPE_REMOTE:
-			switch_remotestation((RemoteStationData *)pdata->sped, value);
-			break;
-			
-		case STN_TYPE_GPIO:
-			switch_gpiostation((GPIOStationData *)pdata->sped, value);
-			break;
-			
-		case STN_TYPE_HTTP:
-			switch_httpstation((HTTPStationData *)pdata->sped, value);
-			break;
-		}
+	if(station_types[sid]==STN_TYPE_STANDARD) return;
+	// read and decode station data
+	// the data is copied out of tmp_buffer, which is used to build HTTP requests
+	StationData *pdata=(StationData*) tmp_buffer;
+	get_station_data(sid, pdata);
+	HTTPStationData copy;
+	memcpy(&copy, pdata->sped, sizeof(HTTPStationData));
+	SpecialStation decoded;
+	SpecialStation *spe = &decoded;
+	if(!decode_special_station(pdata->type, copy.data, spe)) return;
+#endif
+	switch(spe->type) {
+
+	case STN_TYPE_RF:
+		switch_rfstation(spe, value);
+		break;
+
+	case STN_TYPE_REMOTE:
+		switch_remotestation(spe, value);
+		break;
+
+	case STN_TYPE_GPIO:
+		switch_gpiostation(spe, value);
+		break;
+
+	case STN_TYPE_HTTP:
+		switch_httpstation(spe, value);
+		break;
 	}
 }
 
@@ -1673,7 +1867,7 @@ void OpenSprinkler::switch_special_station(byte sid, byte value) {
  * You have to call apply_all_station_bits next to apply the bits
  * (which results in physical actions of opening/closing valves).
  */
-byte OpenSprinkler::set_station_bit(byte sid, byte value) {
+byte OpenSprinkler::set_station_bit(sid_t sid, byte value) {
 	byte *data = station_bits+(sid>>3);  // pointer to the station byte
 	byte mask = (byte)1<<(sid&0x07); // mask
 	if (value) {
@@ -1701,8 +1895,10 @@ byte OpenSprinkler::set_station_bit(byte sid, byte value) {
 /** Clear all station bits */
 void OpenSprinkler::clear_all_station_bits() {
 	DEBUG_PRINTLN("Clearing all station");
-	byte sid;
-	for(sid=0;sid<=MAX_NUM_STATIONS;sid++) {
+	// only the stations that are on need to be switched off
+	sid_t sid;
+	for(sid=station_bits_next(station_bits, 0, MAX_NUM_STATIONS);sid<MAX_NUM_STATIONS;
+			sid=station_bits_next(station_bits, sid+1, MAX_NUM_STATIONS)) {
 		set_station_bit(sid, 0);
 	}
 }
@@ -1754,13 +1950,13 @@ void send_rfsignal(ulong code, ulong len) {
 }
 
 /** Switch RF station
- * This function takes a RF code,
- * parses it into signals and timing,
+ * This function takes the decoded RF code
+ * (signals and timing)
  * and sends it out through RF transmitter.
  */
-void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
-	ulong on, off;
-	uint16_t length = parse_rfstation_code(data, &on, &off);
+void OpenSprinkler::switch_rfstation(SpecialStation *spe, bool turnon) {
+	ulong on = spe->rf.on, off = spe->rf.off;
+	uint16_t length = spe->rf.timing;
 #if defined(ARDUINO)
 	#if defined(ESP8266) || defined(ESP32)
 	rfswitch.enableTransmit(PIN_RFTX);
@@ -1784,10 +1980,11 @@ void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
  * Special data for GPIO Station is three bytes of ascii decimal (not hex)
  * First two bytes are zero padded GPIO pin number.
  * Third byte is either 0 or 1 for active low (GND) or high (+5V) relays
+ * The endpoint holds the decoded pin number and active state.
  */
-void OpenSprinkler::switch_gpiostation(GPIOStationData *data, bool turnon) {
-	byte gpio = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
-	byte activeState = data->active - '0';
+void OpenSprinkler::switch_gpiostation(SpecialStation *spe, bool turnon) {
+	byte gpio = spe->gpio.pin;
+	byte activeState = spe->gpio.active;
 
 	pinMode(gpio, OUTPUT);
 	if (turnon)
@@ -1948,18 +2145,15 @@ int8_t OpenSprinkler::send_http_request(char* server_with_port, char* p, void(*c
 }
 
 /** Switch remote station
- * This function takes a remote station code,
- * parses it into remote IP, port, station index,
+ * This function takes a decoded remote station code
+ * (remote IP, port, station index)
  * and makes a HTTP GET request.
  * The remote controller is assumed to have the same
  * password as the main controller
  */
-void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
-	RemoteStationData copy;
-	memcpy((char*)&copy, (char*)data, sizeof(RemoteStationData));
-	
-	uint32_t ip4 = hex2ulong(copy.ip, sizeof(copy.ip));
-	uint16_t port = (uint16_t)hex2ulong(copy.port, sizeof(copy.port));
+void OpenSprinkler::switch_remotestation(SpecialStation *spe, bool turnon) {
+	uint32_t ip4 = spe->remote.ip;
+	uint16_t port = spe->remote.port;
 
 	byte ip[4];
 	ip[0] = ip4>>24;
@@ -1967,15 +2161,13 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
 	ip[2] = (ip4>>8)&0xff;
 	ip[3] = ip4&0xff;
 	
-	// use tmp_buffer starting at a later location
-	// because remote station data is loaded at the beginning
 	char *p = tmp_buffer;
-	BufferFiller bf = p;
+	BufferFiller bf(p, TMP_BUFFER_SIZE+MAX_SOPTS_SIZE+1);
 	// MAX_NUM_STATIONS is the refresh cycle
 	uint16_t timer = iopts[IOPT_SPE_AUTO_REFRESH]?2*MAX_NUM_STATIONS:64800;  
 	bf.emit_p(PSTR("GET /cm?pw=$O&sid=$D&en=$D&t=$D"),
 						SOPT_PASSWORD,
-						(int)hex2ulong(copy.sid, sizeof(copy.sid)),
+						(int)spe->remote.sid,
 						turnon, timer);
 	bf.emit_p(PSTR(" HTTP/1.0\r\nHOST: $D.$D.$D.$D\r\n\r\n"),
 						ip[0],ip[1],ip[2],ip[3]);
@@ -1985,30 +2177,39 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
 }
 
 /** Switch http station
- * This function takes an http station code,
- * parses it into a server name and two HTTP GET requests.
+ * This function takes a decoded http station code
+ * (a server name and two HTTP GET requests).
  */
-void OpenSprinkler::switch_httpstation(HTTPStationData *data, bool turnon) {
-
-	HTTPStationData copy;
-	// make a copy of the HTTP station data and work with it
-	memcpy((char*)&copy, (char*)data, sizeof(HTTPStationData));
-	char * server = strtok((char *)copy.data, ",");
-	char * port = strtok(NULL, ",");
-	char * on_cmd = strtok(NULL, ",");
-	char * off_cmd = strtok(NULL, ",");
-	char * cmd = turnon ? on_cmd : off_cmd;
+void OpenSprinkler::switch_httpstation(SpecialStation *spe, bool turnon) {
+	char * server = spe->http.server;
+	char * cmd = turnon ? spe->http.on_cmd : spe->http.off_cmd;
 
 	char *p = tmp_buffer;
-	BufferFiller bf = p;
+	BufferFiller bf(p, TMP_BUFFER_SIZE+MAX_SOPTS_SIZE+1);
 	bf.emit_p(PSTR("GET /$S HTTP/1.0\r\nHOST: $S\r\n\r\n"), cmd, server);
 
-	send_http_request(server, atoi(port), p, remote_http_callback);
+	send_http_request(server, spe->http.port, p, remote_http_callback);
 }
 
 /** Setup function for options */
 void OpenSprinkler::options_setup() {
 
+	// finish config writes interrupted by a power loss
+	file_recover(IOPTS_FILENAME);
+	file_recover(NVCON_FILENAME);
+	file_recover(LOADS_FILENAME);
+
+#if defined(CHANGE_JOURNAL)
+	// a new id for this boot, change sequence numbers start again from 0
+	#if defined(ESP8266)
+	change_boot = RANDOM_REG32;
+	#elif defined(ESP32)
+	change_boot = esp_random();
+	#else
+	change_boot = (ulong)time(NULL);
+	#endif
+#endif
+
 	// Check reset conditions:
 	if (file_read_byte(IOPTS_FILENAME, IOPT_FW_VERSION)<219 ||	// fw version is invalid (<219)
 			!file_exists(DONE_FILENAME) ||													// done file doesn't exist
@@ -2025,7 +2226,7 @@ void OpenSprinkler::options_setup() {
 		if(file_read_byte(IOPTS_FILENAME, IOPT_RESET)==0xAA) {
 			// this is an explicit reset request, simply perform a format
 			#if defined(ESP8266) || defined(ESP32)
-			SPIFFS.format();
+			FILESYSTEM.format();
 			#else
 			// todo future: delete log files
 			#endif
@@ -2055,6 +2256,7 @@ void OpenSprinkler::options_setup() {
 		pdata->name[0]='S';
 		pdata->name[3]=0;
 		pdata->name[4]=0;
+		pdata->name[5]=0;
 		StationAttrib at;
 		memset(&at, 0, sizeof(StationAttrib));
 		at.mas=1;
@@ -2068,10 +2270,15 @@ void OpenSprinkler::options_setup() {
 			if(i<99) {
 				pdata->name[1]='0'+(sid/10); // default station name
 				pdata->name[2]='0'+(sid%10);
-			} else {
+			} else if(i<999) {
 				pdata->name[1]='0'+(sid/100);
 				pdata->name[2]='0'+((sid%100)/10);
 				pdata->name[3]='0'+(sid%10);
+			} else {
+				pdata->name[1]='0'+(sid/1000);
+				pdata->name[2]='0'+((sid%1000)/100);
+				pdata->name[3]='0'+((sid%100)/10);
+				pdata->name[4]='0'+(sid%10);
 			}
 			file_write_block(STATIONS_FILENAME, pdata, sizeof(StationData)*i, sizeof(StationData));
 		}
@@ -2083,8 +2290,14 @@ void OpenSprinkler::options_setup() {
 		nvdata_save();
 		last_reboot_cause = nvdata.reboot_cause;
 		
-		// 4. write program data: just need to write a program counter: 0
-		file_write_byte(PROG_FILENAME, 0, 0);
+		// 4. remove program data: an empty program log is created on start up
+		remove_file(PROG_FILENAME);
+		remove_file(PROG_ALT_FILENAME);
+		remove_file(PROG_V2_FILENAME);
+		remove_file(PROG_V1_FILENAME);
+		remove_file(LOGSHIP_FILENAME);
+		remove_file(LOADS_FILENAME);
+		config_flush();
 		
 		// 5. write 'done' file
 		file_write_byte(DONE_FILENAME, 0, 1);
@@ -2093,6 +2306,8 @@ void OpenSprinkler::options_setup() {
 
 		iopts_load();
 		nvdata_load();
+		loads_load();
+		sopts_load();
 		last_reboot_cause = nvdata.reboot_cause;
 		nvdata.reboot_cause = REBOOT_CAUSE_POWERON;
 		nvdata_save();
@@ -2203,15 +2418,89 @@ void OpenSprinkler::options_setup() {
 #endif
 }
 
+/** Mark config data for saving */
+static void config_mark_dirty(byte bits) {
+	if(!OpenSprinkler::config_dirty) OpenSprinkler::config_dirty_time = millis();
+	OpenSprinkler::config_dirty |= bits;
+}
+
 /** Load non-volatile controller status data from file */
 void OpenSprinkler::nvdata_load() {
 	file_read_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
 	old_status = status;
 }
 
-/** Save non-volatile controller status data */
+/** Save non-volatile controller status data, see config_flush() */
 void OpenSprinkler::nvdata_save() {
-	file_write_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
+	config_mark_dirty(CONFIG_DIRTY_NVDATA);
+	change_note(CHANGE_NVDATA);
+}
+
+/** Load learned station loads from file, stations missing from the file are not known */
+void OpenSprinkler::loads_load() {
+	memset(station_loads, 0, sizeof(station_loads));
+	if(file_exists(LOADS_FILENAME)) file_read_block(LOADS_FILENAME, station_loads, 0, sizeof(station_loads));
+}
+
+/** Save learned station loads, see config_flush() */
+void OpenSprinkler::loads_save() {
+	config_mark_dirty(CONFIG_DIRTY_LOADS);
+}
+
+/** Check if a block differs from the content of its file */
+static bool config_changed(const char *fn, const void *data, ulong len) {
+	byte buf[16];
+	const byte *p = (const byte*)data;
+	for(ulong pos=0; pos<len; pos+=sizeof(buf)) {
+		ulong n = (len-pos<sizeof(buf)) ? len-pos : sizeof(buf);
+		memset(buf, 0, n);
+		file_read_block(fn, buf, pos, n);
+		if(memcmp(buf, p+pos, n)) return true;
+	}
+	return false;
+}
+
+/** Write dirty config data */
+void OpenSprinkler::config_flush() {
+	if(config_dirty & CONFIG_DIRTY_IOPTS) {
+		if(config_changed(IOPTS_FILENAME, iopts, NUM_IOPTS)) file_replace(IOPTS_FILENAME, iopts, NUM_IOPTS);
+	}
+	if(config_dirty & CONFIG_DIRTY_NVDATA) {
+		if(config_changed(NVCON_FILENAME, &nvdata, sizeof(NVConData))) file_replace(NVCON_FILENAME, &nvdata, sizeof(NVConData));
+	}
+	if(config_dirty & CONFIG_DIRTY_LOADS) {
+		if(config_changed(LOADS_FILENAME, station_loads, sizeof(station_loads))) file_replace(LOADS_FILENAME, station_loads, sizeof(station_loads));
+	}
+	config_dirty = 0;
+}
+
+/** Write dirty config data once CONFIG_SAVE_DELAY seconds have passed since the first change */
+void OpenSprinkler::config_flush_idle() {
+	if(config_dirty && millis()-config_dirty_time>=CONFIG_SAVE_DELAY*1000UL) config_flush();
+}
+
+/** Record a configuration change in the change journal */
+void OpenSprinkler::change_note(byte kind, uint16_t id) {
+#if defined(CHANGE_JOURNAL)
+	byte i;
+	// drop the older record of the same entity, or the oldest record if the journal is full
+	for(i=0;i<nchanges;i++) {
+		if(changes[i].kind==kind && changes[i].id==id) break;
+	}
+	if(i==nchanges && nchanges==CHANGE_JOURNAL_SIZE) {
+		change_floor = changes[0].seq;
+		i = 0;
+	}
+	if(i<nchanges) {
+		memmove(changes+i, changes+i+1, (nchanges-i-1)*sizeof(ChangeRecord));
+		nchanges--;
+	}
+	ChangeRecord *c = changes+nchanges;
+	c->seq = ++change_seq;
+	c->id = id;
+	c->kind = kind;
+	nchanges++;
+#endif
 }
 
 /** Load integer options from file */
@@ -2235,9 +2524,10 @@ void OpenSprinkler::iopts_load() {
         }
 }
 
-/** Save integer options to file */
+/** Save integer options to file, see config_flush() */
 void OpenSprinkler::iopts_save() {
-	file_write_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+	config_mark_dirty(CONFIG_DIRTY_IOPTS);
+	change_note(CHANGE_IOPTS);
 	nboards = iopts[IOPT_EXT_BOARDS]+1;
 	nstations = nboards * 8;
 	status.enabled = iopts[IOPT_DEVICE_ENABLE];
@@ -2245,10 +2535,47 @@ void OpenSprinkler::iopts_save() {
 
 /** Load a string option from file */
 void OpenSprinkler::sopt_load(byte oid, char *buf) {
+#if defined(SOPTS_CACHE)
+	if(sopts_cache[oid]) {
+		strcpy(buf, sopts_cache[oid]);
+		return;
+	}
+#endif
 	file_read_block(SOPTS_FILENAME, buf, MAX_SOPTS_SIZE*oid, MAX_SOPTS_SIZE);
 	buf[MAX_SOPTS_SIZE]=0;	// ensure the string ends properly
 }
 
+#if defined(SOPTS_CACHE)
+/** Set the cached value of a string option */
+static void sopt_cache_set(byte oid, const char *buf) {
+	char *&s = OpenSprinkler::sopts_cache[oid];
+	free(s);
+	size_t len = strlen(buf);
+	if(len>MAX_SOPTS_SIZE) len = MAX_SOPTS_SIZE;
+	s = (char*)malloc(len+1);
+	if(!s) return;	// falls back to the file
+	memcpy(s, buf, len);
+	s[len] = 0;
+}
+#endif
+
+/** Load all string options into the cache
+ * The file is read at once into ether_buffer, which is not in use at start up.
+ */
+void OpenSprinkler::sopts_load() {
+#if defined(SOPTS_CACHE)
+	memset(ether_buffer, 0, (ulong)NUM_SOPTS*MAX_SOPTS_SIZE+1);
+	file_read_block(SOPTS_FILENAME, ether_buffer, 0, (ulong)NUM_SOPTS*MAX_SOPTS_SIZE);
+	for(byte oid=0; oid<NUM_SOPTS; oid++) {
+		char *s = ether_buffer+(ulong)oid*MAX_SOPTS_SIZE;
+		char c = s[MAX_SOPTS_SIZE];
+		s[MAX_SOPTS_SIZE] = 0;	// ensure the string ends properly
+		sopt_cache_set(oid, s);
+		s[MAX_SOPTS_SIZE] = c;
+	}
+#endif
+}
+
 /** Load a string option from file, return String */
 String OpenSprinkler::sopt_load(byte oid) {
 	sopt_load(oid, tmp_buffer);
@@ -2259,7 +2586,16 @@ String OpenSprinkler::sopt_load(byte oid) {
 /** Save a string option to file */
 bool OpenSprinkler::sopt_save(byte oid, const char *buf) {
 	// smart save: if value hasn't changed, don't write
+#if defined(SOPTS_CACHE)
+	if(sopts_cache[oid]) {
+		if(strncmp(sopts_cache[oid], buf, MAX_SOPTS_SIZE)==0) return false;
+	} else
+#endif
 	if(file_cmp_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid)==0) return false;
+#if defined(SOPTS_CACHE)
+	sopt_cache_set(oid, buf);
+#endif
+	change_note(CHANGE_SOPT, oid);
 	int len = strlen(buf);
 	if(len>=MAX_SOPTS_SIZE) {
 		file_write_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid, MAX_SOPTS_SIZE);
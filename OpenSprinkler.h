@@ -47,9 +47,22 @@
 		#include <SdFat.h>
 		#include "LiquidCrystal.h"
 	#endif
-	#if defined(ESP32)
-    	#include <SPIFFS.h>
-  	#endif
+	#if defined(ESP8266) || defined(ESP32)
+		/** Flash file system, selected at build time: SPIFFS (default),
+		 * LittleFS (-DUSE_LITTLEFS) or FFat (-DUSE_FFAT, ESP32 with an FFat partition) */
+		#if defined(USE_LITTLEFS)
+			#include <LittleFS.h>
+			#define FILESYSTEM LittleFS
+		#elif defined(USE_FFAT) && defined(ESP32)
+			#include <FFat.h>
+			#define FILESYSTEM FFat
+		#else
+			#if defined(ESP32)
+			#include <SPIFFS.h>
+			#endif
+			#define FILESYSTEM SPIFFS
+		#endif
+	#endif
 	
 #else // headers for RPI/BBB/LINUX
 	#include <time.h>
@@ -61,6 +74,45 @@
 #endif // end of headers
 
 /** Non-volatile data structure */
+/** Config persistence
+ * iopts_save(), nvdata_save() and loads_save() mark their data dirty, and the data is written
+ * CONFIG_SAVE_DELAY seconds after the first change, so that bursts of changes
+ * cost a single write. A block is written only if it differs from its file, by
+ * replacing the file (file_replace), so a write is never torn.
+ * config_flush() writes at once, before reboot and on exit.
+ */
+#define CONFIG_DIRTY_IOPTS  0x01
+#define CONFIG_DIRTY_NVDATA 0x02
+#define CONFIG_DIRTY_LOADS  0x04
+#define CONFIG_SAVE_DELAY   5
+
+/** Change journal (ESP8266/ESP32 and Linux)
+ * Each configuration change bumps change_seq and is recorded in a small
+ * journal: the kind of data (CHANGE_*) and the program, station or string
+ * option id, or CHANGE_ID_ALL if the whole kind changed (e.g. a program was
+ * deleted and the others moved). A record replaces any older record of the
+ * same entity. When the journal is full, the oldest record is dropped and
+ * change_floor is raised to its sequence number, so that clients synced before
+ * it know they must reload everything. The sequence number starts again at
+ * each boot, with a new change_boot id.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define CHANGE_JOURNAL
+#endif
+#define CHANGE_JOURNAL_SIZE 32
+#define CHANGE_PROGRAM 0
+#define CHANGE_STATION 1
+#define CHANGE_IOPTS   2
+#define CHANGE_SOPT    3
+#define CHANGE_NVDATA  4
+#define CHANGE_ID_ALL  0xFFFF
+
+struct ChangeRecord {
+	uint32_t seq;
+	uint16_t id;
+	byte kind;
+};
+
 struct NVConData {
 	uint16_t sunrise_time;	// sunrise time (in minutes)
 	uint16_t sunset_time;		// sunset time (in minutes)
@@ -69,6 +121,13 @@ struct NVConData {
 	uint8_t  reboot_cause;	// reboot cause
 };
 
+/** Learned station load, used by capacity-aware scheduling
+ * 0 means not known yet */
+struct StationLoad {
+	uint16_t flow;	// flow rate (gpm x 100)
+	uint16_t curr;	// solenoid current (mA above baseline)
+};
+
 struct StationAttrib {	// station attributes
 	byte mas:1;
 	byte igs:1;	// ignore sensor 1
@@ -79,7 +138,7 @@ struct StationAttrib {	// station attributes
 	byte igrd:1;// ignore rain delay
 	byte unused:1;
 	
-	byte gid:4; // group id: reserved for the future
+	byte gid:4; // sequential group id
 	byte dummy:4;
 	byte reserved[2]; // reserved bytes for the future
 }; // total is 4 bytes so far
@@ -117,6 +176,36 @@ struct HTTPStationData {
 	byte data[STATION_SPECIAL_DATA_SIZE];
 };
 
+/** Special station endpoint, decoded from the special station data */
+struct SpecialStation {
+	byte type;
+	union {
+		struct { ulong on; ulong off; uint16_t timing; } rf;
+		struct { uint32_t ip; uint16_t port; uint16_t sid; } remote;
+		struct { byte pin; byte active; } gpio;
+		struct { char *server; char *on_cmd; char *off_cmd; uint16_t port; } http;	// strings point into the tokenized station data
+	};
+};
+
+/** Station table (ESP8266/ESP32 and Linux)
+ * Station names and decoded special station endpoints are kept in RAM, loaded
+ * with the attributes at start up and written through to the station file on
+ * change, so station switching and /jn do not access the file. The station
+ * types are kept in RAM on all platforms.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define STATION_TABLE
+#endif
+
+/** String option cache (ESP8266/ESP32 and Linux)
+ * String options are loaded into RAM at start up and written through to the
+ * file on change, so sopt_load(), $O in BufferFiller::emit_p and password
+ * checks do not access the file.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define SOPTS_CACHE
+#endif
+
 /** Volatile controller status bits */
 struct ConStatus {
 	byte enabled:1;						// operation enable (when set, controller operation is enabled)
@@ -162,12 +251,25 @@ public:
 	static NVConData nvdata;
 	static ConStatus status;
 	static ConStatus old_status;
-	static byte nboards, nstations;
+	static byte nboards;
+	static sid_t nstations;
 	static byte hw_type;	// hardware type
 	static byte hw_rev;		// hardware minor
 
 	static byte iopts[]; // integer options
+	static byte config_dirty;	// CONFIG_DIRTY_* bits of the data not saved yet
+	static ulong config_dirty_time;	// time of the oldest change not saved yet (millis)
 	static const char*sopts[]; // string options
+#if defined(SOPTS_CACHE)
+	static char *sopts_cache[];	// cached string options, NULL if not loaded
+#endif
+#if defined(CHANGE_JOURNAL)
+	static ulong change_seq;	// sequence number of the latest change
+	static ulong change_floor;	// sequence number of the latest record dropped from the journal
+	static ulong change_boot;	// id of this boot
+	static ChangeRecord changes[];	// change journal, oldest first
+	static byte nchanges;
+#endif
 	static byte station_bits[];			// station activation bits. each byte corresponds to a board (8 stations)
 																	// first byte-> master controller, second byte-> ext. board 1, and so on
 	// todo future: the following attribute bytes are for backward compatibility
@@ -179,6 +281,13 @@ public:
 	static byte attrib_dis[];
 	static byte attrib_seq[];
 	static byte attrib_spe[];
+	static byte attrib_grp[];	// sequential group id of each station
+	static byte station_types[];	// type of each station
+	static StationLoad station_loads[];	// learned load of each station
+#if defined(STATION_TABLE)
+	static char station_names[][STATION_NAME_SIZE];	// name of each station, not terminated if the name is STATION_NAME_SIZE long
+	static SpecialStation *station_specials[];	// decoded endpoint of each special station, NULL for other stations
+#endif
 		
 	// variables for time keeping
 	static ulong sensor1_on_timer;	// time when sensor1 is detected on last time
@@ -208,23 +317,30 @@ public:
 	static bool load_hardware_mac(byte* buffer, bool wired=false);	// read hardware mac address
 	static time_t now_tz();
 	// -- station names and attributes
-	static void get_station_data(byte sid, StationData* data); // get station data
-	static void set_station_data(byte sid, StationData* data); // set station data
-	static void get_station_name(byte sid, char buf[]); // get station name
-	static void set_station_name(byte sid, char buf[]); // set station name
-	static byte get_station_type(byte sid); // get station type
+	static void get_station_data(sid_t sid, StationData* data); // get station data
+	static void set_station_data(sid_t sid, StationData* data); // set station data
+	static void get_station_name(sid_t sid, char buf[]); // get station name
+	static bool set_station_name(sid_t sid, char buf[], bool note=true); // set station name, returns false if it is unchanged
+	static byte get_station_type(sid_t sid); // get station type
+	static void set_station_special(sid_t sid, const byte *buf); // set station type and special data (buf: type followed by the special data)
 	//static StationAttrib get_station_attrib(byte sid); // get station attribute
 	static void attribs_save(); // repackage attrib bits and save (backward compatibility)
 	static void attribs_load(); // load and repackage attrib bits (backward compatibility)
 	static uint16_t parse_rfstation_code(RFStationData *data, ulong *on, ulong *off); // parse rf code into on/off/time sections
-	static void switch_rfstation(RFStationData *data, bool turnon);  // switch rf station
-	static void switch_remotestation(RemoteStationData *data, bool turnon); // switch remote station
-	static void switch_gpiostation(GPIOStationData *data, bool turnon); // switch gpio station
-	static void switch_httpstation(HTTPStationData *data, bool turnon); // switch http station
+	static bool decode_special_station(byte type, byte *sped, SpecialStation *spe); // decode special station data, tokenizes HTTP data
+	static void switch_rfstation(SpecialStation *spe, bool turnon);  // switch rf station
+	static void switch_remotestation(SpecialStation *spe, bool turnon); // switch remote station
+	static void switch_gpiostation(SpecialStation *spe, bool turnon); // switch gpio station
+	static void switch_httpstation(SpecialStation *spe, bool turnon); // switch http station
 
 	// -- options and data storeage
 	static void nvdata_load();
 	static void nvdata_save();
+	static void loads_load();
+	static void loads_save();
+	static void config_flush();
+	static void config_flush_idle();
+	static void change_note(byte kind, uint16_t id=CHANGE_ID_ALL);
 
 	static void options_setup();
 	static void iopts_load();
@@ -232,6 +348,7 @@ public:
 	static bool sopt_save(byte oid, const char *buf);
 	static void sopt_load(byte oid, char *buf);
 	static String sopt_load(byte oid);
+	static void sopts_load();
 
 	static byte password_verify(char *pw);	// verify password
 	
@@ -250,8 +367,8 @@ public:
 	static int detect_exp();				// detect the number of expansion boards
 	static byte weekday_today();		// returns index of today's weekday (Monday is 0)
 
-	static byte set_station_bit(byte sid, byte value); // set station bit of one station (sid->station index, value->0/1)
-	static void switch_special_station(byte sid, byte value); // swtich special station
+	static byte set_station_bit(sid_t sid, byte value); // set station bit of one station (sid->station index, value->0/1)
+	static void switch_special_station(sid_t sid, byte value); // swtich special station
 	static void clear_all_station_bits(); // clear all station bits
 	static void apply_all_station_bits(); // apply all station bits (activate/deactive values)
 
@@ -309,9 +426,9 @@ private:
 
 	#if defined(ESP8266) || defined(ESP32)
 	static void latch_boost();
-	static void latch_open(byte sid);
-	static void latch_close(byte sid);
-	static void latch_setzonepin(byte sid, byte value);
+	static void latch_open(sid_t sid);
+	static void latch_close(sid_t sid);
+	static void latch_setzonepin(sid_t sid, byte value);
 	static void latch_setallzonepins(byte value);
 	static void latch_apply_all_station_bits();
 	static byte prev_station_bits[];
@@ -14,17 +14,17 @@ if [ "$1" == "demo" ]; then
 	echo "Installing required libraries..."
 	apt-get install -y libmosquitto-dev
 	echo "Compiling firmware..."
-	g++ -o OpenSprinkler -DDEMO -m32 main.cpp OpenSprinkler.cpp program.cpp server.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp -lpthread -lmosquitto
+	g++ -o OpenSprinkler -DDEMO -m32 main.cpp OpenSprinkler.cpp program.cpp logs.cpp logship.cpp server_os.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp simulation.cpp -lpthread -lmosquitto
 elif [ "$1" == "osbo" ]; then
 	echo "Installing required libraries..."
 	apt-get install -y libmosquitto-dev
 	echo "Compiling firmware..."
-	g++ -o OpenSprinkler -DOSBO main.cpp OpenSprinkler.cpp program.cpp server.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp -lpthread -lmosquitto
+	g++ -o OpenSprinkler -DOSBO main.cpp OpenSprinkler.cpp program.cpp logs.cpp logship.cpp server_os.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp simulation.cpp -lpthread -lmosquitto
 else
 	echo "Installing required libraries..."
 	apt-get install -y libmosquitto-dev
 	echo "Compiling firmware..."
-	g++ -o OpenSprinkler -DOSPI main.cpp OpenSprinkler.cpp program.cpp server.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp -lpthread -lmosquitto
+	g++ -o OpenSprinkler -DOSPI main.cpp OpenSprinkler.cpp program.cpp logs.cpp logship.cpp server_os.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp mqtt.cpp simulation.cpp -lpthread -lmosquitto
 fi
 
 if [ ! "$SILENT" = true ] && [ -f OpenSprinkler.launch ] && [ ! -f /etc/init.d/OpenSprinkler.sh ]; then
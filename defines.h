@@ -58,8 +58,13 @@ typedef unsigned long ulong;
 #define SOPTS_FILENAME        "sopts.dat"   // string options data file
 #define STATIONS_FILENAME     "stns.dat"    // stations data file
 #define NVCON_FILENAME        "nvcon.dat"   // non-volatile controller data file, see OpenSprinkler.h --> struct NVConData
-#define PROG_FILENAME         "prog.dat"    // program data file
+#define PROG_FILENAME         "prog0.dat"   // program log file
+#define PROG_ALT_FILENAME     "prog1.dat"   // program log file (alternates with the above on compaction)
+#define PROG_V2_FILENAME      "prog2.dat"   // program data files of older firmwares (migrated on start up)
+#define PROG_V1_FILENAME      "prog.dat"
 #define DONE_FILENAME         "done.dat"    // used to indicate the completion of all files
+#define LOGSHIP_FILENAME      "logship.dat" // log shipping high-water mark, see logship.h
+#define LOADS_FILENAME        "loads.dat"   // learned station loads, see OpenSprinkler.h --> struct StationLoad
 #endif
 
 /** Station macro defines */
@@ -129,12 +134,29 @@ typedef unsigned long ulong;
 /** Storage / zone expander defines */
 #if defined(ARDUINO)
 	#define MAX_EXT_BOARDS    8  // maximum number of 8-zone expanders (each 16-zone expander counts as 2)
-#else
-	#define MAX_EXT_BOARDS		24 // allow more zones for linux-based firmwares
+#elif !defined(MAX_EXT_BOARDS)
+	#define MAX_EXT_BOARDS		24 // allow more zones for linux-based firmwares (can be raised at compile time, e.g. -DMAX_EXT_BOARDS=127)
+#endif
+
+#if MAX_EXT_BOARDS > 254
+	#error "MAX_EXT_BOARDS must not exceed 254"
 #endif
 
 #define MAX_NUM_BOARDS    (1+MAX_EXT_BOARDS)  // maximum number of 8-zone boards including expanders
 #define MAX_NUM_STATIONS  (MAX_NUM_BOARDS*8)  // maximum number of stations
+
+/** Station index and runtime queue index types
+ * 16-bit if the station count does not fit in a byte */
+#if MAX_NUM_STATIONS > 255
+	#include <stdint.h>
+	typedef uint16_t sid_t;
+#else
+	typedef byte sid_t;
+#endif
+typedef sid_t qid_t;
+#define QID_NONE          ((qid_t)~0)  // no queue element assigned
+#define MAX_MASTER_SID    (MAX_NUM_STATIONS>255?255:MAX_NUM_STATIONS)  // master station options are stored in a byte
+#define NUM_SEQ_GROUPS    4     // number of sequential groups (each runs its own sequential lane)
 #define STATION_NAME_SIZE 32    // maximum number of characters in each station name
 #define MAX_SOPTS_SIZE    160   // maximum string option size
 
@@ -240,6 +262,11 @@ enum {
 	IOPT_ML_DUTYCYCLE2,
 	IOPT_ML_STATIONTYPE,
 #endif //defined(ESP32) && defined(MIRRORLINK_ENABLE)
+	IOPT_CAPACITY_MODE,
+	IOPT_MAX_FLOW,
+	IOPT_MAX_CURRENT,
+	IOPT_LOG_BUDGET,
+	IOPT_LOG_MAXAGE,
 	NUM_IOPTS // total number of integer options
 };
 
@@ -253,6 +280,7 @@ enum {
 	SOPT_STA_SSID,
 	SOPT_STA_PASS,
 	SOPT_MQTT_OPTS,
+	SOPT_LOGSHIP_OPTS,
 	//SOPT_WEATHER_KEY,
 	//SOPT_AP_PASS,
 	NUM_SOPTS	// total number of string options
@@ -399,8 +427,13 @@ enum {
 	#define SOPTS_FILENAME        "/sopts.dat"   // string options data file
 	#define STATIONS_FILENAME     "/stns.dat"    // stations data file
 	#define NVCON_FILENAME        "/nvcon.dat"   // non-volatile controller data file, see OpenSprinkler.h --> struct NVConData
-	#define PROG_FILENAME         "/prog.dat"    // program data file
+	#define PROG_FILENAME         "/prog0.dat"   // program log file
+	#define PROG_ALT_FILENAME     "/prog1.dat"   // program log file (alternates with the above on compaction)
+	#define PROG_V2_FILENAME      "/prog2.dat"   // program data files of older firmwares (migrated on start up)
+	#define PROG_V1_FILENAME      "/prog.dat"
 	#define DONE_FILENAME         "/done.dat"    // used to indicate the completion of all files
+	#define LOGSHIP_FILENAME      "/logship.dat" // log shipping high-water mark, see logship.h
+	#define LOADS_FILENAME        "/loads.dat"   // learned station loads, see OpenSprinkler.h --> struct StationLoad
 
 	#define MDNS_NAME "opensprinkler" // mDNS name for OS controler
 	#define OS_HW_VERSION    (OS_HW_VERSION_BASE+40)
@@ -501,8 +534,8 @@ enum {
 	#define PIN_SR_DATA     0
 	#define PIN_SR_CLOCK    0
 	#define PIN_SR_OE       0
-	#define PIN_SENSOR1			0
-	#define PIN_SENSOR2			0
+	#define PIN_SENSOR1			1		// distinct sensor pins so the simulation can drive them
+	#define PIN_SENSOR2			2
 	#define PIN_RFTX     0
 	#define PIN_FREE_LIST	{}
 	#define ETHER_BUFFER_SIZE   16384
@@ -540,12 +573,19 @@ enum {
 	#include <stddef.h>
 	inline void itoa(int v,char *s,int b)   {sprintf(s,"%d",v);}
 	inline void ultoa(unsigned long v,char *s,int b) {sprintf(s,"%lu",v);}
-	#define now()       time(0)
+	#include <time.h>
+	#if defined(DEMO)
+		time_t sim_now();	// virtual clock in simulation mode, see simulation.h
+		#define now()       sim_now()
+	#else
+		#define now()       time(0)
+	#endif
 	#define pgm_read_byte(x) *(x)
 	#define PSTR(x)      x
 	#define F(x)				 x
 	#define strcat_P     strcat
 	#define strcpy_P     strcpy
+	#define strcmp_P     strcmp
 	#define sprintf_P    sprintf
 	#include<string>
 	#define String       string
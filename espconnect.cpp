@@ -23,30 +23,21 @@
 
 const char html_ap_redirect[] PROGMEM = "<h3>WiFi config saved. Now switching to station mode.</h3>";
 
-String scan_network() {
+/** Scan WiFi networks, returns the number of networks copied to list */
+byte scan_network(ScannedNetwork *list, byte max) {
 	WiFi.mode(WIFI_STA);
 	WiFi.disconnect();
-	byte n = WiFi.scanNetworks();
-	String wirelessinfo;
-	if (n>32) n = 32; // limit to 32 ssids max
-	 //Maintain old format of wireless network JSON for mobile app compat
-	 wirelessinfo = "{\"ssids\":["; 
+	int n = WiFi.scanNetworks();
+	if (n<0) n = 0;
+	if (n>max) n = max;
 	for(int i=0;i<n;i++) {
-		wirelessinfo += "\"";
-		wirelessinfo += WiFi.SSID(i);
-		wirelessinfo += "\"";
-		if(i<n-1) wirelessinfo += ",\r\n";
+		// the SSID is copied from the scan result, which is freed right after
+		strncpy(list[i].ssid, WiFi.SSID(i).c_str(), sizeof(list[i].ssid)-1);
+		list[i].ssid[sizeof(list[i].ssid)-1] = 0;
+		list[i].rssi = WiFi.RSSI(i);
 	}
-	wirelessinfo += "],";
-	wirelessinfo += "\"rssis\":["; 
-	for(int i=0;i<n;i++) {
-		wirelessinfo += "\"";
-		wirelessinfo += WiFi.RSSI(i);
-		wirelessinfo += "\"";
-		if(i<n-1) wirelessinfo += ",\r\n";
-	}
-	wirelessinfo += "]}";
-	return wirelessinfo;
+	WiFi.scanDelete();
+	return n;
 }
 
 void start_network_ap(const char *ssid, const char *pass) {
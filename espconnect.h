@@ -37,7 +37,15 @@
 #include "defines.h"
 #include "htmls.h"
 
-String scan_network();
+#define SCAN_MAX_NETWORKS 32	// maximum number of networks kept from a scan
+
+/** Network found by a scan */
+struct ScannedNetwork {
+	char ssid[33];
+	int8_t rssi;
+};
+
+byte scan_network(ScannedNetwork *list, byte max);
 void start_network_ap(const char *ssid, const char *pass);
 void start_network_sta(const char *ssid, const char *pass);
 void start_network_sta_with_ap(const char *ssid, const char *pass);
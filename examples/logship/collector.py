@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Minimal log collector for testing log shipping.
+
+Accepts the batches POSTed by the controller, drops batches already received
+(same mac and seq) and appends the records to a JSON lines file.
+
+    python3 collector.py [--port 8081] [--out logs.jsonl] [--fail N]
+
+--fail N rejects the first N batches with a 503, to exercise the retries.
+"""
+
+import argparse
+import json
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+seen = set()
+failures = 0
+
+
+class Handler(BaseHTTPRequestHandler):
+    def do_POST(self):
+        global failures
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        if failures > 0:
+            failures -= 1
+            print('reject (fail on demand)')
+            self.reply(503)
+            return
+        try:
+            batch = json.loads(body)
+        except ValueError:
+            print('bad payload:', body[:80])
+            self.reply(400)
+            return
+        key = (batch.get('mac'), batch.get('seq'))
+        if key in seen:
+            print('duplicate', key)
+        else:
+            seen.add(key)
+            with open(args.out, 'a') as f:
+                for rec in batch.get('logs', []):
+                    f.write(json.dumps(rec) + '\n')
+            print('batch', key, len(batch.get('logs', [])), 'records')
+        self.reply(200)
+
+    def reply(self, status):
+        self.send_response(status)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def log_message(self, *a):
+        pass
+
+
+if __name__ == '__main__':
+    p = argparse.ArgumentParser()
+    p.add_argument('--port', type=int, default=8081)
+    p.add_argument('--out', default='logs.jsonl')
+    p.add_argument('--fail', type=int, default=0)
+    args = p.parse_args()
+    failures = args.fail
+    HTTPServer(('', args.port), Handler).serve_forever()
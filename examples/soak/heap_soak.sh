@@ -0,0 +1,83 @@
+#!/bin/bash
+# Heap fragmentation soak test for ESP8266/ESP32 controllers
+#
+# Sends status requests to a controller in a loop and samples /db, which
+# reports the free heap and the largest free heap block (maxblk). Without
+# fragmentation, maxblk stays flat over the run.
+#
+# Usage: heap_soak.sh [-m] [-p <password md5>] [-t <percent>] <host[:port]> [requests] [interval]
+#   -m          also request the MirrorLink status pages
+#   -p          password hash, also request /jc and /js
+#   -t          allowed drop of maxblk from the first sample, default 10 (%)
+#   requests    number of status requests, default 100000
+#   interval    requests between two /db samples, default 1000
+#
+# The samples are printed as CSV (requests,heap,maxblk). The exit status is 1
+# if maxblk dropped by more than the allowed percentage.
+
+MIRRORLINK=false
+PW=""
+THRESHOLD=10
+while getopts ":mp:t:" opt; do
+	case $opt in
+		m) MIRRORLINK=true ;;
+		p) PW=$OPTARG ;;
+		t) THRESHOLD=$OPTARG ;;
+		*) echo "unknown option -$OPTARG" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND-1))
+
+if [ -z "$1" ]; then
+	sed -n '8,14s/^# \{0,1\}//p' "$0" >&2
+	exit 2
+fi
+HOST=$1
+REQUESTS=${2:-100000}
+INTERVAL=${3:-1000}
+
+URLS=()
+if [ -n "$PW" ]; then
+	URLS+=("/jc?pw=$PW" "/js?pw=$PW")
+fi
+if [ "$MIRRORLINK" = true ]; then
+	URLS+=("/mlstatusgeneral" "/mlstatusradio" "/mlstatuspackets" "/mlstatusboards")
+fi
+if [ ${#URLS[@]} -eq 0 ]; then
+	URLS=("/db")
+fi
+
+# prints "heap,maxblk" from /db
+sample() {
+	curl -s --max-time 10 "http://$HOST/db" | sed -n 's/.*"heap":\([0-9]*\).*"maxblk":\([0-9]*\).*/\1,\2/p'
+}
+
+FIRST=$(sample)
+if [ -z "$FIRST" ]; then
+	echo "no heap data from http://$HOST/db (ESP8266/ESP32 firmware required)" >&2
+	exit 2
+fi
+echo "requests,heap,maxblk"
+echo "0,$FIRST"
+FIRST_BLK=${FIRST#*,}
+MIN_BLK=$FIRST_BLK
+FAILED=0
+
+for ((i=1; i<=REQUESTS; i++)); do
+	URL=${URLS[$(( (i-1) % ${#URLS[@]} ))]}
+	curl -s --max-time 10 -o /dev/null "http://$HOST$URL" || FAILED=$((FAILED+1))
+	if (( i % INTERVAL == 0 || i == REQUESTS )); then
+		S=$(sample)
+		echo "$i,$S"
+		BLK=${S#*,}
+		if [ -n "$BLK" ] && (( BLK < MIN_BLK )); then MIN_BLK=$BLK; fi
+	fi
+done
+
+LAST_BLK=${S#*,}
+echo "maxblk: first $FIRST_BLK, last $LAST_BLK, lowest $MIN_BLK, failed requests $FAILED" >&2
+if (( MIN_BLK * 100 < FIRST_BLK * (100 - THRESHOLD) )); then
+	echo "maxblk dropped by more than $THRESHOLD%" >&2
+	exit 1
+fi
+exit 0
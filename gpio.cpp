@@ -425,9 +425,15 @@ void attachInterrupt(int pin, const char* mode, void (*isr)(void)) {
 }
 #else
 
+#include "simulation.h"
+
 void pinMode(int pin, byte mode) {}
 void digitalWrite(int pin, byte value) {}
+#if defined(DEMO)
+byte digitalRead(int pin) {return sim_active() ? sim_digital_read(pin) : 0;}
+#else
 byte digitalRead(int pin) {return 0;}
+#endif
 void attachInterrupt(int pin, const char* mode, void (*isr)(void)) {}
 int gpio_fd_open(int pin, int mode) {return 0;}
 void gpio_fd_close(int fd) {}
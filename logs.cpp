@@ -0,0 +1,1468 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log functions
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "OpenSprinkler.h"
+#include "program.h"
+#include "logs.h"
+#include "server_os.h"
+
+#if defined(ARDUINO) && !defined(ESP8266) && !defined(ESP32)
+	extern SdFat sd;
+#endif
+#if !defined(ARDUINO)
+	#include <dirent.h>
+#endif
+
+extern char tmp_buffer[];
+extern OpenSprinkler os;
+extern ProgramData pd;
+extern ulong flow_count;
+extern float flow_last_gpm;
+
+#if defined(ARDUINO)
+	#if defined(ESP32)
+	char LOG_PREFIX[] = "/logs";
+	#else
+	char LOG_PREFIX[] = "/logs/";
+	#endif
+#else
+char LOG_PREFIX[] = "./logs/";
+#endif
+
+static LogRecord log_pending[LOG_PENDING_SIZE];	// records not written to the day files yet
+static byte log_npending = 0;
+
+#define ROLLUP_MAX_ROWS (MAX_NUM_STATIONS+MAX_NUM_PROGRAMS+8)
+
+static uint16_t rollup_keys[ROLLUP_MAX_ROWS];	// row keys of the month file last updated
+static uint16_t rollup_nrows = 0;
+static uint16_t rollup_cached = 0;	// month of the cached row keys (year*12+month-1), 0 if none
+
+static void rollup_update(const LogRecord *recs, byte n);
+
+static ulong log_bytes = 0;	// bytes used by the log folder
+static ulong log_first_day = 0xFFFFFFFFUL;	// no day file is older than this day
+static uint16_t log_first_month = 0xFFFF;	// no rollup file is older than this month (year*12+month-1)
+static bool log_bytes_valid = false;	// false if the usage needs a new scan of the log folder
+#if defined(LOG_SEGMENTS)
+static ulong log_pack_next = 0;	// next week to check for day files to pack, 0 to start at the oldest day
+static void log_pack(ulong curr_time);
+#endif
+
+static bool log_prune(ulong curr_time);
+static ulong log_remove(const char *fn);
+static void log_usage_sub(ulong size);
+
+/* To save RAM space, we store log type names
+ * in program memory, and each name
+ * must be strictly two characters with an ending 0
+ * so each name is 3 characters total
+ */
+static const char log_type_names[] PROGMEM =
+	"  \0"
+	"s1\0"
+	"rd\0"
+	"wl\0"
+	"fl\0"
+	"s2\0"
+	"cu\0";
+
+/** Log file handle over the file functions of each platform */
+class LogFile {
+public:
+	bool open(const char *fn, bool write);
+	ulong size();
+	ulong read(void *dst, ulong pos, ulong len);
+	void write(const void *src, ulong pos, ulong len);
+	int gets(char *buf, int maxsize);
+	void close();
+private:
+#if defined(ESP8266) || defined(ESP32)
+	File file;
+#elif defined(ARDUINO)
+	SdFile file;
+#else
+	FILE *file;
+#endif
+};
+
+/** Open a file, for writing the file is created if it does not exist */
+bool LogFile::open(const char *fn, bool write) {
+#if defined(ESP8266)
+	file = FILESYSTEM.open(fn, write ? "r+" : "r");
+	if(!file && write) file = FILESYSTEM.open(fn, "w");
+	return (bool)file;
+#elif defined(ESP32)
+	if(!FILESYSTEM.exists(fn)) {
+		if(!write) return false;
+		file = FILESYSTEM.open(fn, "w");
+	} else {
+		file = FILESYSTEM.open(fn, write ? "r+" : "r");
+	}
+	return (bool)file;
+#elif defined(ARDUINO)
+	sd.chdir("/");
+	return file.open(fn, write ? (O_CREAT | O_RDWR) : O_READ);
+#else
+	file = fopen(get_filename_fullpath(fn), write ? "rb+" : "rb");
+	if(!file && write) file = fopen(get_filename_fullpath(fn), "wb+");
+	return file != NULL;
+#endif
+}
+
+ulong LogFile::size() {
+#if defined(ESP8266) || defined(ESP32)
+	return file.size();
+#elif defined(ARDUINO)
+	return file.fileSize();
+#else
+	fseek(file, 0, SEEK_END);
+	return ftell(file);
+#endif
+}
+
+/** Read a block, returns the number of bytes read */
+ulong LogFile::read(void *dst, ulong pos, ulong len) {
+#if defined(ESP8266) || defined(ESP32)
+	#if defined(ESP32)
+	file.seek(0, SeekSet);
+	#endif
+	file.seek(pos, SeekSet);
+	return file.read((byte*)dst, len);
+#elif defined(ARDUINO)
+	file.seekSet(pos);
+	int res = file.read(dst, len);
+	return (res>0) ? res : 0;
+#else
+	fseek(file, pos, SEEK_SET);
+	return fread(dst, 1, len, file);
+#endif
+}
+
+void LogFile::write(const void *src, ulong pos, ulong len) {
+#if defined(ESP8266) || defined(ESP32)
+	#if defined(ESP32)
+	file.seek(0, SeekSet);
+	#endif
+	file.seek(pos, SeekSet);
+	file.write((const byte*)src, len);
+#elif defined(ARDUINO)
+	file.seekSet(pos);
+	file.write(src, len);
+#else
+	fseek(file, pos, SEEK_SET);
+	fwrite(src, 1, len, file);
+#endif
+}
+
+/** Read the next line (without line ending) from the current position
+ * Returns the length of the line, or -1 at the end of the file
+ */
+int LogFile::gets(char *buf, int maxsize) {
+#if defined(ESP8266) || defined(ESP32)
+	// do not use file.readBytes or readBytesUntil because it's very slow
+	int n = 0, c = 0;
+	while(n<maxsize-1 && (c=file.read())>=0) {
+		if(c=='\n') break;
+		if(c!='\r') buf[n++] = (char)c;
+	}
+	buf[n] = 0;
+	return (c<0 && n==0) ? -1 : n;
+#elif defined(ARDUINO)
+	int n = file.fgets(buf, maxsize);
+	return (n>0) ? n : -1;
+#else
+	if(!fgets(buf, maxsize, file)) return -1;
+	return strlen(buf);
+#endif
+}
+
+void LogFile::close() {
+#if defined(ESP8266) || defined(ESP32) || defined(ARDUINO)
+	file.close();
+#else
+	fclose(file);
+#endif
+}
+
+/** Generate log file name
+ * Log files will be named /logs/xxxxx.bin where xxxxx is the day in epoch time.
+ * Text log files (/logs/xxxxx.txt) of earlier firmwares are converted on first access.
+ */
+static void make_logfile_name(char *fn, ulong day, bool text) {
+	strcpy(fn, LOG_PREFIX);
+	#if defined(ESP32)
+	strcat_P(fn, PSTR("/"));
+	#endif
+	ultoa(day, fn+strlen(fn), 10);
+	if(text) strcat_P(fn, PSTR(".txt"));
+	else strcat_P(fn, PSTR(".bin"));
+}
+
+/** Create the log folder if it doesn't exist yet */
+static bool prepare_log_folder() {
+#if defined(ESP8266) || defined(ESP32)
+	#if defined(ESP32) && (defined(USE_LITTLEFS) || defined(USE_FFAT))
+	// SPIFFS has no folders, and LittleFS on ESP8266 creates them when a file is created
+	if(!FILESYSTEM.exists(LOG_PREFIX)) return FILESYSTEM.mkdir(LOG_PREFIX);
+	#endif
+	return true;
+#elif defined(ARDUINO)
+	sd.chdir("/");
+	if (sd.chdir(LOG_PREFIX) == false) {
+		// create dir if it doesn't exist yet
+		if (sd.mkdir(LOG_PREFIX) == false) {
+			return false;
+		}
+	}
+	return true;
+#else
+	struct stat st;
+	if(stat(get_filename_fullpath(LOG_PREFIX), &st)) {
+		if(mkdir(get_filename_fullpath(LOG_PREFIX), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH)) {
+			return false;
+		}
+	}
+	return true;
+#endif
+}
+
+static void log_header_init(LogFileHeader *h) {
+	memset(h, 0, sizeof(LogFileHeader));
+	h->magic = LOG_MAGIC;
+	h->version = LOG_VERSION;
+	h->record_size = sizeof(LogRecord);
+	h->tmin = 0xFFFFFFFFUL;
+}
+
+static void log_header_add(LogFileHeader *h, const LogRecord *rec) {
+	if(rec->type<LOG_NTYPES) h->counts[rec->type]++;
+	if(rec->endtime<h->tmin) h->tmin = rec->endtime;
+	if(rec->endtime>h->tmax) h->tmax = rec->endtime;
+}
+
+static ulong log_header_total(const LogFileHeader *h) {
+	ulong total = 0;
+	for(byte t=0;t<LOG_NTYPES;t++) total += h->counts[t];
+	return total;
+}
+
+/** Read the header of a day file
+ * Returns the number of records, or -1 if this is not a valid day file.
+ * A partially written record at the end of the file is not counted.
+ */
+static long log_header_read(LogFile &file, LogFileHeader *h) {
+	if(file.read(h, 0, sizeof(LogFileHeader)) != sizeof(LogFileHeader)) return -1;
+	if(h->magic!=LOG_MAGIC || h->version!=LOG_VERSION || h->record_size!=sizeof(LogRecord)) return -1;
+	return (file.size()-sizeof(LogFileHeader)) / sizeof(LogRecord);
+}
+
+/** Re-build the header index from the records
+ * This is needed if a record was appended but the header was not updated
+ */
+static void log_header_rebuild(LogFile &file, LogFileHeader *h, ulong n) {
+	LogRecord recs[LOG_BLOCK_RECORDS];
+	log_header_init(h);
+	for(ulong i=0;i<n;i+=LOG_BLOCK_RECORDS) {
+		ulong k = (n-i<LOG_BLOCK_RECORDS) ? n-i : LOG_BLOCK_RECORDS;
+		file.read(recs, sizeof(LogFileHeader)+i*sizeof(LogRecord), k*sizeof(LogRecord));
+		for(ulong j=0;j<k;j++) log_header_add(h, recs+j);
+	}
+}
+
+/** Parse a text log record
+ * Station records are in the form of [pid,sid,dur,end] or [pid,sid,dur,end,gpm]
+ * and other records are in the form of [value,"xx",dur,end]
+ */
+static bool log_parse(char *s, LogRecord *rec) {
+	memset(rec, 0, sizeof(LogRecord));
+	if(*s++!='[') return false;
+	ulong v = strtoul(s, &s, 10);
+	if(*s++!=',') return false;
+	if(*s=='"') {
+		byte t;
+		for(t=1;t<LOG_NTYPES;t++) {
+			if(pgm_read_byte(log_type_names+t*3)==s[1] && pgm_read_byte(log_type_names+t*3+1)==s[2]) break;
+		}
+		if(t==LOG_NTYPES || s[3]!='"' || s[4]!=',') return false;
+		rec->type = t;
+		rec->count = v;
+		s += 5;
+	} else {
+		rec->type = LOGDATA_STATION;
+		rec->pid = v;
+		rec->sid = strtoul(s, &s, 10);
+		if(*s++!=',') return false;
+	}
+	rec->duration = strtoul(s, &s, 10);
+	if(*s++!=',') return false;
+	rec->endtime = strtoul(s, &s, 10);
+	if(*s==',' && rec->type==LOGDATA_STATION) {
+		rec->has_flow = 1;
+		rec->gpm = strtod(s+1, &s);
+	}
+	return *s==']';
+}
+
+/** Convert a text day file to a binary day file
+ * The header is written last and the text file is removed only once all
+ * records are converted, so an interrupted conversion starts over.
+ * Returns true if a text day file was converted.
+ */
+static bool log_import(ulong day) {
+	char fn[LOG_FILENAME_SIZE];
+	make_logfile_name(fn, day, true);
+	if(!file_exists(fn)) return false;
+
+	char bn[LOG_FILENAME_SIZE];
+	make_logfile_name(bn, day, false);
+	remove_file(bn);
+	LogFile in, out;
+	if(!in.open(fn, false)) return false;
+	if(!out.open(bn, true)) {
+		in.close();
+		return false;
+	}
+	LogFileHeader h;
+	memset(&h, 0, sizeof(h));
+	out.write(&h, 0, sizeof(h));
+	log_header_init(&h);
+
+	LogRecord recs[LOG_BLOCK_RECORDS];
+	ulong pos = sizeof(h);
+	byte k = 0;
+	while(in.gets(tmp_buffer, TMP_BUFFER_SIZE)>=0) {
+		if(!log_parse(tmp_buffer, recs+k)) continue;
+		log_header_add(&h, recs+k);
+		if(++k==LOG_BLOCK_RECORDS) {
+			out.write(recs, pos, k*sizeof(LogRecord));
+			rollup_update(recs, k);
+			pos += k*sizeof(LogRecord);
+			k = 0;
+		}
+	}
+	if(k) {
+		out.write(recs, pos, k*sizeof(LogRecord));
+		rollup_update(recs, k);
+	}
+	out.write(&h, 0, sizeof(h));
+	out.close();
+	in.close();
+	remove_file(fn);
+	log_bytes_valid = false;
+	return true;
+}
+
+/** Open a day file and read its header
+ * A text day file is converted first. For writing, a new day file is
+ * started if there is no valid one.
+ * Returns the number of records, or -1 if the file could not be opened.
+ */
+static long log_open(LogFile &file, ulong day, bool write, LogFileHeader *h) {
+	char fn[LOG_FILENAME_SIZE];
+	make_logfile_name(fn, day, false);
+	long n;
+	if(file.open(fn, write)) {
+		if((n=log_header_read(file, h))>=0) return n;
+		file.close();
+	}
+	if(log_import(day) && file.open(fn, write)) {
+		if((n=log_header_read(file, h))>=0) return n;
+		file.close();
+	}
+	if(!write) return -1;
+
+	remove_file(fn);
+	if(!file.open(fn, true)) return -1;
+	log_header_init(h);
+	file.write(h, 0, sizeof(LogFileHeader));
+	log_bytes += sizeof(LogFileHeader);
+	if(day<log_first_day) log_first_day = day;
+	return 0;
+}
+
+/** Append records to a day file
+ * The records are written before the header, and a header that doesn't
+ * match the records is re-built.
+ */
+static void log_append(ulong day, const LogRecord *recs, byte n) {
+	if(!prepare_log_folder()) return;
+	LogFile file;
+	LogFileHeader h;
+	long count = log_open(file, day, true, &h);
+	if(count<0) return;
+	if(log_header_total(&h)!=(ulong)count) log_header_rebuild(file, &h, count);
+	file.write(recs, sizeof(h)+count*sizeof(LogRecord), n*sizeof(LogRecord));
+	log_bytes += n*sizeof(LogRecord);
+	for(byte i=0;i<n;i++) log_header_add(&h, recs+i);
+	file.write(&h, 0, sizeof(h));
+	file.close();
+}
+
+#if defined(LOG_SEGMENTS)
+/** LZSS encoder of segment records (see logs.h)
+ * The buffer keeps the last LZ_WINDOW encoded bytes followed by the bytes
+ * still to be encoded. Matches are searched in the whole window.
+ */
+class LogPacker {
+public:
+	void begin(LogFile *f, ulong pos);
+	void put(const LogRecord *rec);
+	ulong finish();	// returns the compressed size
+private:
+	void encode(uint16_t limit);
+	void item(bool match, byte a, byte b);
+	void flush_group();
+	LogFile *file;
+	ulong start, pos;
+	uint32_t prev;	// end time of the previous record
+	byte buf[LZ_WINDOW+2*LZ_MAX_MATCH];
+	uint16_t n, i;	// number of bytes in the buffer, position of the next byte to encode
+	byte group[1+2*8];	// flag byte and up to 8 items
+	byte glen, nitems;
+};
+
+void LogPacker::begin(LogFile *f, ulong p) {
+	file = f;
+	start = pos = p;
+	prev = 0;
+	n = i = 0;
+	group[0] = 0;
+	glen = 1;
+	nitems = 0;
+}
+
+void LogPacker::flush_group() {
+	if(!nitems) return;
+	file->write(group, pos, glen);
+	pos += glen;
+	group[0] = 0;
+	glen = 1;
+	nitems = 0;
+}
+
+void LogPacker::item(bool match, byte a, byte b) {
+	if(match) {
+		group[0] |= (1<<nitems);
+		group[glen++] = a;
+		group[glen++] = b;
+	} else {
+		group[glen++] = a;
+	}
+	if(++nitems==8) flush_group();
+}
+
+/** Encode the buffer up to position limit (a match may go beyond) */
+void LogPacker::encode(uint16_t limit) {
+	while(i<limit) {
+		uint16_t best = 0, dist = 0;
+		uint16_t maxlen = (n-i<LZ_MAX_MATCH) ? n-i : LZ_MAX_MATCH;
+		uint16_t j = (i>LZ_WINDOW) ? i-LZ_WINDOW : 0;
+		for(;j<i && maxlen>=LZ_MIN_MATCH;j++) {
+			if(buf[j]!=buf[i] || buf[j+best]!=buf[i+best]) continue;
+			uint16_t len = 1;
+			while(len<maxlen && buf[j+len]==buf[i+len]) len++;
+			if(len>best) {
+				best = len;
+				dist = i-j;
+				if(best==maxlen) break;
+			}
+		}
+		if(best>=LZ_MIN_MATCH) {
+			item(true, dist-1, best-LZ_MIN_MATCH);
+			i += best;
+		} else {
+			item(false, buf[i], 0);
+			i++;
+		}
+	}
+}
+
+void LogPacker::put(const LogRecord *rec) {
+	if(n+sizeof(LogRecord)>sizeof(buf)) {
+		// encode what has a full look-ahead, then drop the bytes out of the window
+		encode(n-LZ_MAX_MATCH);
+		uint16_t drop = i-LZ_WINDOW;
+		memmove(buf, buf+drop, n-drop);
+		n -= drop;
+		i -= drop;
+	}
+	LogRecord r = *rec;
+	r.endtime -= prev;
+	prev = rec->endtime;
+	memcpy(buf+n, &r, sizeof(r));
+	n += sizeof(r);
+}
+
+ulong LogPacker::finish() {
+	encode(n);
+	flush_group();
+	return pos-start;
+}
+
+/** LZSS decoder of segment records, decodes one record at a time */
+class LogUnpacker {
+public:
+	void begin(LogFile *f, ulong pos, ulong size);
+	bool get(LogRecord *rec);
+private:
+	int next_in();
+	int next_out();
+	LogFile *file;
+	ulong pos, end;
+	uint32_t prev;	// end time of the previous record
+	byte ring[LZ_WINDOW];	// the last LZ_WINDOW decoded bytes
+	byte rpos;
+	byte in[LZ_IN_SIZE];
+	byte nin, iin;
+	byte flags, nitems;
+	byte mdist;	// distance and remaining length of the current match
+	uint16_t mlen;
+};
+
+void LogUnpacker::begin(LogFile *f, ulong p, ulong size) {
+	file = f;
+	pos = p;
+	end = p+size;
+	prev = 0;
+	rpos = 0;
+	nin = iin = 0;
+	nitems = 0;
+	mlen = 0;
+}
+
+int LogUnpacker::next_in() {
+	if(iin==nin) {
+		if(pos>=end) return -1;
+		ulong k = (end-pos<LZ_IN_SIZE) ? end-pos : LZ_IN_SIZE;
+		nin = file->read(in, pos, k);
+		iin = 0;
+		pos += k;
+		if(!nin) return -1;
+	}
+	return in[iin++];
+}
+
+int LogUnpacker::next_out() {
+	int c;
+	if(mlen) {
+		mlen--;
+		c = ring[(byte)(rpos-mdist)];
+	} else {
+		if(!nitems) {
+			if((c=next_in())<0) return -1;
+			flags = c;
+			nitems = 8;
+		}
+		bool match = flags&1;
+		flags >>= 1;
+		nitems--;
+		if(match) {
+			int d = next_in();
+			int l = next_in();
+			if(l<0) return -1;
+			mdist = d+1;
+			mlen = l+LZ_MIN_MATCH-1;
+			c = ring[(byte)(rpos-mdist)];
+		} else {
+			if((c=next_in())<0) return -1;
+		}
+	}
+	ring[rpos++] = c;
+	return c;
+}
+
+bool LogUnpacker::get(LogRecord *rec) {
+	byte *p = (byte*)rec;
+	for(byte k=0;k<sizeof(LogRecord);k++) {
+		int c = next_out();
+		if(c<0) return false;
+		p[k] = c;
+	}
+	rec->endtime += prev;
+	prev = rec->endtime;
+	return true;
+}
+
+/** Generate segment file name: /logs/xxxxx.seg where xxxxx is the first day of the week,
+ * or /logs/xxxxx.tmp while it is being written
+ */
+static void make_segment_name(char *fn, ulong day, bool tmp) {
+	make_logfile_name(fn, day, false);
+	strcpy_P(fn+strlen(fn)-4, tmp ? PSTR(".tmp") : PSTR(".seg"));
+}
+
+/** Read and check the header of a segment */
+static bool log_segment_read(LogFile &file, LogSegmentHeader *h) {
+	if(file.read(h, 0, sizeof(LogSegmentHeader)) != sizeof(LogSegmentHeader)) return false;
+	if(h->magic!=LOG_SEG_MAGIC || h->version!=LOG_VERSION || h->record_size!=sizeof(LogRecord)) return false;
+	return file.size() >= sizeof(LogSegmentHeader)+h->csize;
+}
+
+static void log_segment_add(LogSegmentHeader *h, byte k, const LogRecord *rec) {
+	h->days[k]++;
+	if(rec->type<LOG_NTYPES) h->counts[rec->type]++;
+	if(rec->endtime<h->tmin) h->tmin = rec->endtime;
+	if(rec->endtime>h->tmax) h->tmax = rec->endtime;
+}
+
+/** Open the segment of a week for reading
+ * Returns false if there is no valid segment
+ */
+static bool log_segment_open(LogFile &file, ulong week, LogSegmentHeader *h) {
+	char fn[LOG_FILENAME_SIZE];
+	make_segment_name(fn, week*LOG_SEG_DAYS, false);
+	if(!file.open(fn, false)) return false;
+	if(log_segment_read(file, h)) return true;
+	file.close();
+	return false;
+}
+
+/** Replace the segment of a week with the complete temporary segment,
+ * once the day files of the week are removed
+ */
+static void log_segment_commit(ulong d0, bool empty) {
+	char fn[LOG_FILENAME_SIZE], tn[LOG_FILENAME_SIZE];
+	for(byte k=0;k<LOG_SEG_DAYS;k++) {
+		make_logfile_name(fn, d0+k, false);
+		log_usage_sub(log_remove(fn));
+		make_logfile_name(fn, d0+k, true);
+		log_usage_sub(log_remove(fn));
+	}
+	make_segment_name(fn, d0, false);
+	make_segment_name(tn, d0, true);
+	log_usage_sub(log_remove(fn));
+	if(empty) log_usage_sub(log_remove(tn));
+	else {
+		rename_file(tn, fn);
+		// the week may start before its oldest day file
+		if(d0<log_first_day) log_first_day = d0;
+	}
+}
+
+/** Pack the day files of a week into its segment
+ * Records of an existing segment are kept, in front of the records of
+ * day files written since (e.g. after a clock change).
+ * skip: records of this day are left out (to delete a single day)
+ * Returns true if the segment was written.
+ */
+static bool log_pack_week(ulong week, ulong skip) {
+	ulong d0 = week*LOG_SEG_DAYS;
+	char fn[LOG_FILENAME_SIZE], tn[LOG_FILENAME_SIZE];
+	make_segment_name(tn, d0, true);
+	LogFile out;
+	LogSegmentHeader h;
+	if(out.open(tn, false)) {
+		bool complete = log_segment_read(out, &h);
+		out.close();
+		if(complete) {
+			log_segment_commit(d0, false);
+			log_bytes_valid = false;
+			return true;
+		}
+		remove_file(tn);
+	}
+
+	LogFile seg;
+	LogSegmentHeader sh;
+	make_segment_name(fn, d0, false);
+	bool has_seg = false;
+	if(seg.open(fn, false)) {
+		has_seg = log_segment_read(seg, &sh);
+		if(!has_seg) seg.close();
+	}
+	bool work = has_seg && skip>=d0 && skip<d0+LOG_SEG_DAYS;
+	for(byte k=0;k<LOG_SEG_DAYS && !work;k++) {
+		make_logfile_name(fn, d0+k, false);
+		if(file_exists(fn)) work = true;
+		make_logfile_name(fn, d0+k, true);
+		if(file_exists(fn)) work = true;
+	}
+	if(!work) {
+		if(has_seg) seg.close();
+		return false;
+	}
+
+	if(!out.open(tn, true)) {
+		if(has_seg) seg.close();
+		return false;
+	}
+	memset(&h, 0, sizeof(h));
+	out.write(&h, 0, sizeof(h));
+	h.magic = LOG_SEG_MAGIC;
+	h.version = LOG_VERSION;
+	h.record_size = sizeof(LogRecord);
+	h.day = d0;
+	h.tmin = 0xFFFFFFFFUL;
+
+	static LogPacker packer;	// kept off the stack for its look-ahead buffer
+	LogUnpacker unpacker;
+	packer.begin(&out, sizeof(h));
+	if(has_seg) unpacker.begin(&seg, sizeof(sh), sh.csize);
+	LogRecord recs[LOG_BLOCK_RECORDS];
+	LogFileHeader dh;
+	bool ok = true;
+	for(byte k=0;k<LOG_SEG_DAYS && ok;k++) {
+		ulong day = d0+k;
+		for(uint16_t c=0;has_seg && c<sh.days[k];c++) {
+			if(!unpacker.get(recs)) {
+				ok = false;
+				break;
+			}
+			if(day==skip) continue;
+			packer.put(recs);
+			log_segment_add(&h, k, recs);
+		}
+		if(day==skip) continue;
+		LogFile file;
+		long n = log_open(file, day, false, &dh);
+		for(long i=0;i<n;i+=LOG_BLOCK_RECORDS) {
+			ulong m = (n-i<LOG_BLOCK_RECORDS) ? n-i : LOG_BLOCK_RECORDS;
+			if(file.read(recs, sizeof(dh)+i*sizeof(LogRecord), m*sizeof(LogRecord)) != m*sizeof(LogRecord)) break;
+			for(ulong j=0;j<m;j++) {
+				packer.put(recs+j);
+				log_segment_add(&h, k, recs+j);
+			}
+		}
+		if(n>=0) file.close();
+	}
+	if(has_seg) seg.close();
+	if(!ok) {
+		// a damaged segment is left as it is
+		out.close();
+		remove_file(tn);
+		return false;
+	}
+	h.csize = packer.finish();
+	out.write(&h, 0, sizeof(h));
+	out.close();
+	log_bytes += sizeof(h)+h.csize;
+	ulong total = 0;
+	for(byte k=0;k<LOG_SEG_DAYS;k++) total += h.days[k];
+	log_segment_commit(d0, total==0);
+	return true;
+}
+#endif
+
+/** write run record to log */
+void write_log(byte type, ulong curr_time) {
+
+	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
+
+	LogRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.endtime = curr_time;
+
+	if(type == LOGDATA_STATION) {
+		rec.pid = pd.lastrun.program;
+		rec.sid = pd.lastrun.station;
+		rec.duration = pd.lastrun.duration;
+		if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
+			// RAH implementation of flow sensor
+			rec.has_flow = 1;
+			rec.gpm = flow_last_gpm;
+		}
+	} else {
+		if(type==LOGDATA_FLOWSENSE) {
+			rec.count = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
+		}
+		switch(type) {
+			case LOGDATA_FLOWSENSE:
+				rec.duration = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
+				break;
+			case LOGDATA_SENSOR1:
+				rec.duration = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
+				break;
+			case LOGDATA_SENSOR2:
+				rec.duration = (curr_time>os.sensor2_active_lasttime)?(curr_time-os.sensor2_active_lasttime):0;
+				break;
+			case LOGDATA_RAINDELAY:
+				rec.duration = (curr_time>os.raindelay_on_lasttime)?(curr_time-os.raindelay_on_lasttime):0;
+				break;
+			case LOGDATA_WATERLEVEL:
+				rec.duration = os.iopts[IOPT_WATER_PERCENTAGE];
+				break;
+		}
+	}
+	if(log_npending==LOG_PENDING_SIZE) log_flush();
+	log_pending[log_npending++] = rec;
+	if(log_npending>=LOG_FLUSH_WATERMARK) log_flush();
+}
+
+/** Write pending records to the day files
+ * Consecutive records of the same day are appended in one batch
+ */
+void log_flush() {
+	byte i = 0;
+	while(i<log_npending) {
+		ulong day = log_pending[i].endtime / 86400;
+		byte j = i+1;
+		while(j<log_npending && log_pending[j].endtime/86400==day) j++;
+		log_append(day, log_pending+i, j-i);
+		i = j;
+	}
+	rollup_update(log_pending, log_npending);
+	log_npending = 0;
+}
+
+/** Number of records not written to the day files yet */
+byte log_pending_count() {
+	return log_npending;
+}
+
+/** Flush pending records if no program is running, or if the oldest
+ * pending record has waited for LOG_FLUSH_DELAY seconds
+ * When no program is running, old log files are also pruned, or else
+ * an old week is packed into a segment.
+ * This is called once per second from the main loop.
+ */
+void log_flush_idle(ulong curr_time) {
+	if(os.status.program_busy) {
+		if(log_npending && curr_time>=log_pending[0].endtime+LOG_FLUSH_DELAY) log_flush();
+		return;
+	}
+	if(log_npending) log_flush();
+	#if defined(LOG_SEGMENTS)
+	if(!log_prune(curr_time)) log_pack(curr_time);
+	#else
+	log_prune(curr_time);
+	#endif
+}
+
+static bool log_scan_record(const LogRecord *rec, ulong *idx, ulong skipto, byte typemask, LogCallback callback) {
+	if((*idx)++<skipto) return true;
+	if(rec->type>=LOG_NTYPES || !(typemask&(1<<rec->type))) return true;
+	return callback(rec);
+}
+
+/** Scan the records of a range of days
+ * start, end: first and last day (epoch time / 86400)
+ * typemask: bit t selects records of type t
+ * cursor: if not NULL and within the range, the scan resumes at the cursor,
+ *   and it is set to the record at which the callback stopped the scan
+ * The records of a day are numbered in scan order, all types included,
+ * so a cursor stays valid when records are flushed or packed.
+ * Day files and segments whose header index has no records of the
+ * selected types are skipped without reading their records.
+ * Returns false if the callback stopped the scan.
+ */
+bool log_scan(ulong start, ulong end, byte typemask, LogCallback callback, LogCursor *cursor) {
+	if(!typemask) return true;
+	ulong skipto = 0;	// number of the first record to scan on the start day
+	if(cursor && cursor->day>=start && cursor->day<=end) {
+		start = cursor->day;
+		skipto = cursor->index;
+	}
+	LogFileHeader h;
+	LogRecord recs[LOG_BLOCK_RECORDS];
+	bool more = true;
+	ulong day, idx = 0;	// number of the next record of the day
+#if defined(LOG_SEGMENTS)
+	LogFile seg;
+	LogSegmentHeader sh;
+	LogUnpacker unpacker;
+	bool has_seg = false;	// the segment of the week has a valid header
+	bool seg_open = false;	// and is being decoded
+#endif
+	for(day=start;day<=end;day++,skipto=0) {
+		idx = 0;
+#if defined(LOG_SEGMENTS)
+		if(day==start || day%LOG_SEG_DAYS==0) {
+			if(seg_open) seg.close();
+			has_seg = log_segment_open(seg, day/LOG_SEG_DAYS, &sh);
+			seg_open = false;
+			if(has_seg) {
+				for(byte t=0;t<LOG_NTYPES;t++) {
+					if(sh.counts[t] && (typemask&(1<<t))) seg_open = true;
+				}
+				if(!seg_open) seg.close();
+			}
+			if(seg_open) {
+				unpacker.begin(&seg, sizeof(sh), sh.csize);
+				// skip the records of the days before the start day
+				ulong skip = 0;
+				for(ulong d=sh.day;d<day;d++) skip += sh.days[d-sh.day];
+				for(ulong c=0;c<skip;c++) {
+					if(!unpacker.get(recs)) {
+						seg.close();
+						seg_open = false;
+						break;
+					}
+				}
+			}
+		}
+		// packed records are older than the records of a day file written since
+		if(has_seg) {
+			uint16_t c = sh.days[day-sh.day];
+			if(!seg_open) idx += c;
+			for(uint16_t i=0;seg_open && more && i<c;i++) {
+				if(!unpacker.get(recs)) {
+					seg.close();
+					seg_open = false;
+					break;
+				}
+				more = log_scan_record(recs, &idx, skipto, typemask, callback);
+			}
+			if(!more) break;
+		}
+#endif
+		LogFile file;
+		long n = log_open(file, day, false, &h);
+		long i = 0;
+		if(n>=0 && log_header_total(&h)==(ulong)n) {
+			byte mask = 0;
+			for(byte t=0;t<LOG_NTYPES;t++) if(h.counts[t]) mask |= (1<<t);
+			if(!(mask&typemask)) i = n;
+		}
+		// records before the cursor are not read
+		if(i<n && skipto>idx) i = (skipto-idx<(ulong)n) ? skipto-idx : n;
+		idx += i;
+		for(;i<n && more;i+=LOG_BLOCK_RECORDS) {
+			ulong k = (n-i<LOG_BLOCK_RECORDS) ? n-i : LOG_BLOCK_RECORDS;
+			if(file.read(recs, sizeof(h)+i*sizeof(LogRecord), k*sizeof(LogRecord)) != k*sizeof(LogRecord)) break;
+			for(ulong j=0;j<k && more;j++) more = log_scan_record(recs+j, &idx, skipto, typemask, callback);
+		}
+		if(n>=0) file.close();
+		if(!more) break;
+		// pending records are newer than the records of the day file
+		for(byte p=0;p<log_npending && more;p++) {
+			if(log_pending[p].endtime/86400!=day) continue;
+			more = log_scan_record(log_pending+p, &idx, skipto, typemask, callback);
+		}
+		if(!more) break;
+	}
+#if defined(LOG_SEGMENTS)
+	if(seg_open) seg.close();
+#endif
+	if(!more && cursor) {
+		cursor->day = day;
+		cursor->index = idx-1;
+	}
+	return more;
+}
+
+/** Record types selected by a type name (see /jl)
+ * If no type is given, all records except water level and flow records are selected
+ */
+byte log_type_mask(const char *type) {
+	if(!type) return LOG_TYPEMASK_ALL & ~((1<<LOGDATA_WATERLEVEL)|(1<<LOGDATA_FLOWSENSE));
+	for(byte t=1;t<LOG_NTYPES;t++) {
+		if(type[0]==pgm_read_byte(log_type_names+t*3) && type[1]==pgm_read_byte(log_type_names+t*3+1)) return (1<<t);
+	}
+	return 0;
+}
+
+/** Render a record in the JSON array form of the text logs */
+void log_render(const LogRecord *rec, BufferFiller &bf) {
+	if(rec->type == LOGDATA_STATION) {
+		bf.emit_p(PSTR("[$D,$D,"), rec->pid, rec->sid);
+	} else {
+		bf.emit_p(PSTR("[$L,\"$F\","), (ulong)rec->count, log_type_names+rec->type*3);
+	}
+	bf.emit_p(PSTR("$L,$L"), (ulong)rec->duration, (ulong)rec->endtime);
+	if(rec->type==LOGDATA_STATION && rec->has_flow) {
+		char gpm[12];
+		#if defined(ARDUINO)
+		dtostrf(rec->gpm,5,2,gpm);
+		#else
+		snprintf(gpm, sizeof(gpm), "%5.2f", rec->gpm);
+		#endif
+		bf.emit_p(PSTR(",$S"), gpm);
+	}
+	bf.emit_p(PSTR("]"));
+}
+
+/** Convert a day (epoch time / 86400) to a civil date */
+static void log_civil_date(ulong day, uint16_t *year, byte *month, byte *mday) {
+	ulong z = day + 719468L;	// days since 0000-03-01
+	ulong era = z / 146097L;
+	ulong doe = z - era*146097L;	// day of the 400-year era
+	ulong yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	ulong doy = doe - (365*yoe + yoe/4 - yoe/100);	// day of the year, starting on March 1st
+	ulong mp = (5*doy + 2) / 153;
+	*mday = doy - (153*mp + 2)/5 + 1;
+	*month = (mp<10) ? mp+3 : mp-9;
+	*year = yoe + era*400 + (*month<=2);
+}
+
+/** Convert a civil date to a day (epoch time / 86400) */
+static ulong log_civil_day(uint16_t year, byte month, byte mday) {
+	if(month<=2) year--;
+	ulong era = year / 400;
+	ulong yoe = year - era*400;
+	ulong doy = (153*(month>2 ? month-3 : month+9) + 2)/5 + mday-1;
+	ulong doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097L + doe - 719468L;
+}
+
+/** First day of the month that is offset months away from the month of the given day */
+ulong rollup_month_start(ulong day, int offset) {
+	uint16_t year;
+	byte month, mday;
+	log_civil_date(day, &year, &month, &mday);
+	long ym = (long)year*12 + month-1 + offset;
+	return log_civil_day(ym/12, ym%12+1, 1);
+}
+
+/** Generate rollup file name
+ * Rollup files will be named /logs/yyyymm.sum
+ */
+static void make_rollup_name(char *fn, uint16_t year, byte month) {
+	strcpy(fn, LOG_PREFIX);
+	#if defined(ESP32)
+	strcat_P(fn, PSTR("/"));
+	#endif
+	ultoa((ulong)year*100+month, fn+strlen(fn), 10);
+	strcat_P(fn, PSTR(".sum"));
+}
+
+/** Find the row of a key in the open month file, a new row is appended
+ * if the key has none. Returns the row index, or -1 if there is no room.
+ */
+static long rollup_row(LogFile &file, uint16_t key) {
+	for(uint16_t i=0;i<rollup_nrows;i++) {
+		if(rollup_keys[i]==key) return i;
+	}
+	if(rollup_nrows>=ROLLUP_MAX_ROWS) return -1;
+	// a partially written row is not counted, and is overwritten by the next new row
+	ulong pos = (ulong)rollup_nrows*sizeof(RollupRow);
+	uint16_t head[2] = {key, 0};
+	RollupEntry e;
+	memset(&e, 0, sizeof(e));
+	file.write(head, pos, sizeof(head));
+	for(byte i=0;i<32;i++) file.write(&e, pos+sizeof(head)+i*sizeof(e), sizeof(e));
+	rollup_keys[rollup_nrows] = key;
+	log_bytes += sizeof(RollupRow);
+	return rollup_nrows++;
+}
+
+static void rollup_add_entry(LogFile &file, long row, byte idx, ulong seconds, ulong volume) {
+	RollupEntry e;
+	ulong pos = row*sizeof(RollupRow) + 2*sizeof(uint16_t) + idx*sizeof(RollupEntry);
+	file.read(&e, pos, sizeof(e));
+	e.seconds += seconds;
+	e.volume += volume;
+	e.runs++;
+	file.write(&e, pos, sizeof(e));
+}
+
+/** Add a run to the month total and the day entry of a key */
+static void rollup_add(LogFile &file, uint16_t key, byte mday, ulong seconds, ulong volume) {
+	long row = rollup_row(file, key);
+	if(row<0) return;
+	rollup_add_entry(file, row, 0, seconds, volume);
+	rollup_add_entry(file, row, mday, seconds, volume);
+}
+
+/** Add station and flow records to the rollups */
+static void rollup_update(const LogRecord *recs, byte n) {
+	if(!prepare_log_folder()) return;
+	LogFile file;
+	uint16_t opened = 0;
+	char fn[LOG_FILENAME_SIZE];
+	for(byte i=0;i<n;i++) {
+		const LogRecord *rec = recs+i;
+		if(rec->type!=LOGDATA_STATION && rec->type!=LOGDATA_FLOWSENSE) continue;
+		uint16_t year;
+		byte month, mday;
+		log_civil_date(rec->endtime/86400, &year, &month, &mday);
+		uint16_t ym = year*12 + month-1;
+		if(ym!=opened) {
+			if(opened) file.close();
+			opened = 0;
+			make_rollup_name(fn, year, month);
+			if(!file.open(fn, true)) continue;
+			opened = ym;
+			// re-load the row keys if the file is not the one cached
+			ulong nrows = file.size()/sizeof(RollupRow);
+			if(!nrows && ym<log_first_month) log_first_month = ym;
+			if(rollup_cached!=ym || nrows!=rollup_nrows) {
+				if(nrows>ROLLUP_MAX_ROWS) nrows = ROLLUP_MAX_ROWS;
+				for(rollup_nrows=0;rollup_nrows<nrows;rollup_nrows++) {
+					file.read(rollup_keys+rollup_nrows, (ulong)rollup_nrows*sizeof(RollupRow), sizeof(uint16_t));
+				}
+				rollup_cached = ym;
+			}
+		}
+		if(rec->type==LOGDATA_STATION) {
+			ulong volume = rec->has_flow ? (ulong)(rec->gpm*rec->duration/60*100+0.5) : 0;
+			rollup_add(file, rec->sid, mday, rec->duration, volume);
+			rollup_add(file, ROLLUP_KEY_PROGRAM|rec->pid, mday, rec->duration, volume);
+		} else {
+			rollup_add(file, ROLLUP_KEY_FLOW, mday, rec->duration, rec->count*100);
+		}
+	}
+	if(opened) file.close();
+}
+
+/** Scan the rollups of a day, or of the month of a day
+ * Pending records are written first so that they are included.
+ */
+void rollup_scan(ulong day, bool month, RollupCallback callback) {
+	log_flush();
+	uint16_t year;
+	byte mon, mday;
+	log_civil_date(day, &year, &mon, &mday);
+	char fn[LOG_FILENAME_SIZE];
+	make_rollup_name(fn, year, mon);
+	LogFile file;
+	if(!file.open(fn, false)) return;
+	ulong nrows = file.size()/sizeof(RollupRow);
+	byte idx = month ? 0 : mday;
+	uint16_t key;
+	RollupEntry e;
+	for(ulong i=0;i<nrows;i++) {
+		ulong pos = i*sizeof(RollupRow);
+		if(file.read(&key, pos, sizeof(key))!=sizeof(key)) break;
+		if(file.read(&e, pos+2*sizeof(uint16_t)+idx*sizeof(e), sizeof(e))!=sizeof(e)) break;
+		if(e.runs) callback(key, &e);
+	}
+	file.close();
+}
+
+/** Log folder listing callback, gets the file name and size of each file */
+typedef void (*LogDirCallback)(const char *fn, ulong size);
+
+/** List the files of the log folder, up to max files
+ * File names are given in the form used by remove_file()
+ * Returns the number of files listed.
+ */
+static uint16_t log_list(LogDirCallback callback, uint16_t max) {
+	uint16_t n = 0;
+	char fn[LOG_FILENAME_SIZE];
+#if defined(ESP8266)
+	Dir dir = FILESYSTEM.openDir(LOG_PREFIX);
+	while(n<max && dir.next()) {
+		if(dir.fileName().length()>=LOG_FILENAME_SIZE) continue;
+		strcpy(fn, dir.fileName().c_str());
+		callback(fn, dir.fileSize());
+		n++;
+	}
+#elif defined(ESP32)
+	File root = FILESYSTEM.open(LOG_PREFIX);
+	if(!root) return 0;
+	File file = root.openNextFile();
+	while(n<max && file) {
+		// depending on the core version, the name may or may not include the folder
+		const char *name = file.name();
+		if(name[0]=='/') fn[0] = 0;
+		else {
+			strcpy(fn, LOG_PREFIX);
+			strcat_P(fn, PSTR("/"));
+		}
+		ulong size = file.size();
+		file.close();
+		if(strlen(fn)+strlen(name)<LOG_FILENAME_SIZE) {
+			strcat(fn, name);
+			callback(fn, size);
+			n++;
+		}
+		file = root.openNextFile();
+	}
+	root.close();
+#elif defined(ARDUINO)
+	// not available for the SD card of AVR controllers
+#else
+	DIR *dir = opendir(get_filename_fullpath(LOG_PREFIX));
+	if(!dir) return 0;
+	struct dirent *ent;
+	struct stat st;
+	while(n<max && (ent=readdir(dir))) {
+		if(ent->d_name[0]=='.') continue;
+		if(strlen(LOG_PREFIX)+strlen(ent->d_name)>=LOG_FILENAME_SIZE) continue;
+		strcpy(fn, LOG_PREFIX);
+		strcat(fn, ent->d_name);
+		if(stat(get_filename_fullpath(fn), &st)) continue;
+		callback(fn, st.st_size);
+		n++;
+	}
+	closedir(dir);
+#endif
+	return n;
+}
+
+#define LOG_FILE_OTHER  0
+#define LOG_FILE_DAY    1
+#define LOG_FILE_ROLLUP 2
+
+/** Get the kind of a log file from its name, and its day (day files,
+ * first day of the week for segments) or its month (rollup files, year*12+month-1)
+ */
+static byte log_file_kind(const char *fn, ulong *v) {
+	const char *name = strrchr(fn, '/');
+	name = name ? name+1 : fn;
+	char *end;
+	ulong x = strtoul(name, &end, 10);
+	if(end==name) return LOG_FILE_OTHER;
+	if(!strcmp_P(end, PSTR(".bin")) || !strcmp_P(end, PSTR(".txt")) || !strcmp_P(end, PSTR(".seg"))) {
+		*v = x;
+		return LOG_FILE_DAY;
+	}
+	if(!strcmp_P(end, PSTR(".sum")) && x%100>=1 && x%100<=12) {
+		*v = (x/100)*12 + x%100-1;
+		return LOG_FILE_ROLLUP;
+	}
+	return LOG_FILE_OTHER;
+}
+
+static void log_usage_add(const char *fn, ulong size) {
+	ulong v;
+	log_bytes += size;
+	byte kind = log_file_kind(fn, &v);
+	if(kind==LOG_FILE_DAY && v<log_first_day) log_first_day = v;
+	if(kind==LOG_FILE_ROLLUP && v<log_first_month) log_first_month = v;
+}
+
+static void log_usage_sub(ulong size) {
+	log_bytes = (log_bytes>size) ? log_bytes-size : 0;
+}
+
+static void log_usage_reset() {
+	log_bytes = 0;
+	log_first_day = 0xFFFFFFFFUL;
+	log_first_month = 0xFFFF;
+	log_bytes_valid = true;
+	#if defined(LOG_SEGMENTS)
+	log_pack_next = 0;
+	#endif
+}
+
+/** Bytes used by the log folder */
+ulong log_usage() {
+	if(!log_bytes_valid) {
+		log_usage_reset();
+		log_list(log_usage_add, 0xFFFF);
+	}
+	return log_bytes;
+}
+
+/** Log storage budget in bytes, 0 if there is no limit */
+ulong log_budget() {
+	if(os.iopts[IOPT_LOG_BUDGET]) return os.iopts[IOPT_LOG_BUDGET]*LOG_BUDGET_UNIT;
+#if defined(ESP8266)
+	FSInfo fs_info;
+	FILESYSTEM.info(fs_info);
+	return fs_info.totalBytes/4;
+#elif defined(ESP32)
+	return FILESYSTEM.totalBytes()/4;
+#else
+	return 0;
+#endif
+}
+
+/** The oldest day that may still have a day file, 0 if there is none */
+ulong log_oldest_day() {
+	log_usage();
+	return (log_first_day==0xFFFFFFFFUL) ? 0 : log_first_day;
+}
+
+/** Remove a log file, returns its size (0 if it does not exist) */
+static ulong log_remove(const char *fn) {
+	LogFile file;
+	if(!file.open(fn, false)) return 0;
+	ulong size = file.size();
+	file.close();
+	remove_file(fn);
+	return size;
+}
+
+/** Prune the oldest log files while over the budget or the maximum age
+ * Today's day file and this month's rollup file are never pruned.
+ * Returns true if a file was pruned or the log folder was scanned.
+ */
+static bool log_prune(ulong curr_time) {
+	if(!log_bytes_valid) {
+		// the folder scan is all the work for this second
+		log_usage();
+		return true;
+	}
+	ulong budget = log_budget();
+	ulong today = curr_time / 86400;
+	ulong maxage = os.iopts[IOPT_LOG_MAXAGE]*7UL;
+	ulong oldest = (maxage && today>maxage) ? today-maxage : 0;	// files before this day are too old
+	uint16_t year;
+	byte month, mday;
+	log_civil_date(today, &year, &month, &mday);
+	uint16_t this_month = year*12 + month-1;
+
+	char fn[LOG_FILENAME_SIZE];
+	byte removed = 0;
+	for(byte probes=0; probes<LOG_PRUNE_PROBES && removed<LOG_PRUNE_FILES; probes++) {
+		bool over = budget && log_bytes>budget;
+		ulong size = 0;
+		if(log_first_day<today && (over || log_first_day<oldest)) {
+			#if defined(LOG_SEGMENTS)
+			if(log_first_day%LOG_SEG_DAYS==0) {
+				// a segment is pruned as a whole, by age once its last day is too old
+				make_segment_name(fn, log_first_day, false);
+				if(!over && log_first_day+LOG_SEG_DAYS>oldest && file_exists(fn)) break;
+				size = log_remove(fn);
+				make_segment_name(fn, log_first_day, true);
+				size += log_remove(fn);
+			}
+			#endif
+			make_logfile_name(fn, log_first_day, false);
+			size += log_remove(fn);
+			make_logfile_name(fn, log_first_day, true);
+			size += log_remove(fn);
+			log_first_day++;
+		} else {
+			// a rollup file is pruned once its whole month is over the maximum age,
+			// or when there is no day file left to prune
+			uint16_t m = log_first_month;
+			if(m>=this_month) break;
+			if(!over && log_civil_day((m+1)/12, (m+1)%12+1, 1)>oldest) break;
+			make_rollup_name(fn, m/12, m%12+1);
+			size = log_remove(fn);
+			log_first_month++;
+		}
+		if(size) {
+			removed++;
+			log_usage_sub(size);
+		}
+	}
+	return removed>0;
+}
+
+#if defined(LOG_SEGMENTS)
+/** Pack the next week that is more than LOG_PACK_AGE days old
+ * One week is checked per call, and weeks are checked again from the
+ * oldest day after each scan of the log folder (e.g. after a reboot).
+ */
+static void log_pack(ulong curr_time) {
+	ulong today = curr_time / 86400;
+	if(log_first_day==0xFFFFFFFFUL || today<LOG_PACK_AGE) return;
+	ulong last = (today-LOG_PACK_AGE) / LOG_SEG_DAYS;	// weeks before this one are old enough
+	if(log_pack_next<log_first_day/LOG_SEG_DAYS) log_pack_next = log_first_day/LOG_SEG_DAYS;
+	if(log_pack_next>=last) return;
+	log_pack_week(log_pack_next++, 0xFFFFFFFFUL);
+}
+#endif
+
+#if !defined(ARDUINO)
+static LogExportFile *log_export_array;
+static uint16_t log_export_count;
+static ulong log_export_start, log_export_end;
+
+static void log_export_collect(const char *fn, ulong size) {
+	ulong v, first, last;
+	switch(log_file_kind(fn, &v)) {
+	case LOG_FILE_DAY:
+		first = last = v;
+		if(strstr(fn, ".seg")) last = v+LOG_SEG_DAYS-1;
+		break;
+	case LOG_FILE_ROLLUP:
+		first = log_civil_day(v/12, v%12+1, 1);
+		last = log_civil_day((v+1)/12, (v+1)%12+1, 1)-1;
+		break;
+	default:
+		return;
+	}
+	if(last<log_export_start || first>log_export_end) return;
+	if(log_export_count%64==0) {
+		LogExportFile *a = (LogExportFile*)realloc(log_export_array, (log_export_count+64)*sizeof(LogExportFile));
+		if(!a) return;
+		log_export_array = a;
+	}
+	LogExportFile *f = log_export_array+log_export_count++;
+	strcpy(f->fn, fn);
+	f->size = size;
+	f->day = first;
+}
+
+static int log_export_compare(const void *a, const void *b) {
+	const LogExportFile *fa = (const LogExportFile*)a, *fb = (const LogExportFile*)b;
+	if(fa->day!=fb->day) return (fa->day<fb->day) ? -1 : 1;
+	return strcmp(fa->fn, fb->fn);
+}
+
+/** List the log files (day files, segments and rollup files) that overlap
+ * a range of days, ordered by their first day
+ * Returns an array to be released with free(), n is set to its length.
+ */
+LogExportFile *log_export_files(ulong start, ulong end, uint16_t *n) {
+	log_export_array = NULL;
+	log_export_count = 0;
+	log_export_start = start;
+	log_export_end = end;
+	log_list(log_export_collect, 0xFFFF);
+	if(log_export_count) qsort(log_export_array, log_export_count, sizeof(LogExportFile), log_export_compare);
+	*n = log_export_count;
+	return log_export_array;
+}
+#endif
+
+static char (*log_delete_names)[LOG_FILENAME_SIZE];
+static byte log_delete_count;
+
+static void log_delete_collect(const char *fn, ulong size) {
+	strcpy(log_delete_names[log_delete_count++], fn);
+}
+
+/** Delete log file
+ * If name is 'all', delete all logs
+ */
+void delete_log(char *name) {
+	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
+	log_flush();	// so that pending records are deleted too
+	if (strncmp(name, "all", 3) == 0) {
+		rollup_cached = 0;
+#if defined(ARDUINO) && !defined(ESP8266) && !defined(ESP32)
+		// delete the log folder
+		SdFile file;
+
+		if (sd.chdir(LOG_PREFIX)) {
+			// delete the whole log folder
+			sd.vwd()->rmRfStar();
+		}
+#else
+		// list a batch of files before removing them, removing files
+		// while the folder is being listed may skip files
+		char names[LOG_DELETE_BATCH][LOG_FILENAME_SIZE];
+		log_delete_names = names;
+		do {
+			log_delete_count = 0;
+			log_list(log_delete_collect, LOG_DELETE_BATCH);
+			for(byte i=0;i<log_delete_count;i++) remove_file(names[i]);
+		} while(log_delete_count==LOG_DELETE_BATCH);
+		#if !defined(ARDUINO)
+		rmdir(get_filename_fullpath(LOG_PREFIX));
+		#endif
+#endif
+		log_usage_reset();
+		return;
+	}
+	// delete a single day file (and its text version if not converted yet)
+	char fn[LOG_FILENAME_SIZE];
+	ulong day = strtoul(name, NULL, 10);
+	make_logfile_name(fn, day, false);
+	remove_file(fn);
+	make_logfile_name(fn, day, true);
+	remove_file(fn);
+	#if defined(LOG_SEGMENTS)
+	// a packed day is left out of its segment
+	make_segment_name(fn, day-day%LOG_SEG_DAYS, false);
+	if(file_exists(fn)) log_pack_week(day/LOG_SEG_DAYS, day);
+	#endif
+	log_bytes_valid = false;
+}
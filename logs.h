@@ -0,0 +1,189 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log functions header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGS_H
+#define _LOGS_H
+
+#include "defines.h"
+
+class BufferFiller;
+
+#define LOG_MAGIC    0x474C534FUL	// "OSLG", identifies a binary day file
+#define LOG_VERSION  1
+#define LOG_NTYPES   6	// number of record types (LOGDATA_STATION to LOGDATA_SENSOR2)
+#define LOG_BLOCK_RECORDS 8	// number of records read from a day file at a time
+#define LOG_TYPEMASK_ALL ((1<<LOG_NTYPES)-1)
+
+/** Pending records are kept in RAM and written to the day files in batches:
+ * when no program is running, when the buffer reaches LOG_FLUSH_WATERMARK,
+ * when the oldest record is LOG_FLUSH_DELAY seconds old, and before reboot.
+ */
+#if defined(ARDUINO) && !defined(ESP8266) && !defined(ESP32)
+	#define LOG_PENDING_SIZE 4
+#else
+	#define LOG_PENDING_SIZE 32
+#endif
+#define LOG_FLUSH_WATERMARK (LOG_PENDING_SIZE*3/4)
+#define LOG_FLUSH_DELAY     300
+
+/** Log retention
+ * When no program is running, the oldest day files are pruned while the log
+ * folder is over its budget (IOPT_LOG_BUDGET) or older than IOPT_LOG_MAXAGE,
+ * at most LOG_PRUNE_FILES files per second. Rollup files are pruned once no
+ * day file is left to prune, or when their whole month is over the maximum age.
+ */
+#define LOG_BUDGET_UNIT   16384UL	// unit of IOPT_LOG_BUDGET (bytes)
+#define LOG_PRUNE_FILES   2	// maximum number of files pruned per second
+#define LOG_PRUNE_PROBES  16	// maximum number of days / months checked per second
+#define LOG_DELETE_BATCH  8	// number of files listed at a time when deleting all logs
+
+/** Log record (16 bytes)
+ * Station records keep the program, the station, the run time and,
+ * if a flow sensor is installed, the flow rate.
+ * Other records keep the type, a value (flow count) and a duration
+ * (sensor / rain delay active time, or the water level).
+ */
+struct LogRecord {
+	uint32_t endtime;	// end time of the event (local time)
+	uint32_t duration;
+	union {
+		uint32_t count;	// flow count (LOGDATA_FLOWSENSE)
+		float gpm;	// flow rate (LOGDATA_STATION with has_flow set)
+	};
+	uint16_t sid;
+	byte pid;
+	byte type:7;
+	byte has_flow:1;
+};
+
+/** Day file header
+ * Records follow the header. The record count is derived from the
+ * file size, the per-type counts and the time range let queries skip
+ * files without reading their records.
+ */
+struct LogFileHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint16_t counts[LOG_NTYPES];	// number of records of each type
+	uint32_t tmin;	// earliest / latest end time of the records
+	uint32_t tmax;
+};
+
+/** Cold log segments (ESP8266/ESP32 and Linux)
+ * Once a week (7 days counted from epoch day 0) is more than LOG_PACK_AGE
+ * days old, its day files are packed into one compressed segment
+ * (logs/xxxxx.seg, xxxxx is the first day of the week). A segment is
+ * written to logs/xxxxx.tmp first, with its header written last, and
+ * renamed once the day files are removed. A complete temporary segment
+ * left by an interruption is committed at the next attempt.
+ * Records are compressed with an LZSS codec: groups of 8 items, each
+ * preceded by a flag byte (bit i set if item i is a match). A literal is
+ * one byte, a match is two bytes (distance-1, length-LZ_MIN_MATCH) that
+ * copies earlier bytes within the last LZ_WINDOW bytes.
+ * Record end times are stored as the difference to the previous record.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define LOG_SEGMENTS
+#endif
+#define LOG_SEG_MAGIC  0x5A4C534FUL	// "OSLZ", identifies a segment file
+#define LOG_SEG_DAYS   7	// days per segment
+#define LOG_PACK_AGE   7	// days after which a week is packed
+#define LZ_WINDOW      256	// must be 256, the decoder window index wraps as a byte
+#define LZ_MIN_MATCH   3
+#define LZ_MAX_MATCH   (LZ_MIN_MATCH+255)
+#define LZ_IN_SIZE     32	// size of the decoder input buffer
+
+struct LogSegmentHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t day;	// first day of the week
+	uint32_t csize;	// size of the compressed records following the header
+	uint16_t days[LOG_SEG_DAYS];	// number of records of each day
+	uint16_t counts[LOG_NTYPES];	// number of records of each type
+	uint16_t reserved;
+	uint32_t tmin;	// earliest / latest end time of the records
+	uint32_t tmax;
+};
+
+/** Watering rollups
+ * Station runs and flow records are summed per day and per month for each
+ * station, each program and the flow sensor. Each month has a file
+ * (logs/yyyymm.sum) with one row per key: the month total followed by an
+ * entry for each day of the month. A query reads one entry per row.
+ */
+#define ROLLUP_KEY_PROGRAM 0x8000	// key of a program is ROLLUP_KEY_PROGRAM|pid
+#define ROLLUP_KEY_FLOW    0xFFFF	// key of the flow sensor records
+
+struct RollupEntry {
+	uint32_t seconds;	// total duration
+	uint32_t volume;	// flow volume, in 1/100 of the flow log unit
+	uint16_t runs;	// number of runs (records)
+	uint16_t reserved;
+};
+
+struct RollupRow {
+	uint16_t key;
+	uint16_t reserved;
+	RollupEntry entries[32];	// [0]: month total, [1..31]: day of month
+};
+
+/** Rollup scan callback, called for each key with a non-empty entry */
+typedef void (*RollupCallback)(uint16_t key, const RollupEntry *e);
+
+#define LOG_FILENAME_SIZE 24
+
+/** Log file listed for a raw export (Linux) */
+struct LogExportFile {
+	char fn[LOG_FILENAME_SIZE];	// file name, in the form used by get_filename_fullpath()
+	ulong size;
+	ulong day;	// first day covered by the file
+};
+
+/** Log scan callback, return false to stop scanning at this record */
+typedef bool (*LogCallback)(const LogRecord *rec);
+
+/** Position of a record: its day and its number within the day */
+struct LogCursor {
+	ulong day;
+	ulong index;
+};
+
+void write_log(byte type, ulong curr_time);
+void log_flush();
+void log_flush_idle(ulong curr_time);
+byte log_pending_count();
+void delete_log(char *name);
+bool log_scan(ulong start, ulong end, byte typemask, LogCallback callback, LogCursor *cursor=NULL);
+byte log_type_mask(const char *type);
+void log_render(const LogRecord *rec, BufferFiller &bf);
+ulong log_usage();
+ulong log_budget();
+ulong log_oldest_day();
+void rollup_scan(ulong day, bool month, RollupCallback callback);
+ulong rollup_month_start(ulong day, int offset);
+#if !defined(ARDUINO)
+LogExportFile *log_export_files(ulong start, ulong end, uint16_t *n);
+#endif
+
+#endif	// _LOGS_H
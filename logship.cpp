@@ -0,0 +1,201 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log shipping
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "OpenSprinkler.h"
+#include "logs.h"
+#include "logship.h"
+#include "server_os.h"
+#include "simulation.h"
+
+#if defined(LOG_SHIPPING)
+
+extern OpenSprinkler os;
+extern char ether_buffer[];
+extern char tmp_buffer[];
+
+#define str(s) #s
+#define xstr(s) str(s)
+
+#define LOG_SHIP_HEADER_SIZE 256	// space reserved for the HTTP request header in ether_buffer
+
+/** Shipping state, saved in LOGSHIP_FILENAME after each delivered batch */
+struct LogShipState {
+	uint32_t seq;	// sequence number of the next batch
+	uint32_t day;	// high-water mark: position of the first record not delivered yet
+	uint32_t index;
+};
+
+static LogShipState ship_state;
+static bool ship_loaded = false;	// ship_state is loaded
+static bool ship_configured = false;	// the configuration is loaded
+static byte ship_mode = LOG_SHIP_OFF;
+static uint16_t ship_port;
+static char ship_host[LOG_SHIP_MAX_HOST+1];
+static char ship_path[LOG_SHIP_MAX_PATH+1];
+static ulong ship_next = 0;	// time of the next attempt
+static byte ship_failures = 0;	// number of consecutive failed attempts
+
+static LogRecord ship_batch[LOG_SHIP_BATCH];
+static byte ship_count;
+static ulong ship_day, ship_index;	// position after the last record of the batch
+static bool ship_accepted;
+
+/** Load the shipping configuration, called again when it changes */
+void log_ship_config() {
+	char *config = tmp_buffer;
+	config[0] = 0;
+	os.sopt_load(SOPT_LOGSHIP_OPTS, config);
+	int enabled = 0, port = 80;
+	ship_host[0] = ship_path[0] = 0;
+	if (*config != 0) {
+		sscanf(
+			config,
+			"\"en\":%d,\"host\":\"%" xstr(LOG_SHIP_MAX_HOST) "[^\"]\",\"port\":%d,\"path\":\"%" xstr(LOG_SHIP_MAX_PATH) "[^\"]\"",
+			&enabled, ship_host, &port, ship_path
+			);
+	}
+	ship_mode = (enabled==LOG_SHIP_HTTP || enabled==LOG_SHIP_MQTT) ? enabled : LOG_SHIP_OFF;
+	ship_port = port;
+	ship_next = 0;
+	ship_failures = 0;
+	ship_configured = true;
+}
+
+static void ship_state_save() {
+	file_write_block(LOGSHIP_FILENAME, &ship_state, 0, sizeof(ship_state));
+}
+
+/** Load the high-water mark, a new mark starts with the records of today */
+static void ship_state_load(ulong today) {
+	if (file_exists(LOGSHIP_FILENAME)) {
+		file_read_block(LOGSHIP_FILENAME, &ship_state, 0, sizeof(ship_state));
+	} else {
+		ship_state.seq = 1;
+		ship_state.day = today;
+		ship_state.index = 0;
+		ship_state_save();
+	}
+	ship_loaded = true;
+}
+
+static bool ship_collect(const LogRecord *rec) {
+	if (ship_count==LOG_SHIP_BATCH) return false;
+	ship_batch[ship_count++] = *rec;
+	ulong day = rec->endtime / 86400;
+	if (day!=ship_day) {
+		ship_day = day;
+		ship_index = 0;
+	}
+	ship_index++;
+	return true;
+}
+
+static void ship_http_callback(char *buffer) {
+	// status line: HTTP/1.x 2xx
+	ship_accepted = (strncmp(buffer, "HTTP/1.", 7)==0 && buffer[9]=='2');
+}
+
+/** Send the batch, returns true if the collector accepted it */
+static bool ship_send() {
+	// payload, after the space reserved for the HTTP request header
+	char *body = ether_buffer+LOG_SHIP_HEADER_SIZE;
+	BufferFiller bf(body, ETHER_BUFFER_SIZE-LOG_SHIP_HEADER_SIZE);
+	byte mac[6] = {0};
+	os.load_hardware_mac(mac, m_server!=NULL);
+	bf.emit_p(PSTR("{\"mac\":\"$X:$X:$X:$X:$X:$X\",\"seq\":$L,\"logs\":["),
+						mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ship_state.seq);
+	for (byte i=0; i<ship_count; i++) {
+		if (i) bf.emit_p(PSTR(","));
+		log_render(ship_batch+i, bf);
+	}
+	bf.emit_p(PSTR("]}"));
+
+	if (ship_mode==LOG_SHIP_MQTT) {
+		return os.mqtt.publish(ship_path, body);
+	}
+
+	uint16_t len = strlen(body);
+	BufferFiller hf(ether_buffer, LOG_SHIP_HEADER_SIZE);
+	hf.emit_p(PSTR("POST $S HTTP/1.0\r\nHost: $S\r\nContent-Type: application/json\r\nContent-Length: $D\r\n\r\n"),
+						ship_path, ship_host, len);
+	uint16_t hlen = strlen(ether_buffer);
+	memmove(ether_buffer+hlen, body, len+1);
+	ship_accepted = false;
+	os.send_http_request(ship_host, ship_port, ether_buffer, ship_http_callback);
+	return ship_accepted;
+}
+
+/** Ship the next batch of log records
+ * This is called once per second from the main loop. New records are
+ * checked every LOG_SHIP_INTERVAL seconds, and the next batch follows
+ * right away if more records are waiting.
+ */
+void log_ship(ulong curr_time) {
+	if (!ship_configured) log_ship_config();
+	if (ship_mode==LOG_SHIP_OFF || curr_time<ship_next) return;
+#if defined(DEMO)
+	if (sim_active()) return;	// there is no network in simulation mode
+#endif
+	if (!os.network_connected()) return;
+	// only records written to the log files are shipped, so that the
+	// numbering of the records does not change after a power failure
+	if (log_pending_count()) return;
+
+	ulong today = curr_time / 86400;
+	if (!ship_loaded) ship_state_load(today);
+	ulong end = ship_state.day+LOG_SHIP_DAYS-1;
+	if (end>today) end = today;
+	if (end<ship_state.day) end = ship_state.day;
+
+	ship_count = 0;
+	ship_day = ship_state.day;
+	ship_index = ship_state.index;
+	LogCursor cursor = {ship_state.day, ship_state.index};
+	bool complete = log_scan(ship_state.day, end, LOG_TYPEMASK_ALL, ship_collect, &cursor);
+	if (complete) {
+		// all records up to the end day are in the batch
+		if (ship_day!=end) {
+			ship_day = end;
+			ship_index = 0;
+		}
+	} else {
+		ship_day = cursor.day;
+		ship_index = cursor.index;
+	}
+
+	if (ship_count && !ship_send()) {
+		if (ship_failures<8) ship_failures++;
+		ulong delay = (ulong)LOG_SHIP_RETRY << (ship_failures-1);
+		ship_next = curr_time + (delay<LOG_SHIP_RETRY_MAX ? delay : LOG_SHIP_RETRY_MAX);
+		return;
+	}
+	ship_failures = 0;
+	if (ship_count || ship_day!=ship_state.day || ship_index!=ship_state.index) {
+		if (ship_count) ship_state.seq++;
+		ship_state.day = ship_day;
+		ship_state.index = ship_index;
+		ship_state_save();
+	}
+	ship_next = curr_time + ((complete && ship_day==today) ? LOG_SHIP_INTERVAL : 1);
+}
+
+#endif	// LOG_SHIPPING
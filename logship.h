@@ -0,0 +1,63 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log shipping header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGSHIP_H
+#define _LOGSHIP_H
+
+#include "defines.h"
+
+/** Log shipping (ESP8266/ESP32 and Linux)
+ * Log records are pushed in batches to a collector, by an HTTP POST or
+ * an MQTT message. The configuration is a string option (SOPT_LOGSHIP_OPTS):
+ *   "en":0|1|2,"host":"server name or IP","port":80,"path":"/path or topic"
+ * en: 0 off, 1 HTTP POST to http://host:port/path, 2 MQTT message on topic path
+ * (using the MQTT broker settings).
+ * The payload is {"mac":"xx:xx:xx:xx:xx:xx","seq":n,"logs":[...]}, where the
+ * records have the same form as in /jl.
+ * A batch is read from the log files, starting at the high-water mark: the
+ * position of the first record not delivered yet. The mark and the sequence
+ * number are saved in LOGSHIP_FILENAME once the collector accepts a batch
+ * (HTTP status 2xx, or MQTT message published). A batch that failed is sent
+ * again with the same sequence number, so the collector can drop duplicates.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define LOG_SHIPPING
+#endif
+
+#define LOG_SHIP_OFF   0
+#define LOG_SHIP_HTTP  1
+#define LOG_SHIP_MQTT  2
+
+#define LOG_SHIP_BATCH     16	// maximum number of records per batch
+#define LOG_SHIP_INTERVAL  60	// seconds between checks for new records
+#define LOG_SHIP_RETRY     15	// delay before the first retry, doubled after each failure
+#define LOG_SHIP_RETRY_MAX 3600	// maximum retry delay
+#define LOG_SHIP_DAYS      31	// maximum number of days scanned for a batch
+#define LOG_SHIP_MAX_HOST  64
+#define LOG_SHIP_MAX_PATH  64
+
+#if defined(LOG_SHIPPING)
+void log_ship_config();
+void log_ship(ulong curr_time);
+#endif
+
+#endif	// _LOGSHIP_H
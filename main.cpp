@@ -22,6 +22,9 @@
  */
 
 #include <limits.h>
+#if !defined(ARDUINO)
+#include <signal.h>
+#endif
 
 #include "OpenSprinkler.h"
 #include "program.h"
@@ -29,6 +32,9 @@
 #include "server_os.h"
 #include "mqtt.h"
 #include "MirrorLink.h"
+#include "simulation.h"
+#include "logs.h"
+#include "logship.h"
 
 #if defined(ARDUINO)
 	EthernetServer *m_server = NULL;
@@ -85,6 +91,12 @@ ulong flow_count = 0;
 byte prev_flow_state = HIGH;
 float flow_last_gpm=0;
 
+/* Changes of the running stations, to tell which stations a flow rate was measured with
+ * flow_on_time - time when a station last turned on (the flow measurement restarts then)
+ * flow_on_prev - time of the turn-on before that
+ * flow_off_time - time when a station last turned off */
+ulong flow_on_time = 0, flow_on_prev = 0, flow_off_time = 0;
+
 void flow_poll() {
 	#if defined(ESP8266) || defined(ESP32)
 	pinModeExt(PIN_SENSOR1, INPUT_PULLUP); // this seems necessary for OS 3.2 
@@ -298,13 +310,12 @@ void ui_state_machine() {
 				ui_state_runprog = (ui_state_runprog+1) % (pd.nprograms+1);
 				os.lcd_print_line_clear_pgm(PSTR("Hold B3 to start"), 0);
 				if(ui_state_runprog > 0) {
-					ProgramStruct prog;
-					pd.read(ui_state_runprog-1, &prog);
+					ProgramHeader *prog = pd.get(ui_state_runprog-1);
 					os.lcd_print_line_clear_pgm(PSTR(" "), 1);
 					os.lcd.setCursor(0, 1);
 					os.lcd.print((int)ui_state_runprog);
 					os.lcd_print_pgm(PSTR(". "));
-					os.lcd.print(prog.name);
+					os.lcd.print(prog->name);
 				} else {
 					os.lcd_print_line_clear_pgm(PSTR("0. Test (1 min)"), 1);
 				}
@@ -410,15 +421,15 @@ void do_setup() {
 }
 #endif
 
-void write_log(byte type, ulong curr_time);
 void schedule_all_stations(ulong curr_time);
-void turn_on_station(byte sid);
-void turn_off_station(byte sid, ulong curr_time);
+void turn_on_station(sid_t sid);
+void turn_off_station(sid_t sid, ulong curr_time);
+void learn_station_load(sid_t sid, ulong curr_time);
+bool enqueue_program(byte pid, ProgramHeader *prog);
 void process_dynamic_events(ulong curr_time);
 void check_network();
 void check_weather();
 void perform_ntp_sync();
-void delete_log(char *name);
 
 #if defined(ESP8266) || defined(ESP32)
 void start_server_ap();
@@ -444,8 +455,8 @@ void do_loop()
 	static ulong last_time = 0;
 	static ulong last_minute = 0;
 
-	byte bid, sid, s, pid, qid, bitvalue;
-	ProgramStruct prog;
+	byte bid, s, pid;
+	sid_t sid;
 
 	os.status.mas = os.iopts[IOPT_MASTER_STATION];
 	os.status.mas2= os.iopts[IOPT_MASTER_STATION_2];
@@ -584,22 +595,24 @@ void do_loop()
 	ui_state_machine();
 
 #else // Process Ethernet packets for RPI/BBB
-	EthernetClient client = m_server->available();
-	if (client) {
-		while(true) {
-			int len = client.read((uint8_t*) ether_buffer, ETHER_BUFFER_SIZE);
-			if (len <=0) {
-				if(!client.connected()) {
-					break;
+	if (m_server) {	// there is no server in simulation mode
+		EthernetClient client = m_server->available();
+		if (client) {
+			while(true) {
+				int len = client.read((uint8_t*) ether_buffer, ETHER_BUFFER_SIZE);
+				if (len <=0) {
+					if(!client.connected()) {
+						break;
+					} else {
+						continue;
+					}
 				} else {
-					continue;
+					m_client = &client;
+					ether_buffer[len] = 0;	// put a zero at the end of the packet
+					handle_web_request(ether_buffer);
+					m_client = 0;
+					break;
 				}
-			} else {
-				m_client = &client;
-				ether_buffer[len] = 0;	// put a zero at the end of the packet
-				handle_web_request(ether_buffer);
-				m_client = 0;
-				break;
 			}
 		}
 	}
@@ -745,53 +758,29 @@ void do_loop()
 		// since the granularity of start time is minute
 		// we only need to check once every minute
 		if (curr_minute != last_minute) {
+			// if the clock has moved backward, re-calculate the calendar index
+			if (curr_minute < last_minute) pd.invalidate_next_runs();
 			last_minute = curr_minute;
-			// check through all programs
-			for(pid=0; pid<pd.nprograms; pid++) {
-				delay(0);
-				pd.read(pid, &prog);	// todo future: reduce load time
-				if(prog.check_match(curr_time)) {
-					// program match found
-					// process all selected stations
-					for(sid=0;sid<os.nstations;sid++) {
-						bid=sid>>3;
-						s=sid&0x07;
-						// skip if the station is a master station (because master cannot be scheduled independently
-						if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
-							continue;
-
-						// if station has non-zero water time and the station is not disabled
-						if (prog.durations[sid] && !(os.attrib_dis[bid]&(1<<s))) {
-							// water time is scaled by watering percentage
-							ulong water_time = water_time_resolve(prog.durations[sid]);
-							// if the program is set to use weather scaling
-							if (prog.use_weather) {
-								byte wl = os.iopts[IOPT_WATER_PERCENTAGE];
-								water_time = water_time * wl / 100;
-								if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
-																								// do not water
-									water_time = 0;
-							}
-
-							if (water_time) {
-								// check if water time is still valid
-								// because it may end up being zero after scaling
-								q = pd.enqueue();
-								if (q) {
-									q->st = 0;
-									q->dur = water_time;
-									q->sid = sid;
-									q->pid = pid+1;
-									match_found = true;
-								} else {
-									// queue is full
-								}
-							}// if water_time
-						}// if prog.durations[sid]
-					}// for sid
-					if(match_found) push_message(NOTIFY_PROGRAM_SCHED, pid, prog.use_weather?os.iopts[IOPT_WATER_PERCENTAGE]:100);
-				}// if check_match
-			}// for pid
+			// the calendar index tells if any program is due in this minute
+			if (pd.update_next_runs(curr_minute*60) <= (ulong)curr_time) {
+				// check through the programs that are due
+				for(pid=0; pid<pd.nprograms; pid++) {
+					if (pd.next_runs[pid] > (ulong)curr_time) continue;
+					delay(0);
+					pd.invalidate_next_runs(pid);	// look for its next run after this minute
+					ProgramHeader *prog = pd.get(pid);
+					ProgramSchedule *sched = pd.get_schedule(pid);
+					if(prog->check_match(curr_time, sched)) {
+						// program match found
+						// process all stations with non-zero water time
+						if(enqueue_program(pid, prog)) {
+							match_found = true;
+							push_message(NOTIFY_PROGRAM_SCHED, pid, prog->use_weather?os.iopts[IOPT_WATER_PERCENTAGE]:100);
+						}
+					}// if check_match
+				}// for pid
+				pd.update_next_runs((curr_minute+1)*60);
+			}// if next_run_time
 
 			// calculate start and end time
 			if (match_found) {
@@ -816,79 +805,91 @@ void do_loop()
 		// Check if a program is running currently
 		// If so, do station run-time keeping
 		if (os.status.program_busy){
-			// first, go through run time queue to assign queue elements to stations
-			q = pd.queue;
-			qid=0;
-			for(;q<pd.queue+pd.nqueue;q++,qid++) {
-				sid=q->sid;
-				byte sqi=pd.station_qid[sid];
-				// skip if station is already assigned a queue element
-				// and that queue element has an earlier start time
-				if(sqi<255 && pd.queue[sqi].st<q->st) continue;
-				// otherwise assign the queue element to station
-				pd.station_qid[sid]=qid;
-			}
-			// next, go through the stations and perform time keeping
-			for(bid=0;bid<os.nboards; bid++) {
-				bitvalue = os.station_bits[bid];
-				for(s=0;s<8;s++) {
-					byte sid = bid*8+s;
-
-					// skip master station
-					if (os.status.mas == sid+1) continue;
-					if (os.status.mas2== sid+1) continue;
-					if (pd.station_qid[sid]==255) continue;
-
-					q = pd.queue + pd.station_qid[sid];
-					// check if this station is scheduled, either running or waiting to run
-					if (q->st > 0) {
-						// if so, check if we should turn it off
-						if (curr_time >= q->st+q->dur) {
+			// process dynamic events
+			process_dynamic_events(curr_time);
+
+			// the queue only needs processing when a station or master is due to change state,
+			// or after the queue has been modified
+			if ((ulong)curr_time >= pd.next_event_time) {
+#if defined(DEMO)
+				sim_timer_start(SIM_TIMER_QUEUE);
+#endif
+				ulong next_event = ULONG_MAX;
+				int16_t mas_on_adj = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ]);
+				int16_t mas_off_adj= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ]);
+				int16_t mas_on_adj_2 = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ_2]);
+				int16_t mas_off_adj_2= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ_2]);
+				bool masref = false, masref2 = false;	// a running station needs master / master2 on
+				byte re=os.iopts[IOPT_REMOTE_EXT_MODE];
+				memset(pd.last_seq_stop_times, 0, NUM_SEQ_GROUPS*sizeof(ulong));
+
+				// go through the queue backward, so dequeued elements (replaced by the last one) are not revisited
+				int qi;
+				for(qi=pd.nqueue-1;qi>=0;qi--) {
+					q=pd.queue+qi;
+					sid=q->sid;
+					bid=sid>>3;
+					s=sid&0x07;
+					ulong et = q->st+q->dur;
+					// only the element assigned to a station (the earliest one) can turn it on or off
+					// master stations are skipped because they cannot be scheduled independently
+					if (pd.station_qid[sid]==qi && os.status.mas!=sid+1 && os.status.mas2!=sid+1) {
+						// check if this station is scheduled, either running or waiting to run
+						if (q->st > 0 && (ulong)curr_time >= et) {
+							// if so, check if we should turn it off
 							turn_off_station(sid, curr_time);
+							// if the station has another element queued, it gets processed in the next round
+							if (pd.station_qid[sid]!=QID_NONE) next_event = curr_time;
+							continue;
 						}
-					}
-					// if current station is not running, check if we should turn it on
-					if(!((bitvalue>>s)&1)) {
-						if (curr_time >= q->st && curr_time < q->st+q->dur) {
+						// if current station is not running, check if we should turn it on
+						if (!((os.station_bits[bid]>>s)&1) && (ulong)curr_time >= q->st && (ulong)curr_time < et) {
 							turn_on_station(sid);
-						} //if curr_time > scheduled_start_time
-					} // if current station is not running
-				}//end_s
-			}//end_bid
-
-			// finally, go through the queue again and clear up elements marked for removal
-			int qi;
-			for(qi=pd.nqueue-1;qi>=0;qi--) {
-				q=pd.queue+qi;
-				if(!q->dur || curr_time>=q->st+q->dur)	{
-					pd.dequeue(qi);
-				}
-			}
+						}
+					}
+					// clear up elements marked for removal
+					if(!q->dur || (ulong)curr_time>=et) {
+						pd.dequeue(qi);
+						continue;
+					}
 
-			// process dynamic events
-			process_dynamic_events(curr_time);
+					// the next state change of this element
+					ulong t = ((ulong)curr_time < q->st) ? q->st : et;
+					if (t < next_event) next_event = t;
 
-			// activate / deactivate valves
-			os.apply_all_station_bits();
-
-			// check through runtime queue, calculate the last stop time of sequential stations
-			pd.last_seq_stop_time = 0;
-			ulong sst;
-			byte re=os.iopts[IOPT_REMOTE_EXT_MODE];
-			q = pd.queue;
-			for(;q<pd.queue+pd.nqueue;q++) {
-				sid = q->sid;
-				bid = sid>>3;
-				s = sid&0x07;
-				// check if any sequential station has a valid stop time
-				// and the stop time must be larger than curr_time
-				sst = q->st + q->dur;
-				if (sst>curr_time) {
-					// only need to update last_seq_stop_time for sequential stations
+					// calculate the last stop time of sequential stations in each group
 					if (os.attrib_seq[bid]&(1<<s) && !re) {
-						pd.last_seq_stop_time = (sst>pd.last_seq_stop_time ) ? sst : pd.last_seq_stop_time;
+						ulong *sst = pd.last_seq_stop_times + os.attrib_grp[sid];
+						if (et > *sst) *sst = et;
+					}
+
+					// check running stations that activate master stations within the master on/off window
+					// only the element assigned to the station counts, later elements have not started yet
+					if (pd.station_qid[sid]!=qi || !((os.station_bits[bid]>>s)&1)) continue;
+					if (os.status.mas>0 && os.status.mas!=sid+1 && (os.attrib_mas[bid]&(1<<s))) {
+						ulong on = q->st + mas_on_adj;
+						ulong off = et + mas_off_adj;
+						if ((ulong)curr_time >= on && (ulong)curr_time <= off) masref = true;
+						if (on > (ulong)curr_time && on < next_event) next_event = on;
+						if (off >= (ulong)curr_time && off+1 < next_event) next_event = off+1;
+					}
+					if (os.status.mas2>0 && os.status.mas2!=sid+1 && (os.attrib_mas2[bid]&(1<<s))) {
+						ulong on = q->st + mas_on_adj_2;
+						ulong off = et + mas_off_adj_2;
+						if ((ulong)curr_time >= on && (ulong)curr_time <= off) masref2 = true;
+						if (on > (ulong)curr_time && on < next_event) next_event = on;
+						if (off >= (ulong)curr_time && off+1 < next_event) next_event = off+1;
 					}
 				}
+				// dequeue() above resets next_event_time, so set it at the end
+				pd.next_event_time = next_event;
+
+				// handle master and master2
+				if (os.status.mas>0)	os.set_station_bit(os.status.mas-1, masref);
+				if (os.status.mas2>0)	os.set_station_bit(os.status.mas2-1, masref2);
+#if defined(DEMO)
+				sim_timer_stop(SIM_TIMER_QUEUE);
+#endif
 			}
 
 			// if the runtime queue is empty
@@ -913,57 +914,6 @@ void do_loop()
 			}
 		}//if_some_program_is_running
 
-		// handle master
-		if (os.status.mas>0) {
-			int16_t mas_on_adj = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ]);
-			int16_t mas_off_adj= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ]);
-			byte masbit = 0;
-			
-			for(sid=0;sid<os.nstations;sid++) {
-				// skip if this is the master station
-				if (os.status.mas == sid+1) continue;
-				bid = sid>>3;
-				s = sid&0x07;
-				// if this station is running and is set to activate master
-				if ((os.station_bits[bid]&(1<<s)) && (os.attrib_mas[bid]&(1<<s))) {
-					q=pd.queue+pd.station_qid[sid];
-					// check if timing is within the acceptable range
-					if (curr_time >= q->st + mas_on_adj &&
-							curr_time <= q->st + q->dur + mas_off_adj) {
-						masbit = 1;
-						break;
-					}
-				}
-			}
-			os.set_station_bit(os.status.mas-1, masbit);
-		}
-		// handle master2
-		if (os.status.mas2>0) {
-			int16_t mas_on_adj_2 = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ_2]);
-			int16_t mas_off_adj_2= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ_2]);
-			byte masbit2 = 0;
-			for(sid=0;sid<os.nstations;sid++) {
-				// skip if this is the master station
-				if (os.status.mas2 == sid+1) continue;
-				bid = sid>>3;
-				s = sid&0x07;
-				// if this station is running and is set to activate master
-				if ((os.station_bits[bid]&(1<<s)) && (os.attrib_mas2[bid]&(1<<s))) {
-					q=pd.queue+pd.station_qid[sid];
-					// check if timing is within the acceptable range
-					if (curr_time >= q->st + mas_on_adj_2 &&
-							curr_time <= q->st + q->dur + mas_off_adj_2) {
-						masbit2 = 1;
-						break;
-					}
-				}
-			}
-			os.set_station_bit(os.status.mas2-1, masbit2);
-		}		 
-
-		// process dynamic events
-		process_dynamic_events(curr_time);
-
 		// activate/deactivate valves
 		os.apply_all_station_bits();
 
@@ -992,8 +942,8 @@ void do_loop()
 				// and if no program is scheduled to run in the next minute
 				bool willrun = false;
 				for(pid=0; pid<pd.nprograms; pid++) {
-					pd.read(pid, &prog);
-					if(prog.check_match(curr_time+60)) {
+					if(pd.next_runs[pid] > (ulong)curr_time+60) continue;
+					if(pd.get(pid)->check_match(curr_time+60, pd.get_schedule(pid))) {
 						willrun = true;
 						break;
 					}
@@ -1005,6 +955,14 @@ void do_loop()
 		}
 #endif
 
+		// write pending log records and config changes
+		log_flush_idle(curr_time);
+		os.config_flush_idle();
+#if defined(LOG_SHIPPING)
+		// push new log records to the collector
+		log_ship(curr_time);
+#endif
+
 		// real-time flow count
 		static ulong flowcount_rt_start = 0;
 		if (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
@@ -1102,10 +1060,10 @@ void schedule_test_station(byte sid, uint16_t duration) {
 	byte pid = 99;
 	unsigned long curr_time = os.now_tz();
 	RuntimeQueueStruct *q = NULL;
-	byte sqi = pd.station_qid[sid];
+	qid_t sqi = pd.station_qid[sid];
 	reset_all_stations_immediate();
 	// check if the station already has a schedule
-	if (sqi!=0xFF) {	// if we, we will overwrite the schedule
+	if (sqi!=QID_NONE) {	// if we, we will overwrite the schedule
 		q = pd.queue+sqi;
 	} else {	// otherwise create a new queue element
 		q = pd.enqueue();
@@ -1159,9 +1117,14 @@ void delete_program_data(int32_t pid) {
 /** Turn on a station
  * This function turns on a scheduled station
  */
-void turn_on_station(byte sid) {
+void turn_on_station(sid_t sid) {
 	// RAH implementation of flow sensor
 	flow_start=0;
+	ulong t = os.now_tz();
+	if (t != flow_on_time) {
+		flow_on_prev = flow_on_time;
+		flow_on_time = t;
+	}
 
 	if (os.set_station_bit(sid, 1)) {
 		push_message(NOTIFY_STATION_ON, sid);
@@ -1172,10 +1135,10 @@ void turn_on_station(byte sid) {
  * This function turns off a scheduled station
  * and writes log record
  */
-void turn_off_station(byte sid, ulong curr_time) {
+void turn_off_station(sid_t sid, ulong curr_time) {
 	os.set_station_bit(sid, 0);
 
-	byte qid = pd.station_qid[sid];
+	qid_t qid = pd.station_qid[sid];
 	// ignore if we are turning off a station that's not running or scheduled to run
 	if (qid>=pd.nqueue)  return;
 
@@ -1193,6 +1156,9 @@ void turn_off_station(byte sid, ulong curr_time) {
 	if (curr_time > q->st) {
 		// record lastrun log (only for non-master stations)
 		if(os.status.mas!=(sid+1) && os.status.mas2!=(sid+1)) {
+			learn_station_load(sid, curr_time);
+			flow_off_time = curr_time;
+
 			pd.lastrun.station = sid;
 			pd.lastrun.program = q->pid;
 			pd.lastrun.duration = curr_time - q->st;
@@ -1204,9 +1170,66 @@ void turn_off_station(byte sid, ulong curr_time) {
 		}
 	}
 
-	// dequeue the element
+	// dequeue the element, this also assigns the station's next queue element (if any)
 	pd.dequeue(qid);
-	pd.station_qid[sid] = 0xFF;
+}
+
+/** Update a learned load value
+ * Returns true if it changed by more than 1/16, so that small variations
+ * between runs do not cause a file write every time
+ */
+static bool learn_value(uint16_t *v, ulong measured, ulong others) {
+	if (measured <= others) return false;
+	ulong n = measured - others;
+	if (n > 65535) n = 65535;
+	ulong d = (n > *v) ? n - *v : *v - n;
+	bool changed = (!*v && n) || d > *v/16;
+	*v = n;
+	return changed;
+}
+
+/** Learn the flow rate and current of a station
+ * This is called as the station turns off. The measured load is the total of the
+ * station and the other (non-master) stations still running, so the learned load
+ * of those is subtracted, and nothing is learned if one of them is not known yet.
+ * Stations turned on in this second are not counted: their valves are not open yet.
+ * The flow rate is only used if no other station turned off since the flow
+ * measurement started.
+ */
+void learn_station_load(sid_t sid, ulong curr_time) {
+	sid_t i, n = os.nstations;
+	ulong flow = 0;	// load of the other running stations
+	bool flow_known = true;
+#if defined(ARDUINO)
+	ulong curr = 0;
+	bool curr_known = true;
+#endif
+	// start of the flow measurement, before any station turned on in this second
+	ulong flow_since = (flow_on_time < curr_time) ? flow_on_time : flow_on_prev;
+	for(i=station_bits_next(os.station_bits, 0, n);i<n;i=station_bits_next(os.station_bits, i+1, n)) {
+		if (os.status.mas==i+1 || os.status.mas2==i+1) continue;
+		qid_t qi = pd.station_qid[i];
+		if (qi<pd.nqueue && pd.queue[qi].st>=curr_time) continue;
+		flow += os.station_loads[i].flow;
+		if (!os.station_loads[i].flow) flow_known = false;
+#if defined(ARDUINO)
+		curr += os.station_loads[i].curr;
+		if (!os.station_loads[i].curr) curr_known = false;
+#endif
+	}
+	StationLoad *l = os.station_loads + sid;
+	bool changed = false;
+	if (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW && flow_last_gpm>0 && flow_off_time<=flow_since && flow_known) {
+		changed |= learn_value(&l->flow, (ulong)(flow_last_gpm*100), flow);
+	}
+#if defined(ARDUINO)
+	if (os.status.has_curr_sense && curr_known) {
+		// valves are not switched off until apply_all_station_bits, so this still reads the station's current
+		uint16_t c = os.read_current();
+		changed |= learn_value(&l->curr, (c > os.baseline_current) ? (c - os.baseline_current) : 0, curr);
+	}
+#endif
+	if (changed) os.loads_save();
 }
 
 /** Process dynamic events
@@ -1228,74 +1251,219 @@ void process_dynamic_events(ulong curr_time) {
 		 && os.status.sensor2_active)
 		sn2 = true;
 
-	// todo: handle sensor 2
-	byte sid, s, bid, qid, igs, igs2, igrd;
-	for(bid=0;bid<os.nboards;bid++) {
-		igs = os.attrib_igs[bid];
-		igs2= os.attrib_igs2[bid];
-		igrd= os.attrib_igrd[bid];
-		
-		for(s=0;s<8;s++) {
-			sid=bid*8+s;
-
-			// ignore master stations because they are handled separately			 
-			if (os.status.mas == sid+1) continue;
-			if (os.status.mas2== sid+1) continue;			 
-			// If this is a normal program (not a run-once or test program)
-			// and either the controller is disabled, or
-			// if raining and ignore rain bit is cleared
-			// FIX ME
-			qid = pd.station_qid[sid];
-			if(qid==255) continue;
-			RuntimeQueueStruct *q = pd.queue + qid;
-
-			if(q->pid>=99) continue;	// if this is a manually started program, proceed
-			if(!en)	turn_off_station(sid, curr_time);	// if system is disabled, turn off zone
-			if(rd && !(igrd&(1<<s))) turn_off_station(sid, curr_time);	// if rain delay is on and zone does not ignore rain delay, turn it off
-			if(sn1&& !(igs &(1<<s))) turn_off_station(sid, curr_time);	// if sensor1 is on and zone does not ignore sensor1, turn it off
-			if(sn2&& !(igs2&(1<<s))) turn_off_station(sid, curr_time);	// if sensor2 is on and zone does not ignore sensor2, turn it off
+	// nothing to do if no event is active
+	if (en && !rd && !sn1 && !sn2) return;
+
+	// go through the queue backward, so dequeued elements (replaced by the last one) are not revisited
+	sid_t sid;
+	byte s, bid;
+	int qi;
+	for(qi=pd.nqueue-1;qi>=0;qi--) {
+		RuntimeQueueStruct *q = pd.queue + qi;
+		sid = q->sid;
+		// only check the element assigned to the station
+		if (pd.station_qid[sid]!=qi) continue;
+		// ignore master stations because they are handled separately
+		if (os.status.mas == sid+1) continue;
+		if (os.status.mas2== sid+1) continue;
+		bid=sid>>3;
+		s=sid&0x07;
+		// If this is a normal program (not a run-once or test program)
+		// and either the controller is disabled, or
+		// if raining and ignore rain bit is cleared
+		if(q->pid>=99) continue;	// if this is a manually started program, proceed
+		if(!en ||	// if system is disabled, turn off zone
+			 (rd && !(os.attrib_igrd[bid]&(1<<s))) ||	// if rain delay is on and zone does not ignore rain delay, turn it off
+			 (sn1&& !(os.attrib_igs[bid] &(1<<s))) ||	// if sensor1 is on and zone does not ignore sensor1, turn it off
+			 (sn2&& !(os.attrib_igs2[bid]&(1<<s)))) {	// if sensor2 is on and zone does not ignore sensor2, turn it off
+			turn_off_station(sid, curr_time);
 		}
 	}
 }
 
+/** Capacity events
+ * The start and the end of each scheduled queue element, sorted by time.
+ * An event is the queue index times 2, plus 1 for the end of the element.
+ */
+static ulong capacity_event_time(uint16_t e) {
+	RuntimeQueueStruct *q = pd.queue + (e>>1);
+	return (e&1) ? q->st+q->dur : q->st;
+}
+
+/** Add the start and end events of a queue element to the sorted list */
+static void capacity_add(uint16_t *events, uint16_t *ne, qid_t qid) {
+	for(byte k=0;k<2;k++) {
+		uint16_t e = ((uint16_t)qid<<1)|k;
+		ulong t = capacity_event_time(e);
+		uint16_t i;
+		for(i=*ne;i>0 && capacity_event_time(events[i-1])>t;i--) events[i] = events[i-1];
+		events[i] = e;
+		(*ne)++;
+	}
+}
+
+/** Earliest start time from t of a queue element
+ * at which the total learned flow and current stay within the budget while it
+ * runs, and no other element starts at the same second (concurrent stations are
+ * staggered by 1 second). The events are swept once: when the load is over the
+ * budget in a segment between two events, the element cannot start before the
+ * end of that segment.
+ */
+static ulong capacity_start(RuntimeQueueStruct *q, ulong t, const uint16_t *events, uint16_t ne) {
+	ulong max_flow = (ulong)os.iopts[IOPT_MAX_FLOW]*100;
+	ulong max_curr = (ulong)os.iopts[IOPT_MAX_CURRENT]*10;
+	ulong own_flow = os.station_loads[q->sid].flow;
+	ulong own_curr = os.station_loads[q->sid].curr;
+	ulong flow = 0, curr = 0;	// load of the other elements running at time p
+	uint16_t running = 0;
+	ulong p = t, last_start = 0;
+	uint16_t i = 0;
+	while(true) {
+		// apply the events up to p
+		for(;i<ne;i++) {
+			uint16_t e = events[i];
+			ulong et = capacity_event_time(e);
+			if (et > p) break;
+			sid_t sid = pd.queue[e>>1].sid;
+			if (e&1) {
+				flow -= os.station_loads[sid].flow;
+				curr -= os.station_loads[sid].curr;
+				running--;
+			} else {
+				flow += os.station_loads[sid].flow;
+				curr += os.station_loads[sid].curr;
+				running++;
+				last_start = et;
+			}
+		}
+		if (p==t && last_start==t) {
+			p = ++t;	// another element starts at t
+			continue;
+		}
+		ulong next = (i<ne) ? capacity_event_time(events[i]) : ULONG_MAX;
+		// a station that exceeds the budget on its own can still run by itself
+		if (running && ((max_flow && flow+own_flow > max_flow) || (max_curr && curr+own_curr > max_curr))) {
+			if (next == ULONG_MAX) break;
+			p = t = next;
+			continue;
+		}
+		if (next >= t+q->dur) break;
+		p = next;
+	}
+	return t;
+}
+
+/** Capacity-aware scheduling of concurrent stations
+ * Elements are placed in first-fit-decreasing order of their (normalized) load:
+ * each is started at the earliest time from start_time at which the total
+ * learned flow and current stay within IOPT_MAX_FLOW and IOPT_MAX_CURRENT.
+ * Stations that have not been learned yet count as zero load.
+ */
+void schedule_capacity(ulong start_time, qid_t *qids, qid_t n) {
+	ulong max_flow = (ulong)os.iopts[IOPT_MAX_FLOW]*100;
+	ulong max_curr = (ulong)os.iopts[IOPT_MAX_CURRENT]*10;
+	qid_t i, j;
+	// weight of each element: the larger of its flow and current share of the budget
+	uint16_t weights[RUNTIME_QUEUE_SIZE];
+	for(i=0;i<n;i++) {
+		sid_t sid = pd.queue[qids[i]].sid;
+		ulong wf = max_flow ? (ulong)os.station_loads[sid].flow*1000/max_flow : 0;
+		ulong wc = max_curr ? (ulong)os.station_loads[sid].curr*1000/max_curr : 0;
+		ulong w = (wf > wc) ? wf : wc;
+		weights[i] = (w > 65535) ? 65535 : w;
+	}
+	// sort by decreasing weight (insertion sort keeps the queue order for equal weights)
+	for(i=1;i<n;i++) {
+		qid_t qid = qids[i];
+		uint16_t w = weights[i];
+		for(j=i;j>0 && weights[j-1]<w;j--) {
+			qids[j] = qids[j-1];
+			weights[j] = weights[j-1];
+		}
+		qids[j] = qid;
+		weights[j] = w;
+	}
+	// events of the elements already scheduled
+	uint16_t events[2*RUNTIME_QUEUE_SIZE];
+	uint16_t ne = 0;
+	RuntimeQueueStruct *q;
+	for(q=pd.queue;q<pd.queue+pd.nqueue;q++) {
+		if (q->st && q->dur) capacity_add(events, &ne, q-pd.queue);
+	}
+	// place each element at the earliest time it fits
+	for(i=0;i<n;i++) {
+		q = pd.queue + qids[i];
+		ulong t = capacity_start(q, start_time, events, ne);
+		q->st = t;
+		capacity_add(events, &ne, qids[i]);
+		sid_t sid = q->sid;
+		qid_t sqi = pd.station_qid[sid];
+		if (sqi>=pd.nqueue || pd.queue[sqi].st>q->st)	pd.station_qid[sid] = q - pd.queue;
+	}
+}
+
+#if defined(DEMO)
+static bool previewing = false;	// preview_timeline() is running, its scheduler calls are not timed
+#endif
+
 /** Scheduler
  * This function loops through the queue
  * and schedules the start time of each station
+ * Each sequential group runs its own sequential lane,
+ * and the lanes run in parallel with each other
  */
 void schedule_all_stations(ulong curr_time) {
+#if defined(DEMO)
+	if (!previewing) sim_timer_start(SIM_TIMER_SCHED);
+#endif
 
 	ulong con_start_time = curr_time + 1;		// concurrent start time
-	ulong seq_start_time = con_start_time;	// sequential start time
+	ulong seq_start_times[NUM_SEQ_GROUPS];	// sequential start time of each group
 
 	int16_t station_delay = water_time_decode_signed(os.iopts[IOPT_STATION_DELAY_TIME]);
-	// if the sequential queue has stations running
-	if (pd.last_seq_stop_time > curr_time) {
-		seq_start_time = pd.last_seq_stop_time + station_delay;
+	byte gid;
+	for(gid=0;gid<NUM_SEQ_GROUPS;gid++) {
+		seq_start_times[gid] = con_start_time;
+		// if the sequential lane has stations running
+		if (pd.last_seq_stop_times[gid] > curr_time) {
+			seq_start_times[gid] = pd.last_seq_stop_times[gid] + station_delay;
+		}
 	}
 
 	RuntimeQueueStruct *q = pd.queue;
 	byte re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	bool packed = os.iopts[IOPT_CAPACITY_MODE] && (os.iopts[IOPT_MAX_FLOW] || os.iopts[IOPT_MAX_CURRENT]);
+	qid_t deferred[RUNTIME_QUEUE_SIZE];	// concurrent elements left for capacity-aware scheduling
+	qid_t ndeferred = 0;
+	pd.next_event_time = 0;
 	// go through runtime queue and calculate start time of each station
 	for(;q<pd.queue+pd.nqueue;q++) {
 		if(q->st) continue; // if this queue element has already been scheduled, skip
 		if(!q->dur) continue; // if the element has been marked to reset, skip
-		byte sid=q->sid;
+		sid_t sid=q->sid;
 		byte bid=sid>>3;
 		byte s=sid&0x07;
 
 		// if this is a sequential station and the controller is not in remote extension mode
 		// use sequential scheduling. station delay time apples
 		if (os.attrib_seq[bid]&(1<<s) && !re) {
-			// sequential scheduling
-			q->st = seq_start_time;
-			seq_start_time += q->dur;
-			seq_start_time += station_delay; // add station delay time
+			// sequential scheduling in the station's group
+			ulong *sst = seq_start_times + os.attrib_grp[sid];
+			q->st = *sst;
+			*sst += q->dur;
+			*sst += station_delay; // add station delay time
+		} else if (packed) {
+			// concurrent scheduling within the flow/current budget, done after the loop
+			deferred[ndeferred++] = q - pd.queue;
 		} else {
 			// otherwise, concurrent scheduling
 			q->st = con_start_time;
 			// stagger concurrent stations by 1 second
 			con_start_time++;
 		}
+		// assign the element to its station, unless the station has an earlier element
+		qid_t sqi = pd.station_qid[sid];
+		if (q->st && (sqi>=pd.nqueue || pd.queue[sqi].st>q->st))	pd.station_qid[sid] = q - pd.queue;
 		/*DEBUG_PRINT("[");
 		DEBUG_PRINT(sid);
 		DEBUG_PRINT(":");
@@ -1313,6 +1481,176 @@ void schedule_all_stations(ulong curr_time) {
 			}
 		}
 	}
+	if (ndeferred) schedule_capacity(con_start_time, deferred, ndeferred);
+#if defined(DEMO)
+	if (!previewing) sim_timer_stop(SIM_TIMER_SCHED);
+#endif
+}
+
+/** Add the stations of a matched program to the runtime queue
+ * Returns true if at least one station was queued
+ */
+bool enqueue_program(byte pid, ProgramHeader *prog) {
+	bool queued = false;
+	uint16_t i, nzones;
+	const ProgramZone *zones = pd.get_zones(pid, &nzones);
+	RuntimeQueueStruct *q;
+	// only visit the stations with a non-zero water time
+	for(i=0;i<nzones;i++) {
+		sid_t sid = zones[i].sid;
+		if (sid >= os.nstations) break;	// zones are sorted by station index
+		// skip if the station is a master station (because master cannot be scheduled independently
+		if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
+			continue;
+
+		// skip if the station is disabled
+		if (os.attrib_dis[sid>>3]&(1<<(sid&0x07))) continue;
+
+		// water time is scaled by watering percentage
+		ulong water_time = water_time_resolve(zones[i].dur);
+		// if the program is set to use weather scaling
+		if (prog->use_weather) {
+			byte wl = os.iopts[IOPT_WATER_PERCENTAGE];
+			water_time = water_time * wl / 100;
+			if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
+																			// do not water
+				water_time = 0;
+		}
+
+		if (water_time) {
+			// check if water time is still valid
+			// because it may end up being zero after scaling
+			q = pd.enqueue();
+			if (q) {
+				q->st = 0;
+				q->dur = water_time;
+				q->sid = sid;
+				q->pid = pid+1;
+				queued = true;
+			} else {
+				// queue is full
+			}
+		}// if water_time
+	}// for zones
+	return queued;
+}
+
+/** Remove the queue elements that have finished by time t
+ * and update the sequential stop times, as the run loop would do.
+ * Used by the timeline preview
+ */
+static void preview_advance(ulong t, void (*emit)(RuntimeQueueStruct *q)) {
+	byte re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	memset(pd.last_seq_stop_times, 0, NUM_SEQ_GROUPS*sizeof(ulong));
+	int qi;
+	for(qi=pd.nqueue-1;qi>=0;qi--) {
+		RuntimeQueueStruct *q = pd.queue+qi;
+		ulong et = q->st+q->dur;
+		if (t >= et) {
+			emit(q);
+			pd.dequeue(qi);
+			continue;
+		}
+		sid_t sid = q->sid;
+		if (os.attrib_seq[sid>>3]&(1<<(sid&0x07)) && !re) {
+			ulong *sst = pd.last_seq_stop_times + os.attrib_grp[sid];
+			if (et > *sst) *sst = et;
+		}
+	}
+}
+
+/** Drop the runs that process_dynamic_events() would turn off:
+ * all runs if the controller is disabled, otherwise the runs of stations that do not ignore rain delay.
+ * Used by the timeline preview
+ */
+static void preview_suppress(bool disabled) {
+	int qi;
+	for(qi=pd.nqueue-1;qi>=0;qi--) {
+		sid_t sid = pd.queue[qi].sid;
+		if (disabled || !(os.attrib_igrd[sid>>3]&(1<<(sid&0x07)))) pd.dequeue(qi);
+	}
+}
+
+/** Preview the watering timeline between start and end (local time)
+ * Programs are matched and scheduled with the same code as the main loop,
+ * on an empty runtime queue. The real runtime state is restored afterwards.
+ * The current rain delay (until nvdata.rd_stop_time) and a disabled controller are
+ * taken into account, sensors and pause are not.
+ * emit is called for every station run of the programs starting before end, in order of end time.
+ * Returns false if there is not enough memory to save the runtime state.
+ */
+bool preview_timeline(ulong start, ulong end, void (*emit)(RuntimeQueueStruct *q)) {
+	// save the runtime state
+	qid_t nqueue = pd.nqueue;
+	RuntimeQueueStruct *saved_queue = (RuntimeQueueStruct*)malloc(nqueue*sizeof(RuntimeQueueStruct)+1);
+	qid_t *saved_qid = (qid_t*)malloc(MAX_NUM_STATIONS*sizeof(qid_t));
+	if (!saved_queue || !saved_qid) {
+		free(saved_queue);
+		free(saved_qid);
+		return false;
+	}
+	memcpy(saved_queue, pd.queue, nqueue*sizeof(RuntimeQueueStruct));
+	memcpy(saved_qid, pd.station_qid, MAX_NUM_STATIONS*sizeof(qid_t));
+	ulong saved_seq_stop_times[NUM_SEQ_GROUPS];
+	memcpy(saved_seq_stop_times, pd.last_seq_stop_times, NUM_SEQ_GROUPS*sizeof(ulong));
+	ulong saved_next_event_time = pd.next_event_time;
+	uint16_t saved_overflows = pd.queue_overflows;
+	byte saved_busy = os.status.program_busy;
+
+	pd.nqueue = 0;
+	memset(pd.station_qid, 0xFF, MAX_NUM_STATIONS*sizeof(qid_t));
+	// keep schedule_all_stations from starting a flow count
+	os.status.program_busy = 1;
+#if defined(DEMO)
+	previewing = true;
+#endif
+
+	bool disabled = !os.status.enabled;
+	ulong rd_stop = os.status.rain_delayed ? os.nvdata.rd_stop_time : 0;
+
+	// the next start time of each program
+	ulong nexts[MAX_NUM_PROGRAMS];
+	byte pid;
+	for(pid=0;pid<pd.nprograms;pid++) {
+		nexts[pid] = pd.get(pid)->next_match(start, pd.get_schedule(pid));
+	}
+	while(true) {
+		ulong t = ULONG_MAX;
+		for(pid=0;pid<pd.nprograms;pid++) {
+			if (nexts[pid] && nexts[pid] < t) t = nexts[pid];
+		}
+		if (t >= end) break;
+		preview_advance(t, emit);
+		bool match_found = false;
+		for(pid=0;pid<pd.nprograms;pid++) {
+			if (nexts[pid] != t) continue;
+			ProgramHeader *prog = pd.get(pid);
+			ProgramSchedule *sched = pd.get_schedule(pid);
+			if (prog->check_match(t, sched) && enqueue_program(pid, prog)) match_found = true;
+			nexts[pid] = pd.get(pid)->next_match(t+60, pd.get_schedule(pid));
+		}
+		if (match_found) {
+			schedule_all_stations(t);
+			if (disabled || t < rd_stop) preview_suppress(disabled);
+		}
+	}
+	// flush the stations still scheduled at the end
+	preview_advance(ULONG_MAX, emit);
+
+	// restore the runtime state
+	memcpy(pd.queue, saved_queue, nqueue*sizeof(RuntimeQueueStruct));
+	pd.nqueue = nqueue;
+	memcpy(pd.station_qid, saved_qid, MAX_NUM_STATIONS*sizeof(qid_t));
+	memcpy(pd.last_seq_stop_times, saved_seq_stop_times, NUM_SEQ_GROUPS*sizeof(ulong));
+	pd.next_event_time = saved_next_event_time;
+	pd.queue_overflows = saved_overflows;
+	os.status.program_busy = saved_busy;
+#if defined(DEMO)
+	previewing = false;
+#endif
+	free(saved_queue);
+	free(saved_qid);
+	return true;
 }
 
 /** Immediately reset all stations
@@ -1336,6 +1674,7 @@ void reset_all_stations() {
 	for(;q<pd.queue+pd.nqueue;q++) {
 		q->dur = 0;
 	}
+	pd.next_event_time = 0;
 }
 
 
@@ -1347,11 +1686,16 @@ void reset_all_stations() {
 void manual_start_program(byte pid, byte uwt) {
 	boolean match_found = false;
 	reset_all_stations_immediate();
-	ProgramStruct prog;
+	ProgramHeader *prog = NULL;
+	const ProgramZone *zones = NULL;
+	uint16_t nzones = 0;
 	ulong dur;
-	byte sid, bid, s;
+	sid_t sid;
+	byte bid, s;
 	if ((pid>0)&&(pid<255)) {
-		pd.read(pid-1, &prog);
+		prog = pd.get(pid-1);
+		if (!prog) return;
+		zones = pd.get_zones(pid-1, &nzones);
 		push_message(NOTIFY_PROGRAM_SCHED, pid-1, uwt?os.iopts[IOPT_WATER_PERCENTAGE]:100, "");
 	}
 	for(sid=0;sid<os.nstations;sid++) {
@@ -1362,8 +1706,11 @@ void manual_start_program(byte pid, byte uwt) {
 			continue;		 
 		dur = 60;
 		if(pid==255)	dur=2;
-		else if(pid>0)
-			dur = water_time_resolve(prog.durations[sid]);
+		else if(pid>0) {
+			// zones are sorted by station index
+			while(nzones && zones->sid<sid) { zones++; nzones--; }
+			dur = (nzones && zones->sid==sid) ? water_time_resolve(zones->dur) : 0;
+		}
 		if(uwt) {
 			dur = dur * os.iopts[IOPT_WATER_PERCENTAGE] / 100;
 		}
@@ -1448,11 +1795,7 @@ void push_message(int type, uint32_t lval, float fval, const char* sval) {
 				if (sval) strcat_P(postval, PSTR("Manually scheduled "));
 				else strcat_P(postval, PSTR("Automatically scheduled "));
 				strcat_P(postval, PSTR("Program "));
-				{
-					ProgramStruct prog;
-					pd.read(lval, &prog);
-					if(lval<pd.nprograms) strcat(postval, prog.name);
-				}
+				if(lval<pd.nprograms) strcat(postval, pd.get(lval)->name);
 				sprintf_P(postval+strlen(postval), PSTR(" with %d%% water level."), (int)fval);
 			}
 			break;
@@ -1563,7 +1906,7 @@ void push_message(int type, uint32_t lval, float fval, const char* sval) {
 		strcat_P(postval, PSTR("\"}"));
 
 		//char postBuffer[1500];
-		BufferFiller bf = ether_buffer;
+		BufferFiller bf(ether_buffer, ETHER_BUFFER_SIZE);
 		bf.emit_p(PSTR("POST /trigger/sprinkler/with/key/$O HTTP/1.0\r\n"
 						"Host: $S\r\n"
 						"Accept: */*\r\n"
@@ -1575,239 +1918,6 @@ void push_message(int type, uint32_t lval, float fval, const char* sval) {
 	}
 }
 
-// ================================
-// ====== LOGGING FUNCTIONS =======
-// ================================
-#if defined(ARDUINO)
-	#if defined(ESP32)
-	char LOG_PREFIX[] = "/logs";
-	#else
-	char LOG_PREFIX[] = "/logs/";
-	#endif
-#else
-char LOG_PREFIX[] = "./logs/";
-#endif
-
-/** Generate log file name
- * Log files will be named /logs/xxxxx.txt
- */
-void make_logfile_name(char *name) {
-#if defined(ARDUINO)
-	#if !defined(ESP8266) && !defined(ESP32)
-	sd.chdir("/");
-	#endif
-#endif
-	strcpy(tmp_buffer+TMP_BUFFER_SIZE-10, name);
-	strcpy(tmp_buffer, LOG_PREFIX);
-	#if defined(ESP32)
-	strcat_P(tmp_buffer, PSTR("/"));
-	#endif 
-	strcat(tmp_buffer, tmp_buffer+TMP_BUFFER_SIZE-10);
-	strcat_P(tmp_buffer, PSTR(".txt"));
-}
-
-/* To save RAM space, we store log type names
- * in program memory, and each name
- * must be strictly two characters with an ending 0
- * so each name is 3 characters total
- */
-static const char log_type_names[] PROGMEM =
-	"  \0"
-	"s1\0"
-	"rd\0"
-	"wl\0"
-	"fl\0"
-	"s2\0"
-	"cu\0";
-
-/** write run record to log on SD card */
-void write_log(byte type, ulong curr_time) {
-
-	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
-
-	// file name will be logs/xxxxx.tx where xxxxx is the day in epoch time
-	ultoa(curr_time / 86400, tmp_buffer, 10);
-	make_logfile_name(tmp_buffer);
-
-	// Step 1: open file if exists, or create new otherwise, 
-	// and move file pointer to the end  
-#if defined(ARDUINO) // prepare log folder for Arduino
-
-	#if defined(ESP8266)
-	File file = SPIFFS.open(tmp_buffer, "r+");
-	if(!file) {
-		file = SPIFFS.open(tmp_buffer, "w");
-		if(!file) return;
-	}
-	file.seek(0, SeekEnd);
-
-	#elif defined(ESP32)
-  
-	File file;
-	
-	if( SPIFFS.exists(tmp_buffer) )
-		file = SPIFFS.open(tmp_buffer, "r+"); 
-	else 
-		file = SPIFFS.open(tmp_buffer, "w");
-
-	if(!file) return;
-	file.seek(0, SeekEnd);	
-	#else
-	sd.chdir("/");
-	if (sd.chdir(LOG_PREFIX) == false) {
-		// create dir if it doesn't exist yet
-		if (sd.mkdir(LOG_PREFIX) == false) {
-			return;
-		}
-	}
-	SdFile file;
-	int ret = file.open(tmp_buffer, O_CREAT | O_WRITE );
-	file.seekEnd();
-	if(!ret) {
-		return;
-	}
-	#endif
-	
-#else // prepare log folder for RPI/BBB
-	struct stat st;
-	if(stat(get_filename_fullpath(LOG_PREFIX), &st)) {
-		if(mkdir(get_filename_fullpath(LOG_PREFIX), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH)) {
-			return;
-		}
-	}
-	FILE *file;
-	file = fopen(get_filename_fullpath(tmp_buffer), "rb+");
-	if(!file) {
-		file = fopen(get_filename_fullpath(tmp_buffer), "wb");
-		if (!file)	return;
-	}
-	fseek(file, 0, SEEK_END);
-#endif	// prepare log folder
-	
-	// Step 2: prepare data buffer
-	strcpy_P(tmp_buffer, PSTR("["));
-
-	if(type == LOGDATA_STATION) {
-		itoa(pd.lastrun.program, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(","));
-		itoa(pd.lastrun.station, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(","));
-		// duration is unsigned integer
-		ultoa((ulong)pd.lastrun.duration, tmp_buffer+strlen(tmp_buffer), 10);
-	} else {
-		ulong lvalue=0;
-		if(type==LOGDATA_FLOWSENSE) {
-			lvalue = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
-		}
-		ultoa(lvalue, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(",\""));
-		strcat_P(tmp_buffer, log_type_names+type*3);
-		strcat_P(tmp_buffer, PSTR("\","));
-
-		switch(type) {
-			case LOGDATA_FLOWSENSE:
-				lvalue = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
-				break;
-			case LOGDATA_SENSOR1:
-				lvalue = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
-				break;
-			case LOGDATA_SENSOR2:
-				lvalue = (curr_time>os.sensor2_active_lasttime)?(curr_time-os.sensor2_active_lasttime):0;
-				break;
-			case LOGDATA_RAINDELAY:
-				lvalue = (curr_time>os.raindelay_on_lasttime)?(curr_time-os.raindelay_on_lasttime):0;
-				break;
-			case LOGDATA_WATERLEVEL:
-				lvalue = os.iopts[IOPT_WATER_PERCENTAGE];
-				break;
-		}
-		ultoa(lvalue, tmp_buffer+strlen(tmp_buffer), 10);
-	}
-	strcat_P(tmp_buffer, PSTR(","));
-	ultoa(curr_time, tmp_buffer+strlen(tmp_buffer), 10);
-	if((os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) && (type==LOGDATA_STATION)) {
-		// RAH implementation of flow sensor
-		strcat_P(tmp_buffer, PSTR(","));
-		#if defined(ARDUINO)
-		dtostrf(flow_last_gpm,5,2,tmp_buffer+strlen(tmp_buffer));
-		#else
-		sprintf(tmp_buffer+strlen(tmp_buffer), "%5.2f", flow_last_gpm);
-		#endif
-	}
-	strcat_P(tmp_buffer, PSTR("]\r\n"));
-
-#if defined(ARDUINO)
-	#if defined(ESP8266) || defined(ESP32)
-	file.write((byte*)tmp_buffer, strlen(tmp_buffer));
-	#else
-	file.write(tmp_buffer);
-	#endif
-	file.close();
-#else
-	fwrite(tmp_buffer, 1, strlen(tmp_buffer), file);
-	fclose(file);
-#endif
-}
-
-
-/** Delete log file
- * If name is 'all', delete all logs
- */
-void delete_log(char *name) {
-	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
-#if defined(ARDUINO)
-
-	#if defined(ESP8266) || defined(ESP32)
-	if (strncmp(name, "all", 3) == 0) {
-		// delete all log files
-	#if defined(ESP8266)
-	  Dir dir = SPIFFS.openDir(LOG_PREFIX);
-		  while (dir.next()) {
-			  SPIFFS.remove(dir.fileName()); 
- 
-	#elif defined(ESP32)
-	File root = SPIFFS.open(LOG_PREFIX);
-	File file = root.openNextFile();   
-		while(file){
-		SPIFFS.remove(file.name());
-		file = root.openNextFile();
-	#endif
-		}
-	} else {
-		// delete a single log file
-		make_logfile_name(name);
-		if(!SPIFFS.exists(tmp_buffer)) return;
-		SPIFFS.remove(tmp_buffer);
-	}
-	#else
-	if (strncmp(name, "all", 3) == 0) {
-		// delete the log folder
-		SdFile file;
-
-		if (sd.chdir(LOG_PREFIX)) {
-			// delete the whole log folder
-			sd.vwd()->rmRfStar();
-		}
-	} else {
-		// delete a single log file
-		make_logfile_name(name);
-		if (!sd.exists(tmp_buffer))  return;
-		sd.remove(tmp_buffer);
-	}
-	#endif
-	
-#else // delete_log implementation for RPI/BBB
-	if (strncmp(name, "all", 3) == 0) {
-		// delete the log folder
-		rmdir(get_filename_fullpath(LOG_PREFIX));
-		return;
-	} else {
-		make_logfile_name(name);
-		remove(get_filename_fullpath(tmp_buffer));
-	}
-#endif
-}
-
 /** Perform network check
  * This function pings the router
  * to check if it's still online.
@@ -1929,12 +2039,30 @@ void perform_ntp_sync() {
 }
 
 #if !defined(ARDUINO) // main function for RPI/BBB
+static volatile sig_atomic_t quit_requested = 0;
+
+/** On SIGTERM / SIGINT, leave the main loop so that pending log records are written */
+static void handle_signal(int sig) {
+	quit_requested = 1;
+}
+
 int main(int argc, char *argv[]) {
+	// a client that disconnects must not kill the process: writes to its socket
+	// (e.g. sendfile() in server_export_log) return EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+#if defined(DEMO)
+	// simulation mode: OpenSprinkler -s <scenario file>
+	if (argc > 2 && !strcmp(argv[1], "-s")) return sim_main(argv[2]);
+#endif
 	do_setup();
+	signal(SIGTERM, handle_signal);
+	signal(SIGINT, handle_signal);
 
-	while(true) {
+	while(!quit_requested) {
 		do_loop();
 	}
+	log_flush();
+	os.config_flush();
 	return 0;
 }
 #endif
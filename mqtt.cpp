@@ -163,18 +163,18 @@ void OSMqtt::begin( const char * host, int port, const char * username, const ch
 	}
 }
 
-// Publish an MQTT message to a specific topic
-void OSMqtt::publish(const char *topic, const char *payload) {
+// Publish an MQTT message to a specific topic, returns true if the message was handed to the broker connection
+bool OSMqtt::publish(const char *topic, const char *payload) {
 	DEBUG_LOGF("MQTT Publish: %s %s\n", topic, payload);
 
-	if (mqtt_client == NULL || !_enabled || os.status.network_fails > 0) return;
+	if (mqtt_client == NULL || !_enabled || os.status.network_fails > 0) return false;
 
 	if (!_connected()) {
 		DEBUG_LOGF("MQTT Publish: Not connected\n");
-		return;
+		return false;
 	}
 
-	_publish(topic, payload);
+	return _publish(topic, payload) == MQTT_SUCCESS;
 }
 
 // Regularly call the loop function to ensure "keep alive" messages are sent to the broker and to reconnect if needed.
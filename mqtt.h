@@ -47,7 +47,7 @@ public:
     static void begin(void);
     static void begin(const char * host, int port, const char * username, const char * password, bool enable);
     static bool enabled(void) { return _enabled; };
-    static void publish(const char *topic, const char *payload);
+    static bool publish(const char *topic, const char *payload);
     static void loop(void);
 };
 
@@ -33,33 +33,106 @@
 
 // Declare static data members
 byte ProgramData::nprograms = 0;
-byte ProgramData::nqueue = 0;
+qid_t ProgramData::nqueue = 0;
 RuntimeQueueStruct ProgramData::queue[RUNTIME_QUEUE_SIZE];
-byte ProgramData::station_qid[MAX_NUM_STATIONS];
+qid_t ProgramData::station_qid[MAX_NUM_STATIONS];
 LogStruct ProgramData::lastrun;
-ulong ProgramData::last_seq_stop_time;
+ulong ProgramData::last_seq_stop_times[NUM_SEQ_GROUPS];
+ulong ProgramData::next_event_time = 0;
+uint16_t ProgramData::queue_overflows = 0;
+#if defined(PROGRAM_CACHE_ENABLE)
+ProgramHeader ProgramData::progs[MAX_NUM_PROGRAMS];
+ProgramZone *ProgramData::zones[MAX_NUM_PROGRAMS];
+uint16_t ProgramData::nzones[MAX_NUM_PROGRAMS];
+ProgramSchedule ProgramData::scheds[MAX_NUM_PROGRAMS];
+#else
+ProgramHeader ProgramData::prog_buf;
+ProgramZone ProgramData::zone_buf[MAX_NUM_STATIONS];
+uint16_t ProgramData::zone_buf_n = 0;
+ProgramSchedule ProgramData::sched_buf;
+byte ProgramData::prog_buf_pid = 0xFF;
+#endif
+byte ProgramData::log_file = 0;
+uint32_t ProgramData::log_generation = 0;
+ulong ProgramData::log_end = 0;
+ulong ProgramData::log_dead = 0;
+ulong ProgramData::prog_pos[MAX_NUM_PROGRAMS];
+int16_t ProgramData::sched_sunrise_time = -1;
+int16_t ProgramData::sched_sunset_time = -1;
+ulong ProgramData::next_runs[MAX_NUM_PROGRAMS];
+ulong ProgramData::next_run_time = 0;
+byte ProgramData::next_runs_tz = 0;
+bool ProgramData::next_runs_dirty = true;
 extern char tmp_buffer[];
 
+#define PROGRAM_ZONE_CHUNK	16	// number of zones read / written at a time
+
+/** Program record of the v1 program file (a fixed size record with
+ * the water time of every station), only used for migration */
+struct ProgramRecordV1 {
+	byte flags;
+	byte days[2];
+	int16_t starttimes[MAX_NUM_STARTTIMES];
+	uint16_t durations[MAX_NUM_STATIONS];
+	char name[PROGRAM_NAME_SIZE];
+};
+
+/** Number of stations with a non-zero water time */
+static uint16_t program_zone_count(const ProgramStruct *buf) {
+	uint16_t n = 0;
+	for(sid_t sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		if (buf->durations[sid]) n++;
+	}
+	return n;
+}
+
+/** Check a program log entry read from the given file position
+ * The entry is valid if it is complete and its checksum matches
+ */
+static bool log_entry_valid(const char *fn, ulong pos, const ProgramLogEntry *e) {
+	if (e->op<PROG_LOG_ADD || e->op>PROG_LOG_CLEAR) return false;
+	if (e->op==PROG_LOG_ADD || e->op==PROG_LOG_MODIFY) {
+		if (e->len<PROGRAMRECORD_SIZE(0) || e->len>PROGRAMRECORD_SIZE(MAX_NUM_STATIONS)) return false;
+	} else if (e->len) {
+		return false;
+	}
+	uint16_t sum = 0;
+	ulong len, n;
+	for(pos+=sizeof(ProgramLogEntry),len=e->len;len;len-=n,pos+=n) {
+		n = (len<TMP_BUFFER_SIZE) ? len : TMP_BUFFER_SIZE;
+		file_read_block(fn, tmp_buffer, pos, n);
+		checksum_update(&sum, tmp_buffer, n);
+	}
+	checksum_update(&sum, e, offsetof(ProgramLogEntry, sum));
+	return sum == e->sum;
+}
+
 void ProgramData::init() {
 	reset_runtime();
-	load_count();
+	load_all();
+	migrate();
+	invalidate_next_runs();
 }
 
 void ProgramData::reset_runtime() {
-	memset(station_qid, 0xFF, MAX_NUM_STATIONS);	// reset station qid to 0xFF
+	memset(station_qid, 0xFF, sizeof(station_qid));	// reset station qid to QID_NONE
 	nqueue = 0;
-	last_seq_stop_time = 0;
+	memset(last_seq_stop_times, 0, sizeof(last_seq_stop_times));
+	next_event_time = 0;
 }
 
 /** Insert a new element to the queue
  * This function returns pointer to the next available element in the queue
- * and returns NULL if the queue is full
+ * and returns NULL if the queue is full (the overflow is counted in queue_overflows)
  */
 RuntimeQueueStruct* ProgramData::enqueue() {
 	if (nqueue < RUNTIME_QUEUE_SIZE) {
 		nqueue ++;
+		next_event_time = 0;
 		return queue + (nqueue-1);
 	} else {
+		if (queue_overflows < 0xFFFF) queue_overflows ++;
+		DEBUG_PRINTLN(F("runtime queue full"));
 		return NULL;
 	}
 }
@@ -68,48 +141,477 @@ RuntimeQueueStruct* ProgramData::enqueue() {
  * This function copies the last element of
  * the queue to overwrite the requested
  * element, therefore removing the requested element.
+ * If the element was assigned to its station, the station's
+ * next queue element (if any) is assigned to it.
  */
 // this removes an element from the queue
-void ProgramData::dequeue(byte qid) {
+void ProgramData::dequeue(qid_t qid) {
 	if (qid>=nqueue)	return;
+	sid_t sid = queue[qid].sid;
+	bool assigned = (station_qid[sid] == qid);
+	if (assigned) station_qid[sid] = QID_NONE;
 	if (qid<nqueue-1) {
 		queue[qid] = queue[nqueue-1]; // copy the last element to the dequeud element to fill the space
 		if(station_qid[queue[qid].sid] == nqueue-1) // fix queue index if necessary
 			station_qid[queue[qid].sid] = qid;
 	}
 	nqueue--;
+	if (assigned) assign_station(sid);
+	next_event_time = 0;
 }
 
-/** Load program count from program file */
-byte ProgramData::load_count() {
-	nprograms = file_read_byte(PROG_FILENAME, 0);
-	return nprograms;
+/** Assign the queue element of a station with the earliest start time to the station */
+void ProgramData::assign_station(sid_t sid) {
+	qid_t qid;
+	for(qid=0;qid<nqueue;qid++) {
+		if (queue[qid].sid != sid) continue;
+		qid_t sqi = station_qid[sid];
+		if (sqi<nqueue && queue[sqi].st<=queue[qid].st) continue;
+		station_qid[sid] = qid;
+	}
+}
+
+/** Load all programs from the program log into RAM */
+void ProgramData::load_all() {
+	log_open();
+#if defined(PROGRAM_CACHE_ENABLE)
+	const char *fn = log_filename(log_file);
+	uint16_t n;
+	for(byte pid=0;pid<nprograms;pid++) {
+		ulong pos = prog_pos[pid];
+		file_read_block(fn, progs+pid, pos, PROGRAMHEADER_SIZE);
+		file_read_block(fn, &n, pos+PROGRAMHEADER_SIZE, sizeof(n));
+		free(zones[pid]);
+		zones[pid] = n ? (ProgramZone*)malloc(n*sizeof(ProgramZone)) : NULL;
+		nzones[pid] = zones[pid] ? n : 0;
+		if (nzones[pid]) {
+			file_read_block(fn, zones[pid], pos+PROGRAMRECORD_SIZE(0), n*sizeof(ProgramZone));
+		} else if (n) {
+			DEBUG_PRINTLN(F("out of memory loading program"));
+		}
+	}
+	compile_all();
+#else
+	prog_buf_pid = 0xFF;
+#endif
 }
 
-/** Save program count to program file */
-void ProgramData::save_count() {
-	file_write_byte(PROG_FILENAME, 0, nprograms);
+/** Convert the program files of older firmwares
+ * Both start with the program count. v1 stores a fixed size record
+ * (ProgramRecordV1) per program, v2 stores program records back to back.
+ * The old file is removed once its programs are added to the log,
+ * an interrupted migration starts over on the next start up.
+ */
+void ProgramData::migrate() {
+	ProgramStruct prog;
+	byte pid, n;
+	ulong pos;
+	if (file_exists(PROG_V2_FILENAME)) {
+		DEBUG_PRINTLN(F("migrating program file"));
+		eraseall();
+		n = file_read_byte(PROG_V2_FILENAME, 0);
+		for(pid=0,pos=1;pid<n && pid<MAX_NUM_PROGRAMS;pid++) {
+			pos += read_record(PROG_V2_FILENAME, pos, &prog);
+			add(&prog);
+		}
+		remove_file(PROG_V2_FILENAME);
+	}
+	if (file_exists(PROG_V1_FILENAME)) {
+		DEBUG_PRINTLN(F("migrating program file"));
+		eraseall();
+		n = file_read_byte(PROG_V1_FILENAME, 0);
+		for(pid=0,pos=1;pid<n && pid<MAX_NUM_PROGRAMS;pid++,pos+=sizeof(ProgramRecordV1)) {
+			// flags, days and start times are laid out the same as in the program header
+			file_read_block(PROG_V1_FILENAME, &prog, pos, offsetof(ProgramRecordV1, durations));
+			file_read_block(PROG_V1_FILENAME, prog.durations, pos+offsetof(ProgramRecordV1, durations), sizeof(prog.durations));
+			file_read_block(PROG_V1_FILENAME, prog.name, pos+offsetof(ProgramRecordV1, name), PROGRAM_NAME_SIZE);
+			add(&prog);
+		}
+		remove_file(PROG_V1_FILENAME);
+	}
+}
+
+const char* ProgramData::log_filename(byte f) {
+	return f ? PROG_ALT_FILENAME : PROG_FILENAME;
+}
+
+/** Open the newest valid program log and replay it to rebuild the program index
+ * An empty log is created if there is none. Replay stops at the first
+ * invalid entry, which is where the next entry is appended.
+ */
+void ProgramData::log_open() {
+	ProgramLogHeader h[2];
+	byte f;
+	for(f=0;f<2;f++) {
+		memset(h+f, 0, sizeof(ProgramLogHeader));
+		if (file_exists(log_filename(f))) file_read_block(log_filename(f), h+f, 0, sizeof(ProgramLogHeader));
+	}
+	bool valid0 = (h[0].magic == PROG_LOG_MAGIC);
+	bool valid1 = (h[1].magic == PROG_LOG_MAGIC);
+	if (!valid0 && !valid1) {
+		remove_file(PROG_FILENAME);
+		h[0].magic = PROG_LOG_MAGIC;
+		h[0].generation = 0;
+		file_write_block(PROG_FILENAME, h, 0, sizeof(ProgramLogHeader));
+		valid0 = true;
+	}
+	log_file = (valid1 && (!valid0 || h[1].generation > h[0].generation)) ? 1 : 0;
+	log_generation = h[log_file].generation;
+	// the other file is outdated or left from an interrupted compaction
+	remove_file(log_filename(1-log_file));
+
+	const char *fn = log_filename(log_file);
+	ProgramLogEntry e;
+	ulong pos = sizeof(ProgramLogHeader);
+	nprograms = 0;
+	log_dead = 0;
+	while(true) {
+		memset(&e, 0, sizeof(e));
+		file_read_block(fn, &e, pos, sizeof(e));
+		if (!log_entry_valid(fn, pos, &e)) break;
+		log_apply(&e, pos);
+		pos += sizeof(e)+e.len;
+	}
+	log_end = pos;
+}
+
+/** Apply a log entry at the given file position to the program index */
+void ProgramData::log_apply(const ProgramLogEntry *e, ulong pos) {
+	ulong rec = pos+sizeof(ProgramLogEntry);
+	byte pid = e->pid;
+	switch(e->op) {
+	case PROG_LOG_ADD:
+		if (nprograms < MAX_NUM_PROGRAMS) {
+			prog_pos[nprograms++] = rec;
+			return;
+		}
+		break;
+	case PROG_LOG_MODIFY:
+		if (pid < nprograms) {
+			log_dead += record_size(pid);
+			prog_pos[pid] = rec;
+			return;
+		}
+		break;
+	case PROG_LOG_DELETE:
+		if (pid < nprograms) {
+			log_dead += record_size(pid);
+			memmove(prog_pos+pid, prog_pos+pid+1, (nprograms-pid-1)*sizeof(ulong));
+			nprograms--;
+		}
+		break;
+	case PROG_LOG_MOVEUP:
+		if (pid > 0 && pid < nprograms) {
+			ulong p = prog_pos[pid-1];
+			prog_pos[pid-1] = prog_pos[pid];
+			prog_pos[pid] = p;
+		}
+		break;
+	case PROG_LOG_CLEAR:
+		nprograms = 0;
+		log_dead = pos-sizeof(ProgramLogHeader);
+		break;
+	}
+	// the entry itself is superseded unless it holds a live program record
+	log_dead += sizeof(ProgramLogEntry)+e->len;
+}
+
+/** Append an entry to the program log, followed by the program record for add / modify
+ * The checksum is computed before anything is written, so the entry and the
+ * record are written in file order at the end of the log. A torn append
+ * fails the checksum and is dropped on start up.
+ */
+void ProgramData::log_append(byte op, byte pid, const ProgramStruct *buf) {
+	const char *fn = log_filename(log_file);
+	ProgramLogEntry e;
+	uint16_t sum = 0;
+	e.op = op;
+	e.pid = pid;
+	e.len = buf ? write_record(NULL, 0, buf, &sum) : 0;
+	checksum_update(&sum, &e, offsetof(ProgramLogEntry, sum));
+	e.sum = sum;
+	file_write_block(fn, &e, log_end, sizeof(e));
+	if (buf) write_record(fn, log_end+sizeof(e), buf, &sum);
+	log_apply(&e, log_end);
+	log_end += sizeof(e)+e.len;
+	if (log_dead > PROG_LOG_SLACK && log_dead > log_end/2) log_compact();
+}
+
+/** Copy a program record to another log file, adding its bytes to the checksum
+ * With no destination file the record is only summed
+ */
+void ProgramData::copy_record(const char *from, ulong src, const char *to, ulong dst, ulong len, uint16_t *sum) {
+	ulong n;
+	for(;len;len-=n,src+=n,dst+=n) {
+		n = (len<TMP_BUFFER_SIZE) ? len : TMP_BUFFER_SIZE;
+		file_read_block(from, tmp_buffer, src, n);
+		checksum_update(sum, tmp_buffer, n);
+		if (to) file_write_block(to, tmp_buffer, dst, n);
+	}
+}
+
+/** Write the current programs to the other log file and switch to it
+ * The file is written front to back, starting with a header that is not
+ * valid yet. The new log becomes valid when the header is rewritten with
+ * the magic at the end, until then a power cut leaves the current log in use.
+ */
+void ProgramData::log_compact() {
+	const char *from = log_filename(log_file);
+	const char *to = log_filename(1-log_file);
+	ProgramLogHeader h;
+	ProgramLogEntry e;
+	ulong pos = sizeof(ProgramLogHeader);
+	uint16_t sum;
+	remove_file(to);
+	h.magic = 0;
+	h.generation = log_generation+1;
+	file_write_block(to, &h, 0, sizeof(h));
+	for(byte pid=0;pid<nprograms;pid++) {
+		e.op = PROG_LOG_ADD;
+		e.pid = pid;
+		e.len = record_size(pid)-sizeof(ProgramLogEntry);
+		sum = 0;
+		copy_record(from, prog_pos[pid], NULL, 0, e.len, &sum);
+		checksum_update(&sum, &e, offsetof(ProgramLogEntry, sum));
+		e.sum = sum;
+		file_write_block(to, &e, pos, sizeof(e));
+		copy_record(from, prog_pos[pid], to, pos+sizeof(e), e.len, &sum);
+		prog_pos[pid] = pos+sizeof(e);
+		pos += sizeof(e)+e.len;
+	}
+	h.magic = PROG_LOG_MAGIC;
+	file_write_block(to, &h, 0, sizeof(h));
+	remove_file(from);
+	log_file = 1-log_file;
+	log_generation = h.generation;
+	log_end = pos;
+	log_dead = 0;
+}
+
+/** Size of the log entry holding the current record of a program */
+ulong ProgramData::record_size(byte pid) {
+	uint16_t n = 0;
+	file_read_block(log_filename(log_file), &n, prog_pos[pid]+PROGRAMHEADER_SIZE, sizeof(n));
+	return sizeof(ProgramLogEntry)+PROGRAMRECORD_SIZE(n);
+}
+
+/** Write a program record at the given file position
+ * Only stations with a non-zero water time are stored. The written
+ * bytes are added to the checksum, this returns the size of the record.
+ * With no file name the record is only summed
+ */
+ulong ProgramData::write_record(const char *fn, ulong pos, const ProgramStruct *buf, uint16_t *sum) {
+	ProgramZone chunk[PROGRAM_ZONE_CHUNK];
+	uint16_t n = program_zone_count(buf), k = 0;
+	if (fn) file_write_block(fn, buf, pos, PROGRAMHEADER_SIZE);
+	checksum_update(sum, buf, PROGRAMHEADER_SIZE);
+	if (fn) file_write_block(fn, &n, pos+PROGRAMHEADER_SIZE, sizeof(n));
+	checksum_update(sum, &n, sizeof(n));
+	pos += PROGRAMRECORD_SIZE(0);
+	for(sid_t sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		if (!buf->durations[sid]) continue;
+		chunk[k].sid = sid;
+		chunk[k].dur = buf->durations[sid];
+		if (++k == PROGRAM_ZONE_CHUNK) {
+			if (fn) file_write_block(fn, chunk, pos, k*sizeof(ProgramZone));
+			checksum_update(sum, chunk, k*sizeof(ProgramZone));
+			pos += k*sizeof(ProgramZone);
+			k = 0;
+		}
+	}
+	if (k) {
+		if (fn) file_write_block(fn, chunk, pos, k*sizeof(ProgramZone));
+		checksum_update(sum, chunk, k*sizeof(ProgramZone));
+	}
+	return PROGRAMRECORD_SIZE(n);
+}
+
+/** Read a program record at the given file position into the expanded form
+ * This returns the size of the record
+ */
+ulong ProgramData::read_record(const char *fn, ulong pos, ProgramStruct *buf) {
+	ProgramZone chunk[PROGRAM_ZONE_CHUNK];
+	uint16_t n, k, i, left;
+	file_read_block(fn, buf, pos, PROGRAMHEADER_SIZE);
+	file_read_block(fn, &n, pos+PROGRAMHEADER_SIZE, sizeof(n));
+	memset(buf->durations, 0, sizeof(buf->durations));
+	for(pos+=PROGRAMRECORD_SIZE(0),left=n;left;left-=k,pos+=k*sizeof(ProgramZone)) {
+		k = (left<PROGRAM_ZONE_CHUNK) ? left : PROGRAM_ZONE_CHUNK;
+		file_read_block(fn, chunk, pos, k*sizeof(ProgramZone));
+		for(i=0;i<k;i++) {
+			if (chunk[i].sid < MAX_NUM_STATIONS) buf->durations[chunk[i].sid] = chunk[i].dur;
+		}
+	}
+	return PROGRAMRECORD_SIZE(n);
+}
+
+#if defined(PROGRAM_CACHE_ENABLE)
+/** Update the RAM copy of a program and compile it */
+void ProgramData::cache_program(byte pid, const ProgramStruct *buf) {
+	uint16_t n = program_zone_count(buf), i = 0;
+	memcpy(progs+pid, buf, PROGRAMHEADER_SIZE);
+	free(zones[pid]);
+	zones[pid] = n ? (ProgramZone*)malloc(n*sizeof(ProgramZone)) : NULL;
+	if (n && !zones[pid]) {
+		DEBUG_PRINTLN(F("out of memory caching program"));
+		n = 0;
+	}
+	for(sid_t sid=0;sid<MAX_NUM_STATIONS && i<n;sid++) {
+		if (!buf->durations[sid]) continue;
+		zones[pid][i].sid = sid;
+		zones[pid][i].dur = buf->durations[sid];
+		i++;
+	}
+	nzones[pid] = n;
+	progs[pid].compile(scheds+pid);
+}
+#endif
+
+/** Re-compile all program schedules (e.g. after sunrise/sunset time changed) */
+void ProgramData::compile_all() {
+	sched_sunrise_time = os.nvdata.sunrise_time;
+	sched_sunset_time = os.nvdata.sunset_time;
+#if defined(PROGRAM_CACHE_ENABLE)
+	for(byte pid=0;pid<nprograms;pid++) {
+		progs[pid].compile(scheds+pid);
+	}
+#endif
+	invalidate_next_runs();
+}
+
+/** Re-compile if sunrise/sunset time has changed since the last compile */
+void ProgramData::check_compiled() {
+	if (os.nvdata.sunrise_time != sched_sunrise_time || os.nvdata.sunset_time != sched_sunset_time) {
+		compile_all();
+#if !defined(PROGRAM_CACHE_ENABLE)
+		prog_buf_pid = 0xFF;
+#endif
+	}
+}
+
+/** Mark a program's next run time (or all of them) for re-calculation */
+void ProgramData::invalidate_next_runs(byte pid) {
+	if (pid < MAX_NUM_PROGRAMS) {
+		next_runs[pid] = 0;
+	} else {
+		memset(next_runs, 0, sizeof(next_runs));
+	}
+	next_runs_dirty = true;
+}
+
+/** Re-calculate invalidated next run times, starting from time t
+ * This returns the earliest next run time of all programs
+ */
+ulong ProgramData::update_next_runs(ulong t) {
+	check_compiled();
+	if (next_runs_tz != os.iopts[IOPT_TIMEZONE]) {
+		next_runs_tz = os.iopts[IOPT_TIMEZONE];
+		invalidate_next_runs();
+	}
+	if (!next_runs_dirty) return next_run_time;
+	t -= t%60;
+	next_run_time = ULONG_MAX;
+	for(byte pid=0;pid<nprograms;pid++) {
+		if (!next_runs[pid]) {
+			next_runs[pid] = get(pid)->next_match(t, get_schedule(pid));
+			// if the program does not run within the horizon, check again at the end of it
+			if (!next_runs[pid]) next_runs[pid] = t + NEXT_RUN_HORIZON*SECS_PER_DAY;
+		}
+		if (next_runs[pid] < next_run_time) next_run_time = next_runs[pid];
+	}
+	next_runs_dirty = false;
+	return next_run_time;
+}
+
+/** Get a program header without copying it
+ * On AVR the program is read into a shared buffer,
+ * which is overwritten by the next call
+ */
+ProgramHeader* ProgramData::get(byte pid) {
+	if (pid >= nprograms) return NULL;
+#if defined(PROGRAM_CACHE_ENABLE)
+	return progs+pid;
+#else
+	if (pid != prog_buf_pid) {
+		const char *fn = log_filename(log_file);
+		ulong pos = prog_pos[pid];
+		file_read_block(fn, &prog_buf, pos, PROGRAMHEADER_SIZE);
+		file_read_block(fn, &zone_buf_n, pos+PROGRAMHEADER_SIZE, sizeof(zone_buf_n));
+		if (zone_buf_n > MAX_NUM_STATIONS) zone_buf_n = MAX_NUM_STATIONS;
+		file_read_block(fn, zone_buf, pos+PROGRAMRECORD_SIZE(0), zone_buf_n*sizeof(ProgramZone));
+		prog_buf_pid = pid;
+		prog_buf.compile(&sched_buf);
+	}
+	return &prog_buf;
+#endif
+}
+
+/** Get the zones of a program (sorted by station index) without copying them */
+const ProgramZone* ProgramData::get_zones(byte pid, uint16_t *n) {
+	*n = 0;
+	if (pid >= nprograms) return NULL;
+#if defined(PROGRAM_CACHE_ENABLE)
+	*n = nzones[pid];
+	return zones[pid];
+#else
+	get(pid);
+	*n = zone_buf_n;
+	return zone_buf;
+#endif
+}
+
+/** Get the compiled schedule of a program */
+ProgramSchedule* ProgramData::get_schedule(byte pid) {
+	if (pid >= nprograms) return NULL;
+	// start times depend on sunrise/sunset time, which may change any time
+	check_compiled();
+#if defined(PROGRAM_CACHE_ENABLE)
+	return scheds+pid;
+#else
+	get(pid);
+	return &sched_buf;
+#endif
 }
 
 /** Erase all program data */
 void ProgramData::eraseall() {
-	nprograms = 0;
-	save_count();
+	log_append(PROG_LOG_CLEAR, 0);
+#if defined(PROGRAM_CACHE_ENABLE)
+	for(byte pid=0;pid<MAX_NUM_PROGRAMS;pid++) {
+		free(zones[pid]);
+		zones[pid] = NULL;
+		nzones[pid] = 0;
+	}
+#else
+	prog_buf_pid = 0xFF;
+#endif
+	invalidate_next_runs();
+	os.change_note(CHANGE_PROGRAM);
 }
 
-/** Read a program from program file*/
+/** Read a program (in the expanded form) */
 void ProgramData::read(byte pid, ProgramStruct *buf) {
 	if (pid >= nprograms) return;
-	// first byte is program counter, so 1+
-	file_read_block(PROG_FILENAME, buf, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
+#if defined(PROGRAM_CACHE_ENABLE)
+	memcpy(buf, progs+pid, PROGRAMHEADER_SIZE);
+	memset(buf->durations, 0, sizeof(buf->durations));
+	for(uint16_t i=0;i<nzones[pid];i++) {
+		if (zones[pid][i].sid < MAX_NUM_STATIONS) buf->durations[zones[pid][i].sid] = zones[pid][i].dur;
+	}
+#else
+	read_record(log_filename(log_file), prog_pos[pid], buf);
+#endif
 }
 
 /** Add a program */
 byte ProgramData::add(ProgramStruct *buf) {
 	if (nprograms >= MAX_NUM_PROGRAMS)	return 0;
-	file_write_block(PROG_FILENAME, buf, 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
-	nprograms ++;
-	save_count();
+	log_append(PROG_LOG_ADD, nprograms, buf);	// this increments nprograms
+#if defined(PROGRAM_CACHE_ENABLE)
+	cache_program(nprograms-1, buf);
+#endif
+	invalidate_next_runs(nprograms-1);
+	os.change_note(CHANGE_PROGRAM, nprograms-1);
 #if defined(ESP32) && defined(MIRRORLINK_ENABLE)
 	return nprograms;
 #else
@@ -120,21 +622,38 @@ byte ProgramData::add(ProgramStruct *buf) {
 /** Move a program up (i.e. swap a program with the one above it) */
 void ProgramData::moveup(byte pid) {
 	if(pid >= nprograms || pid == 0) return;
-	// swap program pid-1 and pid
-	ulong pos = 1+(ulong)(pid-1)*PROGRAMSTRUCT_SIZE;
-	ulong next = pos+PROGRAMSTRUCT_SIZE;
-	char buf2[PROGRAMSTRUCT_SIZE];
-	file_read_block(PROG_FILENAME, tmp_buffer, pos, PROGRAMSTRUCT_SIZE);
-	file_read_block(PROG_FILENAME, buf2, next, PROGRAMSTRUCT_SIZE);
-	file_write_block(PROG_FILENAME, tmp_buffer, next, PROGRAMSTRUCT_SIZE);
-	file_write_block(PROG_FILENAME, buf2, pos, PROGRAMSTRUCT_SIZE);
+	log_append(PROG_LOG_MOVEUP, pid);
+#if defined(PROGRAM_CACHE_ENABLE)
+	ProgramHeader header = progs[pid-1];
+	progs[pid-1] = progs[pid];
+	progs[pid] = header;
+	ProgramZone *z = zones[pid-1];
+	zones[pid-1] = zones[pid];
+	zones[pid] = z;
+	uint16_t n = nzones[pid-1];
+	nzones[pid-1] = nzones[pid];
+	nzones[pid] = n;
+	ProgramSchedule sched = scheds[pid-1];
+	scheds[pid-1] = scheds[pid];
+	scheds[pid] = sched;
+#else
+	prog_buf_pid = 0xFF;
+#endif
+	invalidate_next_runs();
+	os.change_note(CHANGE_PROGRAM);
 }
 
 /** Modify a program */
 byte ProgramData::modify(byte pid, ProgramStruct *buf) {
 	if (pid >= nprograms)  return 0;
-	ulong pos = 1+(ulong)pid*PROGRAMSTRUCT_SIZE;
-	file_write_block(PROG_FILENAME, buf, pos, PROGRAMSTRUCT_SIZE);
+	log_append(PROG_LOG_MODIFY, pid, buf);
+#if defined(PROGRAM_CACHE_ENABLE)
+	cache_program(pid, buf);
+#else
+	if (pid == prog_buf_pid) prog_buf_pid = 0xFF;
+#endif
+	invalidate_next_runs(pid);
+	os.change_note(CHANGE_PROGRAM, pid);
 	return 1;
 }
 
@@ -142,13 +661,20 @@ byte ProgramData::modify(byte pid, ProgramStruct *buf) {
 byte ProgramData::del(byte pid) {
 	if (pid >= nprograms)  return 0;
 	if (nprograms == 0) return 0;
-	ulong pos = 1+(ulong)(pid+1)*PROGRAMSTRUCT_SIZE;
-	// erase by copying backward
-	for (; pos < 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE; pos+=PROGRAMSTRUCT_SIZE) {
-		file_copy_block(PROG_FILENAME, pos, pos-PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE, tmp_buffer);
-	}
-	nprograms --;
-	save_count();
+#if defined(PROGRAM_CACHE_ENABLE)
+	free(zones[pid]);
+	memmove(progs+pid, progs+pid+1, (nprograms-pid-1)*PROGRAMHEADER_SIZE);
+	memmove(zones+pid, zones+pid+1, (nprograms-pid-1)*sizeof(ProgramZone*));
+	memmove(nzones+pid, nzones+pid+1, (nprograms-pid-1)*sizeof(uint16_t));
+	memmove(scheds+pid, scheds+pid+1, (nprograms-pid-1)*sizeof(ProgramSchedule));
+	zones[nprograms-1] = NULL;
+	nzones[nprograms-1] = 0;
+#else
+	prog_buf_pid = 0xFF;
+#endif
+	log_append(PROG_LOG_DELETE, pid);	// this decrements nprograms
+	invalidate_next_runs();
+	os.change_note(CHANGE_PROGRAM);
 #if defined(ESP32) && defined(MIRRORLINK_ENABLE)
 	return nprograms;
 #else
@@ -159,15 +685,16 @@ byte ProgramData::del(byte pid) {
 // set the enable bit
 byte ProgramData::set_flagbit(byte pid, byte bid, byte value) {
 	if (pid >= nprograms)  return 0;
-	byte flag = file_read_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE);
-	if(value) flag|=(1<<bid);
-	else flag&=(~(1<<bid));
-	file_write_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, flag);
-	return 1;
+	ProgramStruct prog;
+	read(pid, &prog);
+	byte *flag = (byte*)&prog;
+	if(value) *flag|=(1<<bid);
+	else *flag&=(~(1<<bid));
+	return modify(pid, &prog);
 }
 
 /** Decode a sunrise/sunset start time to actual start time */
-int16_t ProgramStruct::starttime_decode(int16_t t) {
+int16_t ProgramHeader::starttime_decode(int16_t t) {
 	if((t>>15)&1) return -1;
 	int16_t offset = t&0x7ff;
 	if((t>>STARTTIME_SIGN_BIT)&1) offset = -offset;
@@ -181,8 +708,24 @@ int16_t ProgramStruct::starttime_decode(int16_t t) {
 	return t;
 }
 
+/** Compile the program into its scheduling form */
+void ProgramHeader::compile(ProgramSchedule *sched) {
+	byte i;
+	if (starttime_type) {
+		for(i=0;i<MAX_NUM_STARTTIMES;i++) {
+			sched->starttimes[i] = starttime_decode(starttimes[i]);
+		}
+	} else {
+		// repeating type: only the first start time needs decoding
+		sched->starttimes[0] = starttime_decode(starttimes[0]);
+		for(i=1;i<MAX_NUM_STARTTIMES;i++) {
+			sched->starttimes[i] = starttimes[i];
+		}
+	}
+}
+
 /** Check if a given time matches the program's start day */
-byte ProgramStruct::check_day_match(time_t t) {
+byte ProgramHeader::check_day_match(time_t t) {
 
 #if defined(ARDUINO) // get current time from Arduino
 	byte weekday_t = weekday(t);				// weekday ranges from [0,6] within Sunday being 1
@@ -240,14 +783,21 @@ byte ProgramStruct::check_day_match(time_t t) {
 // Check if a given time matches program's start time
 // this also checks for programs that started the previous
 // day and ran over night
-byte ProgramStruct::check_match(time_t t) {
+// If the compiled schedule is given, its decoded start times are used
+byte ProgramHeader::check_match(time_t t, const ProgramSchedule *sched) {
 
 	// check program enable status
 	if (!enabled) return 0;
 
-	int16_t start = starttime_decode(starttimes[0]);
-	int16_t repeat = starttimes[1];
-	int16_t interval = starttimes[2];
+	ProgramSchedule buf;
+	if (!sched) {
+		compile(&buf);
+		sched = &buf;
+	}
+	const int16_t *st = sched->starttimes;
+	int16_t start = st[0];
+	int16_t repeat = st[1];
+	int16_t interval = st[2];
 	int16_t current_minute = (t%86400L)/60;
 
 	// first assume program starts today
@@ -257,7 +807,7 @@ byte ProgramStruct::check_match(time_t t) {
 		if (starttime_type) {
 			// given start time type
 			for(byte i=0;i<MAX_NUM_STARTTIMES;i++) {
-				if (current_minute == starttime_decode(starttimes[i]))	return 1; // if curren_minute matches any of the given start time, return 1
+				if (current_minute == st[i])	return 1; // if curren_minute matches any of the given start time, return 1
 			}
 			return 0; // otherwise return 0
 		} else {
@@ -289,6 +839,53 @@ byte ProgramStruct::check_match(time_t t) {
 	return 0;
 }
 
+/** Find the first start time of the program at or after time t
+ * This walks forward day by day following the same rules as check_match,
+ * including repeating programs that run over night into the next day.
+ * Returns 0 if the program does not start within NEXT_RUN_HORIZON days.
+ */
+ulong ProgramHeader::next_match(ulong t, const ProgramSchedule *sched) {
+	if (!enabled) return 0;
+	if (type == PROGRAM_TYPE_INTERVAL && !days[1]) return 0;
+
+	const int16_t *st = sched->starttimes;
+	int16_t start = st[0];
+	int16_t repeat = st[1];
+	int16_t interval = st[2];
+	ulong best = 0;
+	ulong today = t / SECS_PER_DAY;
+	// begin with the previous day to catch over night runs
+	ulong d = today ? today-1 : 0;
+	for(;d<=today+NEXT_RUN_HORIZON;d++) {
+		ulong daystart = d * SECS_PER_DAY;
+		if (best && daystart > best) break;
+		if (!check_day_match(daystart)) continue;
+		if (starttime_type) {
+			// given start time type
+			for(byte i=0;i<MAX_NUM_STARTTIMES;i++) {
+				if (st[i]<0 || st[i]>=1440) continue;
+				ulong m = daystart + st[i]*60L;
+				if (m>=t && (!best || m<best))	best = m;
+			}
+		} else {
+			// repeating type: start, start+interval, ... start+repeat*interval
+			// runs past midnight only count if interval is non-zero
+			for(long c=0;c<=2880;c++) {
+				if (c>0 && (!interval || c>repeat)) break;
+				long minute = (long)start + (long)c*interval;
+				if (minute >= 2880) break;
+				if (minute < 0 || (minute >= 1440 && !interval)) continue;
+				ulong m = daystart + minute*60L;
+				if (m>=t) {
+					if (!best || m<best)	best = m;
+					break;
+				}
+			}
+		}
+	}
+	return best;
+}
+
 // convert absolute remainder (reference time 1970 01-01) to relative remainder (reference time today)
 // absolute remainder is stored in flash, relative remainder is presented to web
 void ProgramData::drem_to_relative(byte days[2]) {
@@ -29,12 +29,17 @@
 #define MAX_NUM_STARTTIMES	4
 #define PROGRAM_NAME_SIZE		32
 #define RUNTIME_QUEUE_SIZE	MAX_NUM_STATIONS
+#define NEXT_RUN_HORIZON		366		// number of days to search ahead for a program's next run
 #define PROGRAMSTRUCT_SIZE	sizeof(ProgramStruct)
+#define PROGRAMHEADER_SIZE	sizeof(ProgramHeader)
+#define PROGRAMRECORD_SIZE(n)	(PROGRAMHEADER_SIZE+sizeof(uint16_t)+(ulong)(n)*sizeof(ProgramZone))
+#define PROG_LOG_MAGIC			0x4C50534FUL	// "OSPL"
+#define PROG_LOG_SLACK			4096	// superseded bytes tolerated in the program log before it is compacted
 #include "OpenSprinkler.h"
 
 /** Log data structure */
 struct LogStruct {
-	byte station;
+	sid_t station;
 	byte program;
 	uint16_t duration;
 	uint32_t endtime;
@@ -52,8 +57,31 @@ struct LogStruct {
 #define PROGRAMSTRUCT_EN_BIT	 0
 #define PROGRAMSTRUCT_UWT_BIT  1
 
-/** Program data structure */
-class ProgramStruct {
+// keep a copy of all programs in RAM (AVR does not have enough RAM for it)
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define PROGRAM_CACHE_ENABLE
+#endif
+
+/** Compiled (scheduling) form of a program
+ * Start times are stored decoded: for a fixed start time program
+ * all start times are decoded (-1 if unused); for a repeating program
+ * starttimes[0] is the decoded start time, [1] and [2] are the repeat count and interval
+ */
+struct ProgramSchedule {
+	int16_t starttimes[MAX_NUM_STARTTIMES];
+};
+
+/** Zone of a program: a station with a non-zero water time */
+struct ProgramZone {
+	uint16_t sid;
+	uint16_t dur;
+};
+
+/** Program header: everything except the water times
+ * A program record is the header, followed by the number of
+ * zones (uint16_t) and the zones sorted by station index.
+ */
+class ProgramHeader {
 public:
 	byte enabled	:1;  // HIGH means the program is enabled
 	
@@ -98,12 +126,12 @@ public:
 	//	 else: standard start time (value between 0 to 1440, by bits 0 to 10)
 	int16_t starttimes[MAX_NUM_STARTTIMES];
 
-	uint16_t durations[MAX_NUM_STATIONS];  // duration / water time of each station
-	
 	char name[PROGRAM_NAME_SIZE];
 
-	byte check_match(time_t t);
+	byte check_match(time_t t, const ProgramSchedule *sched=NULL);
+	ulong next_match(ulong t, const ProgramSchedule *sched);
 	int16_t starttime_decode(int16_t t);
+	void compile(ProgramSchedule *sched);
 	
 protected:
 
@@ -111,32 +139,75 @@ protected:
 
 };
 
+/** Program data structure
+ * This is the expanded form with the water time of every station,
+ * used to edit and transfer programs
+ */
+class ProgramStruct : public ProgramHeader {
+public:
+	uint16_t durations[MAX_NUM_STATIONS];  // duration / water time of each station
+};
+
 extern OpenSprinkler os;
 
+/** Program log
+ * Programs are stored in an append-only log: a ProgramLogHeader followed
+ * by entries. Every change appends one entry (followed by a program record
+ * for add and modify), so a power cut can at most lose the entry being written,
+ * which is detected by its checksum and dropped on start up.
+ * When enough of the log is superseded, the live programs are written to the
+ * other log file, which becomes valid once its header is finalized.
+ */
+struct ProgramLogHeader {
+	uint32_t magic;
+	uint32_t generation;	// incremented on each compaction, the newest valid file is used
+};
+
+#define PROG_LOG_ADD		0xA1
+#define PROG_LOG_MODIFY	0xA2
+#define PROG_LOG_DELETE	0xA3
+#define PROG_LOG_MOVEUP	0xA4
+#define PROG_LOG_CLEAR	0xA5
+
+struct ProgramLogEntry {
+	byte op;	// PROG_LOG_xxx
+	byte pid;
+	uint16_t len;	// size of the program record that follows the entry
+	uint16_t sum;	// checksum of the record, followed by op, pid and len
+};
+
 class RuntimeQueueStruct {
 public:
 	ulong		 st;	// start time
 	uint16_t dur; // water time
-	byte	sid;
+	sid_t	sid;
 	byte	pid;
 };
 
 class ProgramData {
 public:  
 	static RuntimeQueueStruct queue[];
-	static byte nqueue;					// number of queue elements
-	static byte station_qid[];	// this array stores the queue element index for each scheduled station
+	static qid_t nqueue;					// number of queue elements
+	static qid_t station_qid[];	// this array stores the queue element index for each scheduled station (QID_NONE if none)
 	static byte nprograms;			// number of programs
 	static LogStruct lastrun;
-	static ulong last_seq_stop_time;	// the last stop time of a sequential station
+	static ulong last_seq_stop_times[];	// the last stop time of a sequential station in each sequential group
+	static ulong next_event_time;	// the next time the runtime queue needs processing (0 means right away)
+	static uint16_t queue_overflows;	// number of elements dropped because the queue was full
+	static ulong next_runs[];		// calendar index: the next time each program starts (or needs to be checked again)
+	static ulong next_run_time;	// the earliest of next_runs
 	
 	static void reset_runtime();
 	static RuntimeQueueStruct* enqueue(); // this returns a pointer to the next available slot in the queue
-	static void dequeue(byte qid);	// this removes an element from the queue
+	static void dequeue(qid_t qid);	// this removes an element from the queue
+	static void assign_station(sid_t sid);	// this assigns the earliest queue element of a station to it
 
 	static void init();
 	static void eraseall();
 	static void read(byte pid, ProgramStruct *buf);
+	static ProgramHeader* get(byte pid);	// this returns a pointer to the program header, without copying
+	static const ProgramZone* get_zones(byte pid, uint16_t *nzones);	// this returns the zones of a program, without copying
+	static ProgramSchedule* get_schedule(byte pid);
 	static byte add(ProgramStruct *buf);
 	static byte modify(byte pid, ProgramStruct *buf);
 	static byte set_flagbit(byte pid, byte bid, byte value);
@@ -144,9 +215,44 @@ public:
 	static byte del(byte pid);
 	static void drem_to_relative(byte days[2]); // absolute to relative reminder conversion
 	static void drem_to_absolute(byte days[2]);
-	static byte load_count();
+	static void invalidate_next_runs(byte pid=0xFF);	// 0xFF means all programs
+	static ulong update_next_runs(ulong t);
 private:	
-	static void save_count();
+	static void load_all();
+	static void migrate();
+	static void compile_all();
+	static void check_compiled();
+	static const char* log_filename(byte f);
+	static void log_open();
+	static void log_apply(const ProgramLogEntry *e, ulong pos);
+	static void log_append(byte op, byte pid, const ProgramStruct *buf=NULL);
+	static void log_compact();
+	static void copy_record(const char *from, ulong src, const char *to, ulong dst, ulong len, uint16_t *sum);
+	static ulong record_size(byte pid);
+	static ulong write_record(const char *fname, ulong pos, const ProgramStruct *buf, uint16_t *sum);
+	static ulong read_record(const char *fname, ulong pos, ProgramStruct *buf);
+	static byte log_file;		// index of the current log file
+	static uint32_t log_generation;
+	static ulong log_end;		// where the next entry is appended
+	static ulong log_dead;		// number of superseded bytes in the log
+	static ulong prog_pos[];	// file position of the current record of each program
+#if defined(PROGRAM_CACHE_ENABLE)
+	static void cache_program(byte pid, const ProgramStruct *buf);
+	static ProgramHeader progs[];	// RAM copy of the programs
+	static ProgramZone *zones[];
+	static uint16_t nzones[];
+	static ProgramSchedule scheds[];
+#else
+	static ProgramHeader prog_buf;	// the most recently read program
+	static ProgramZone zone_buf[];
+	static uint16_t zone_buf_n;
+	static ProgramSchedule sched_buf;
+	static byte prog_buf_pid;
+#endif
+	static int16_t sched_sunrise_time;	// sunrise/sunset time the schedules were compiled with
+	static int16_t sched_sunset_time;
+	static byte next_runs_tz;	// timezone the calendar index was built with
+	static bool next_runs_dirty;
 };
 
 #endif	// _PROGRAM_H
@@ -27,6 +27,8 @@
 #include "weather.h"
 #include "mqtt.h"
 #include "MirrorLink.h"
+#include "logs.h"
+#include "logship.h"
 
 // External variables defined in main ion file
 #if defined(ARDUINO)
@@ -58,6 +60,9 @@
 
 	#include <stdarg.h>
 	#include <stdlib.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/sendfile.h>
 	#include "etherport.h"
 
 	extern EthernetClient *m_client;
@@ -74,19 +79,18 @@ extern ulong flow_count;
 static byte return_code;
 static char* get_buffer = NULL;
 
-BufferFiller bfill;
+static void ether_buffer_flush();
+BufferFiller bfill(ether_buffer, ETHER_BUFFER_SIZE, ether_buffer_flush);
 
 void schedule_all_stations(ulong curr_time);
-void turn_off_station(byte sid, ulong curr_time);
+void turn_off_station(sid_t sid, ulong curr_time);
 void process_dynamic_events(ulong curr_time);
 void check_network(time_t curr_time);
 void check_weather(time_t curr_time);
 void perform_ntp_sync(time_t curr_time);
 void log_statistics(time_t curr_time);
-void delete_log(char *name);
 void reset_all_stations_immediate();
 void reset_all_stations();
-void make_logfile_name(char *name);
 
 /* Check available space (number of bytes) in the Ethernet buffer */
 int available_ether_buffer() {
@@ -270,8 +274,7 @@ byte findKeyVal (const char *str,char *strbuf, uint16_t maxlen,const char *key,b
 }
 
 void rewind_ether_buffer() {
-	bfill = ether_buffer;
-	ether_buffer[0] = 0;
+	bfill.rewind();
 }
 
 void send_packet(bool final=false) {
@@ -286,7 +289,7 @@ void send_packet(bool final=false) {
 	}
 	// else
 	if(final || available_ether_buffer()<250) {
-		wifi_server->sendContent(ether_buffer);
+		wifi_server->sendContent_P(ether_buffer, strlen(ether_buffer));
 		if(final)
 			wifi_server->client().stop();			 
 		else
@@ -309,55 +312,63 @@ void send_packet(bool final=false) {
 #endif	
 }
 
+/** Flush function of bfill, sends out the response so far */
+static void ether_buffer_flush() {
+	send_packet();
+}
+
 char dec2hexchar(byte dec) {
 	if(dec<10) return '0'+dec;
 	else return 'A'+(dec-10);
 }
 
 #if defined(ESP8266) || defined(ESP32)
-String two_digits(uint8_t x) {
-	return String(x/10) + (x%10);
+/** Write a duration as hh:mm:ss into buf (at least 9 bytes) */
+char *toHMS(ulong t, char *buf) {
+	int h = t/3600, m = (t/60)%60, s = t%60;
+	BufferFiller bf(buf, 9);
+	bf.emit_p(PSTR("$D$D:$D$D:$D$D"), h/10, h%10, m/10, m%10, s/10, s%10);
+	return buf;
 }
 
-String toHMS(ulong t) {
-	return two_digits(t/3600)+":"+two_digits((t/60)%60)+":"+two_digits(t%60);
+/* The server_send functions send a whole response from RAM (usually
+ * ether_buffer) or PROGMEM, without copying it to a String first */
+void server_send_html(const char *html) {
+	if (m_client) {
+		return;
+	}
+	// else
+	wifi_server->send_P(200, PSTR("text/html"), html, strlen(html));
 }
 
-void server_send_html(String html) {
+void server_send_html_P(PGM_P html) {
 	if (m_client) {
 		return;
 	}
 	// else
-	wifi_server->send(200, "text/html", html);
+	wifi_server->send_P(200, PSTR("text/html"), html);
 }
 
-void server_send_json(String json) {
+void server_send_json(const char *json) {
 	if (m_client) {
 		return;
 	}
 	// else
-	wifi_server->send(200, "application/json", json);
+	wifi_server->send_P(200, PSTR("application/json"), json, strlen(json));
 }
 
 void server_send_result(byte code) {
 	rewind_ether_buffer();
-	String html = F("{\"result\":");
-	html += code;
-	html += "}";
 	print_json_header(false);
-	server_send_json(html);
+	bfill.emit_p(PSTR("{\"result\":$D}"), code);
+	server_send_json(ether_buffer);
 }
 
 void server_send_result(byte code, const char* item) {
 	rewind_ether_buffer();
-	String html = F("{\"result\":");
-	html += code;
-	html += F(",\"item\":\"");
-	if(item) html += item;
-	html += "\"";
-	html += "}";
 	print_json_header(false);
-	server_send_json(html);
+	bfill.emit_p(PSTR("{\"result\":$D,\"item\":\"$S\"}"), code, item?item:"");
+	server_send_json(ether_buffer);
 }
 
 bool get_value_by_key(const char* key, long& val) {
@@ -378,54 +389,39 @@ bool get_value_by_key(const char* key, String& val) {
 	}
 }
 
-void append_key_value(String& html, const char* key, const ulong value) {
-	html += "\"";
-	html += key;
-	html += "\":";
-	html += value;
-	html += ",";
-}
-
-void append_key_value(String& html, const char* key, const int16_t value) {
-	html += "\"";
-	html += key;
-	html += "\":";
-	html += value;
-	html += ",";
-}
-
-void append_key_value(String& html, const char* key, const String& value) {
-	html += "\"";
-	html += key;
-	html += "\":\"";
-	html += value;
-	html += "\",";
-}
-
-String get_ap_ssid() {
-	static String ap_ssid;
-	if(!ap_ssid.length()) {
+const char *get_ap_ssid() {
+	static char ap_ssid[10];	// OS_ followed by the last 3 bytes of the MAC address
+	if(!ap_ssid[0]) {
 		byte mac[6];
 		WiFi.macAddress(mac);
-		ap_ssid += "OS_";
-		for(byte i=3;i<6;i++) {
-			ap_ssid += dec2hexchar((mac[i]>>4)&0x0F);
-			ap_ssid += dec2hexchar(mac[i]&0x0F);
-		}
+		BufferFiller bf(ap_ssid, sizeof(ap_ssid));
+		bf.emit_p(PSTR("OS_$X$X$X"), mac[3], mac[4], mac[5]);
 	}
 	return ap_ssid;
 }
 
-static String scanned_ssids;
+static ScannedNetwork *scanned = NULL;	// networks found when the AP started
+static byte nscanned = 0;
 
 void on_ap_home() {
 	if(os.get_wifi_mode()!=WIFI_M_AP) return;
-	server_send_html(FPSTR(ap_home_html));
+	server_send_html_P(ap_home_html);
 }
 
 void on_ap_scan() {
 	if(os.get_wifi_mode()!=WIFI_M_AP) return;
-	server_send_html(scanned_ssids);
+	// keep the format of the wireless network list for mobile app compatibility
+	rewind_ether_buffer();
+	bfill.emit_p(PSTR("{\"ssids\":["));
+	for(byte i=0;i<nscanned;i++) {
+		bfill.emit_p((i<nscanned-1)?PSTR("\"$E\",\r\n"):PSTR("\"$E\""), scanned[i].ssid);
+	}
+	bfill.emit_p(PSTR("],\"rssis\":["));
+	for(byte i=0;i<nscanned;i++) {
+		bfill.emit_p((i<nscanned-1)?PSTR("\"$D\",\r\n"):PSTR("\"$D\""), scanned[i].rssi);
+	}
+	bfill.emit_p(PSTR("]}"));
+	server_send_html(ether_buffer);
 }
 
 void on_ap_change_config() {
@@ -446,12 +442,10 @@ void on_ap_change_config() {
 
 void on_ap_try_connect() {
 	if(os.get_wifi_mode()!=WIFI_M_AP) return;
-	String html = "{";
 	ulong ip = (WiFi.status()==WL_CONNECTED)?(uint32_t)WiFi.localIP():0;
-	append_key_value(html, "ip", ip);
-	html.remove(html.length()-1);  
-	html += "}";
-	server_send_html(html);
+	rewind_ether_buffer();
+	bfill.emit_p(PSTR("{\"ip\":$L}"), ip);
+	server_send_html(ether_buffer);
 	if(WiFi.status() == WL_CONNECTED && WiFi.localIP()) {
 		// IP received by client, restart
 		//os.reboot_dev(REBOOT_CAUSE_WIFIDONE);
@@ -460,28 +454,31 @@ void on_ap_try_connect() {
 
 #if defined(ESP32) && defined(MIRRORLINK_ENABLE)
 void ml_sta_ap_control() {
-	String html = FPSTR(mirrorlink_control_html);
-	server_send_html(html);
+	server_send_html_P(mirrorlink_control_html);
 }
 
 void ml_sta_ap_status_general() {
-	String html = MirrorLinkStatusGeneral();
-	server_send_html(html);
+	rewind_ether_buffer();
+	MirrorLinkStatusGeneral(bfill);
+	server_send_html(ether_buffer);
 }
 
 void ml_sta_ap_status_radio() {
-	String html = MirrorLinkStatusRadio();
-	server_send_html(html);
+	rewind_ether_buffer();
+	MirrorLinkStatusRadio(bfill);
+	server_send_html(ether_buffer);
 }
 
 void ml_sta_ap_status_packets() {
-	String html = MirrorLinkStatusPackets();
-	server_send_html(html);
+	rewind_ether_buffer();
+	MirrorLinkStatusPackets(bfill);
+	server_send_html(ether_buffer);
 }
 
 void ml_sta_ap_status_boards() {
-	String html = MirrorLinkStatusBoards();
-	server_send_html(html);
+	rewind_ether_buffer();
+	MirrorLinkStatusBoards(bfill);
+	server_send_html(ether_buffer);
 }
 
 void ml_sta_ap_boardselect() {
@@ -553,6 +550,67 @@ void ml_sta_ap_chconfig() {
 #endif
 
 
+#if defined(SESSION_TOKENS)
+struct SessionToken {
+	char token[SESSION_TOKEN_SIZE+1];	// empty if the entry is free
+	ulong expires;	// millis() at expiry
+};
+
+static SessionToken sessions[SESSION_MAX];
+
+static byte session_random() {
+#if defined(ESP8266)
+	return (byte)RANDOM_REG32;
+#elif defined(ESP32)
+	return (byte)esp_random();
+#else
+	static int fd = -2;
+	if (fd==-2) fd = open("/dev/urandom", O_RDONLY);
+	byte b;
+	if (fd>=0 && read(fd, &b, 1)==1) return b;
+	return (byte)rand();
+#endif
+}
+
+static bool session_expired(const SessionToken *s) {
+	return (long)(s->expires - millis()) <= 0;
+}
+
+/** Create a session token, replacing the oldest one if the table is full */
+static const char *session_create() {
+	SessionToken *s = sessions;
+	for (byte i=0; i<SESSION_MAX; i++) {
+		if (!sessions[i].token[0] || session_expired(sessions+i)) { s = sessions+i; break; }
+		if ((long)(sessions[i].expires - s->expires) < 0) s = sessions+i;
+	}
+	for (byte i=0; i<SESSION_TOKEN_SIZE; i+=2) {
+		byte b = session_random();
+		s->token[i] = dec2hexchar(b>>4);
+		s->token[i+1] = dec2hexchar(b&0x0F);
+	}
+	s->token[SESSION_TOKEN_SIZE] = 0;
+	s->expires = millis() + SESSION_TTL*1000UL;
+	return s->token;
+}
+
+/** Check a session token, the comparison takes the same time for any token */
+static bool session_verify(const char *tk) {
+	if (strlen(tk)!=SESSION_TOKEN_SIZE) return false;
+	bool match = false;
+	for (byte i=0; i<SESSION_MAX; i++) {
+		if (!sessions[i].token[0] || session_expired(sessions+i)) continue;
+		byte diff = 0;
+		for (byte j=0; j<SESSION_TOKEN_SIZE; j++) diff |= sessions[i].token[j] ^ tk[j];
+		if (diff==0) match = true;
+	}
+	return match;
+}
+
+static void session_clear() {
+	memset(sessions, 0, sizeof(sessions));
+}
+#endif
+
 /** Check and verify password */
 #if defined(ESP8266) || defined(ESP32)
 boolean process_password(boolean fwv_on_fail=false, char *p = NULL)
@@ -572,6 +630,12 @@ boolean check_password(char *p)
 		if (os.password_verify(tmp_buffer))
 			return true;
 	}
+#if defined(SESSION_TOKENS)
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("tk"), true)) {
+		if (session_verify(tmp_buffer))
+			return true;
+	}
+#endif
 #if defined(ESP8266) || defined(ESP32)
 	if(m_client) { return false; }
 	/* some pages will output fwv if password check has failed */
@@ -608,18 +672,34 @@ void server_json_stations_main() {
 	server_json_stations_attrib(PSTR("stn_seq"), os.attrib_seq);
 	server_json_stations_attrib(PSTR("stn_spe"), os.attrib_spe);
 
+	sid_t sid;
+	bfill.emit_p(PSTR("\"stn_grp\":["));
+	for(sid=0;sid<os.nstations;sid++) {
+		bfill.emit_p(PSTR("$D"), os.attrib_grp[sid]);
+		if(sid!=os.nstations-1)
+			bfill.emit_p(PSTR(","));
+	}
+	bfill.emit_p(PSTR("],\"ngrp\":$D,"), NUM_SEQ_GROUPS);
+
 	bfill.emit_p(PSTR("\"snames\":["));
-	byte sid;
 	for(sid=0;sid<os.nstations;sid++) {
 		os.get_station_name(sid, tmp_buffer);
-		bfill.emit_p(PSTR("\"$S\""), tmp_buffer);
+		bfill.emit_p(PSTR("\"$E\""), tmp_buffer);
 		if(sid!=os.nstations-1)
 			bfill.emit_p(PSTR(","));
-		if (available_ether_buffer() < 60) {
-			send_packet();
-		}
 	}
-	bfill.emit_p(PSTR("],\"maxlen\":$D}"), STATION_NAME_SIZE);
+	bfill.emit_p(PSTR("],\"maxlen\":$D,"), STATION_NAME_SIZE);
+
+	// next run time of each program, from the calendar index
+	pd.update_next_runs((os.now_tz()/60+1)*60);
+	bfill.emit_p(PSTR("\"nextrun\":["));
+	byte pid;
+	for(pid=0;pid<pd.nprograms;pid++) {
+		bfill.emit_p(PSTR("$L"), pd.next_runs[pid]);
+		if(pid!=pd.nprograms-1)
+			bfill.emit_p(PSTR(","));
+	}
+	bfill.emit_p(PSTR("]}"));
 }
 
 /** Output stations data */
@@ -641,7 +721,7 @@ void server_json_station_special() {
 	rewind_ether_buffer();
 #endif
 
-	byte sid;
+	sid_t sid;
 	byte comma=0;
 	StationData *data = (StationData*)tmp_buffer;
 	print_json_header();
@@ -650,7 +730,7 @@ void server_json_station_special() {
 			os.get_station_data(sid, data);
 			if (comma) bfill.emit_p(PSTR(","));
 			else {comma=1;}
-			bfill.emit_p(PSTR("\"$D\":{\"st\":$D,\"sd\":\"$S\"}"), sid, data->type, data->sped);
+			bfill.emit_p(PSTR("\"$D\":{\"st\":$D,\"sd\":\"$E\"}"), sid, data->type, data->sped);
 		}
 	}
 	bfill.emit_p(PSTR("}"));
@@ -693,30 +773,22 @@ void server_change_stations() {
 	char* p = get_buffer;
 #endif
 	
-	byte sid;
-	char tbuf2[5] = {'s', 0, 0, 0, 0};
-	// process station names
+	sid_t sid;
+	char tbuf2[7] = {'g', 0, 0, 0, 0, 0, 0};
+	// the sequential group ids are checked and the special data is handled
+	// first, so that a rejected request leaves all stations as they were
 	for(sid=0;sid<os.nstations;sid++) {
 		itoa(sid, tbuf2+1, 10);
 		if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, tbuf2)) {
-			urlDecode(tmp_buffer);
-			os.set_station_name(sid, tmp_buffer);
+			int gid = atoi(tmp_buffer);
+			if(gid<0 || gid>=NUM_SEQ_GROUPS) handle_return(HTML_DATA_OUTOFBOUND);
 		}
 	}
 
-	server_change_stations_attrib(p, 'm', os.attrib_mas); // master1
-	server_change_stations_attrib(p, 'i', os.attrib_igrd); // ignore rain delay
-	server_change_stations_attrib(p, 'j', os.attrib_igs); // ignore sensor1
-	server_change_stations_attrib(p, 'k', os.attrib_igs2); // ignore sensor2
-	server_change_stations_attrib(p, 'n', os.attrib_mas2); // master2
-	server_change_stations_attrib(p, 'd', os.attrib_dis); // disable
-	server_change_stations_attrib(p, 'q', os.attrib_seq); // sequential
-	server_change_stations_attrib(p, 'p', os.attrib_spe); // special
-
 	/* handle special data */
 	if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sid"), true)) {
 		sid = atoi(tmp_buffer);
-		if(sid<0 || sid>os.nstations) handle_return(HTML_DATA_OUTOFBOUND);
+		if(sid<0 || sid>=os.nstations) handle_return(HTML_DATA_OUTOFBOUND);
 		if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("st"), true) &&
 			 findKeyVal(p, tmp_buffer+1, TMP_BUFFER_SIZE-1, PSTR("sd"), true)) {
 
@@ -746,8 +818,7 @@ void server_change_stations() {
 				}
 			}
 			// write spe data
-			file_write_block(STATIONS_FILENAME, tmp_buffer,
-				(uint32_t)sid*sizeof(StationData)+offsetof(StationData,type), STATION_SPECIAL_DATA_SIZE+1);
+			os.set_station_special(sid, (byte*)tmp_buffer);
 
 		} else {
 
@@ -756,7 +827,40 @@ void server_change_stations() {
 		}
 	}
 
+	// process station names
+	// apps send every name, so the changes are recorded once for all stations
+	// rather than one journal record per station
+	bool renamed = false;
+	tbuf2[0] = 's';
+	for(sid=0;sid<os.nstations;sid++) {
+		itoa(sid, tbuf2+1, 10);
+		if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, tbuf2)) {
+			urlDecode(tmp_buffer);
+			if(os.set_station_name(sid, tmp_buffer, false)) renamed = true;
+		}
+	}
+	if(renamed) os.change_note(CHANGE_STATION);
+
+	server_change_stations_attrib(p, 'm', os.attrib_mas); // master1
+	server_change_stations_attrib(p, 'i', os.attrib_igrd); // ignore rain delay
+	server_change_stations_attrib(p, 'j', os.attrib_igs); // ignore sensor1
+	server_change_stations_attrib(p, 'k', os.attrib_igs2); // ignore sensor2
+	server_change_stations_attrib(p, 'n', os.attrib_mas2); // master2
+	server_change_stations_attrib(p, 'd', os.attrib_dis); // disable
+	server_change_stations_attrib(p, 'q', os.attrib_seq); // sequential
+	server_change_stations_attrib(p, 'p', os.attrib_spe); // special
+
+	// process sequential group ids
+	tbuf2[0] = 'g';
+	for(sid=0;sid<os.nstations;sid++) {
+		itoa(sid, tbuf2+1, 10);
+		if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, tbuf2)) {
+			os.attrib_grp[sid] = atoi(tmp_buffer);
+		}
+	}
+
 	os.attribs_save();
+	pd.next_event_time = 0;	// master/sequential attributes may have changed
 	
 	handle_return(HTML_SUCCESS);
 }
@@ -779,6 +883,7 @@ uint16_t parse_listdata(char **p) {
 }
 
 void manual_start_program(byte, byte);
+bool preview_timeline(ulong start, ulong end, void (*emit)(RuntimeQueueStruct *q));
 /** Manual start program
  * Command: /mp?pw=xxx&pid=xxx&uwt=xxx
  *
@@ -853,7 +958,8 @@ void server_change_runonce() {
 	// reset all stations and prepare to run one-time program
 	reset_all_stations_immediate();
 
-	byte sid, bid, s;
+	sid_t sid;
+	byte bid, s;
 	uint16_t dur;
 	boolean match_found = false;
 	for(sid=0;sid<os.nstations;sid++) {
@@ -979,7 +1085,7 @@ void server_change_program() {
 	char *p = get_buffer;
 #endif
 
-	byte i;
+	sid_t i;
 
 	ProgramStruct prog;
 
@@ -1112,8 +1218,16 @@ void server_change_program() {
 		// bit 7 to 14 = sid
 		// bit 15 to 25 = time (min)
 		// bit 26 to 31 = Not used
-		for(i=0;i<os.nstations;i++) {
-			MirrorLinkBuffCmd((uint8_t)ML_PROGRAMDURATION, (uint32_t)(((uint32_t)(0x7FF & ((prog.durations[i]) / 60)) << 15) | (((uint32_t)i) << 7) | (uint32_t)(pid)));
+		// only stations with a non-zero water time are sent (the remote clears the others),
+		// but at least one message is needed to keep the command sequence
+		uint16_t nzones;
+		const ProgramZone *zones = pd.get_zones(pid, &nzones);
+		if (!nzones) {
+			MirrorLinkBuffCmd((uint8_t)ML_PROGRAMDURATION, (uint32_t)pid);
+		}
+		for(;nzones;nzones--,zones++) {
+			if (zones->sid >= os.nstations) break;
+			MirrorLinkBuffCmd((uint8_t)ML_PROGRAMDURATION, (uint32_t)(((uint32_t)(0x7FF & ((zones->dur) / 60)) << 15) | (((uint32_t)zones->sid) << 7) | (uint32_t)(pid)));
 		}
 
 		// Send program day setup
@@ -1218,10 +1332,14 @@ void server_json_programs_main() {
 
 	bfill.emit_p(PSTR("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pd\":["),
 							 pd.nprograms, os.nboards, MAX_NUM_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE);
-	byte pid, i;
-	ProgramStruct prog;
+	byte pid;
+	sid_t i;
+	ProgramHeader prog;
+	const ProgramZone *zones;
+	uint16_t nzones;
 	for(pid=0;pid<pd.nprograms;pid++) {
-		pd.read(pid, &prog);
+		prog = *pd.get(pid);
+		zones = pd.get_zones(pid, &nzones);
 		if (prog.type == PROGRAM_TYPE_INTERVAL && prog.days[1] > 1) {
 			pd.drem_to_relative(prog.days);
 		}
@@ -1233,25 +1351,25 @@ void server_json_programs_main() {
 			bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
 		}
 		bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);	// this is the last element
-		// station water time
-		for (i=0; i<os.nstations-1; i++) {
-			bfill.emit_p(PSTR("$L,"),(unsigned long)prog.durations[i]);
+		// station water time, only the stations in the zone list have a non-zero water time
+		for (i=0; i<os.nstations; i++) {
+			unsigned long dur = 0;
+			if (nzones && zones->sid==i) {
+				dur = zones->dur;
+				zones++;
+				nzones--;
+			}
+			bfill.emit_p((i<os.nstations-1)?PSTR("$L,"):PSTR("$L],\""), dur);
 		}
-		bfill.emit_p(PSTR("$L],\""),(unsigned long)prog.durations[i]); // this is the last element
 		// program name
 		strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
 		tmp_buffer[PROGRAM_NAME_SIZE] = 0;	// make sure the string ends
-		bfill.emit_p(PSTR("$S"), tmp_buffer);
+		bfill.emit_p(PSTR("$E"), tmp_buffer);
 		if(pid!=pd.nprograms-1) {
 			bfill.emit_p(PSTR("\"],"));
 		} else {
 			bfill.emit_p(PSTR("\"]"));
 		}
-		// push out a packet if available
-		// buffer size is getting small
-		if (available_ether_buffer() < 250) {
-			send_packet();
-		}
 	}
 	bfill.emit_p(PSTR("]}"));
 }
@@ -1281,11 +1399,12 @@ void server_view_scripturl() {
 }
 
 void server_json_controller_main() {
-	byte bid, sid;
+	byte bid;
+	sid_t sid;
 	ulong curr_time = os.now_tz();
 	bfill.emit_p(PSTR("\"devt\":$L,\"nbrd\":$D,\"en\":$D,\"sn1\":$D,\"sn2\":$D,\"rd\":$D,\"rdst\":$L,"
 										"\"sunrise\":$D,\"sunset\":$D,\"eip\":$L,\"lwc\":$L,\"lswc\":$L,"
-										"\"lupt\":$L,\"lrbtc\":$D,\"lrun\":[$D,$D,$D,$L],"),
+										"\"lupt\":$L,\"lrbtc\":$D,\"lrun\":[$D,$D,$D,$L],\"qover\":$D,"),
 							curr_time,
 							os.nboards,
 							os.status.enabled,
@@ -1303,7 +1422,8 @@ void server_json_controller_main() {
 							pd.lastrun.station,
 							pd.lastrun.program,
 							pd.lastrun.duration,
-							pd.lastrun.endtime);
+							pd.lastrun.endtime,
+							pd.queue_overflows);
 
 #if defined(ESP8266) || defined(ESP32)
 	bfill.emit_p(PSTR("\"RSSI\":$D,"), (int16_t)WiFi.RSSI());
@@ -1313,13 +1433,14 @@ void server_json_controller_main() {
 	os.load_hardware_mac(mac, m_server!=NULL);
 	bfill.emit_p(PSTR("\"mac\":\"$X:$X:$X:$X:$X:$X\","), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-	bfill.emit_p(PSTR("\"loc\":\"$O\",\"jsp\":\"$O\",\"wsp\":\"$O\",\"wto\":{$O},\"ifkey\":\"$O\",\"mqtt\":{$O},\"wtdata\":$S,\"wterr\":$D,"),
+	bfill.emit_p(PSTR("\"loc\":\"$O\",\"jsp\":\"$O\",\"wsp\":\"$O\",\"wto\":{$O},\"ifkey\":\"$O\",\"mqtt\":{$O},\"ship\":{$O},\"wtdata\":$S,\"wterr\":$D,"),
 							 SOPT_LOCATION,
 							 SOPT_JAVASCRIPTURL,
 							 SOPT_WEATHERURL,
 							 SOPT_WEATHER_OPTS,
 							 SOPT_IFTTT_KEY,
 							 SOPT_MQTT_OPTS,
+							 SOPT_LOGSHIP_OPTS,
 							 strlen(wt_rawData)==0?"{}":wt_rawData,
 							 wt_errCode);
 
@@ -1341,19 +1462,14 @@ void server_json_controller_main() {
 	bfill.emit_p(PSTR("0],\"ps\":["));
 	// print ps
 	for(sid=0;sid<os.nstations;sid++) {
-		// if available ether buffer is getting small
-		// send out a packet
-		if(available_ether_buffer() < 60) {
-			send_packet();
-		}
 		unsigned long rem = 0;
-		byte qid = pd.station_qid[sid];
+		qid_t qid = pd.station_qid[sid];
 		RuntimeQueueStruct *q = pd.queue + qid;
-		if (qid<255) {
+		if (qid!=QID_NONE) {
 			rem = (curr_time >= q->st) ? (q->st+q->dur-curr_time) : q->dur;
 			if(rem>65535) rem = 0;
 		}
-		bfill.emit_p(PSTR("[$D,$L,$L]"), (qid<255)?q->pid:0, rem, (qid<255)?q->st:0);
+		bfill.emit_p(PSTR("[$D,$L,$L]"), (qid!=QID_NONE)?q->pid:0, rem, (qid!=QID_NONE)?q->st:0);
 		bfill.emit_p((sid<os.nstations-1)?PSTR(","):PSTR("]"));
 	}
 	
@@ -1655,6 +1771,21 @@ void server_change_options()
 		os.status.req_mqtt_restart = true;
 	}
 
+	keyfound = 0;
+	if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("ship"), true, &keyfound)) {
+		urlDecode(tmp_buffer);
+		os.sopt_save(SOPT_LOGSHIP_OPTS, tmp_buffer);
+#if defined(LOG_SHIPPING)
+		log_ship_config();
+#endif
+	} else if (keyfound) {
+		tmp_buffer[0]=0;
+		os.sopt_save(SOPT_LOGSHIP_OPTS, tmp_buffer);
+#if defined(LOG_SHIPPING)
+		log_ship_config();
+#endif
+	}
+
 	/*
 	// wtkey is retired
 	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("wtkey"), true, &keyfound)) {
@@ -1691,6 +1822,7 @@ void server_change_options()
 	if (err)	handle_return(HTML_DATA_OUTOFBOUND);
 
 	os.iopts_save();
+	pd.next_event_time = 0;	// master options may have changed
 
 	if(time_change) {
 		os.status.req_ntpsync = 1;
@@ -1737,6 +1869,9 @@ void server_change_password() {
 		if (findKeyVal(p, tbuf2, TMP_BUFFER_SIZE, PSTR("cpw"), true) && strncmp(tmp_buffer, tbuf2, TMP_BUFFER_SIZE) == 0) {
 			urlDecode(tmp_buffer);
 			os.sopt_save(SOPT_PASSWORD, tmp_buffer);
+#if defined(SESSION_TOKENS)
+			session_clear();
+#endif
 			handle_return(HTML_SUCCESS);
 		} else {
 			handle_return(HTML_MISMATCH);
@@ -1747,7 +1882,7 @@ void server_change_password() {
 
 void server_json_status_main() {
 	bfill.emit_p(PSTR("\"sn\":["));
-	byte sid;
+	sid_t sid;
 
 	for (sid=0;sid<os.nstations;sid++) {
 		bfill.emit_p(PSTR("$D"), (os.station_bits[(sid>>3)]>>(sid&0x07))&1);
@@ -1816,9 +1951,9 @@ void server_change_manual() {
 				handle_return(HTML_NOT_PERMITTED);
 
 			RuntimeQueueStruct *q = NULL;
-			byte sqi = pd.station_qid[sid];
+			qid_t sqi = pd.station_qid[sid];
 			// check if the station already has a schedule
-			if (sqi!=0xFF) {	// if we, we will overwrite the schedule
+			if (sqi!=QID_NONE) {	// if we, we will overwrite the schedule
 				q = pd.queue+sqi;
 			} else {	// otherwise create a new queue element
 				q = pd.enqueue();
@@ -1873,20 +2008,33 @@ void server_change_manual() {
 	handle_return(HTML_SUCCESS);
 }
 
+#define LOG_PAGE_SCAN 2048	// maximum number of records examined for a page of /jl
 
-#if defined(ESP8266) || defined(ESP32)
-int file_fgets(File file, char* buf, int maxsize) {
-	int index=0;
-	while(index<maxsize) {
-		int c = file.read();
-		if(c<0||c=='\n') break;
-		if(c=='\r') continue; // skip \r
-		*buf++ = (char)c;
-		index++;
+static bool log_comma;
+static long log_sid, log_pid;	// station / program filter, -1 if not specified
+static ulong log_mindur;	// minimum duration
+static ulong log_limit, log_count;	// maximum / current number of records in the response, 0 if no limit
+static ulong log_scanned;	// number of records examined for a page
+
+/** Emit a log record, records are rendered to JSON at response time */
+static bool server_log_emit(const LogRecord *rec) {
+	if (log_limit) {
+		// a page ends at the limit, or once enough records are examined
+		if (log_count==log_limit || log_scanned==LOG_PAGE_SCAN) return false;
+		log_scanned++;
+	}
+	if (rec->type==LOGDATA_STATION) {
+		if ((log_sid>=0 && rec->sid!=log_sid) || (log_pid>=0 && rec->pid!=log_pid)) return true;
 	}
-	return index;
+	// the duration field of water level records is the water level
+	if (rec->type!=LOGDATA_WATERLEVEL && rec->duration<log_mindur) return true;
+	log_count++;
+	// if this is the first record, do not print comma
+	if (log_comma) bfill.emit_p(PSTR(","));
+	else log_comma = true;
+	log_render(rec, bfill);
+	return true;
 }
-#endif
 
 /**
  * Get log data
@@ -1900,6 +2048,13 @@ int file_fgets(File file, char* buf, int maxsize) {
  * type:	type of log records (optional)
  *				rs, rd, wl
  *				if unspecified, output all records
+ * sid:		station index (optional, station records only)
+ * pid:		program index, as in the records (optional, station records only)
+ * dur:		minimum duration in seconds (optional)
+ * limit: maximum number of records (optional)
+ *				the response is then {"logs":[...],"next":"x"}, where next is
+ *				the cursor of the next page, or empty after the last page
+ * cursor: cursor returned by the previous page (optional)
  */
 void server_json_log() {
 
@@ -1940,6 +2095,35 @@ void server_json_log() {
 	bool type_specified = false;
 	if (findKeyVal(p, type, 4, PSTR("type"), true))
 		type_specified = true;
+	byte typemask = log_type_mask(type_specified ? type : NULL);
+
+	// record filters
+	log_sid = log_pid = -1;
+	log_mindur = 0;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sid"), true)) {
+		log_sid = atol(tmp_buffer);
+		typemask &= (1<<LOGDATA_STATION);
+	}
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("pid"), true)) {
+		log_pid = atol(tmp_buffer);
+		typemask &= (1<<LOGDATA_STATION);
+	}
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("dur"), true))
+		log_mindur = strtoul(tmp_buffer, NULL, 10);
+
+	// paging
+	log_limit = log_count = log_scanned = 0;
+	LogCursor cursor = {start, 0};
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("limit"), true)) {
+		log_limit = strtoul(tmp_buffer, NULL, 10);
+		if (!log_limit) handle_return(HTML_DATA_OUTOFBOUND);
+		if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("cursor"), true) && tmp_buffer[0]) {
+			char *s;
+			cursor.day = strtoul(tmp_buffer, &s, 10);
+			if (*s!='.' || cursor.day<start || cursor.day>end) handle_return(HTML_DATA_OUTOFBOUND);
+			cursor.index = strtoul(s+1, NULL, 10);
+		}
+	}
 
 #if defined(ESP8266) || defined(ESP32)
 	// as the log data can be large, we will use ESP8266's sendContent function to
@@ -1952,82 +2136,15 @@ void server_json_log() {
 	print_json_header(false);
 #endif
 
+	if (log_limit) bfill.emit_p(PSTR("{\"logs\":"));
 	bfill.emit_p(PSTR("["));
-
-	bool comma = 0;
-	for(unsigned int i=start;i<=end;i++) {
-		itoa(i, tmp_buffer, 10);
-		make_logfile_name(tmp_buffer);
-
-#if defined(ESP8266) || defined(ESP32)
-		File file = SPIFFS.open(tmp_buffer, "r");
-		if(!file) continue;
-#elif defined(ARDUINO)
-		if (!sd.exists(tmp_buffer)) continue;
-		SdFile file;
-		file.open(tmp_buffer, O_READ);
-#else // prepare to open log file for RPI/BBB
-		FILE *file = fopen(get_filename_fullpath(tmp_buffer), "rb");
-		if(!file) continue;
-#endif // prepare to open log file
-
-		int res;
-		while(true) {
-		#if defined(ESP8266) || defined(ESP32)
-			// do not use file.readBytes or readBytesUntil because it's very slow
-			int res = file_fgets(file, tmp_buffer, TMP_BUFFER_SIZE);
-			if (res <= 0) {
-				file.close();
-				break;
-			}
-			tmp_buffer[res]=0;
-		#elif defined(ARDUINO)
-			res = file.fgets(tmp_buffer, TMP_BUFFER_SIZE);
-			if (res <= 0) {
-				file.close();
-				break;
-			}
-		#else
-			if(fgets(tmp_buffer, TMP_BUFFER_SIZE, file)) {
-				res = strlen(tmp_buffer);
-			} else {
-				res = 0;
-			}
-			if (res <= 0) {
-				fclose(file);
-				break;
-			}
-		#endif
-			// check record type
-			// records are all in the form of [x,"xx",...]
-			// where x is program index (>0) if this is a station record
-			// and "xx" is the type name if this is a special record (e.g. wl, fl, rs)
-
-			// search string until we find the first comma
-			char *ptype = tmp_buffer;
-			tmp_buffer[TMP_BUFFER_SIZE-1]=0; // make sure the search will end
-			while(*ptype && *ptype != ',') ptype++;
-			if(*ptype != ',') continue; // didn't find comma, move on
-			ptype++;	// move past comma
-
-			if (type_specified && strncmp(type, ptype+1, 2))
-				continue;
-			// if type is not specified, output everything except "wl" and "fl" records
-			if (!type_specified && (!strncmp("wl", ptype+1, 2) || !strncmp("fl", ptype+1, 2)))
-				continue;
-			// if this is the first record, do not print comma
-			if (comma)	bfill.emit_p(PSTR(","));
-			else {comma=1;}
-			bfill.emit_p(PSTR("$S"), tmp_buffer);
-			// if the available ether buffer size is getting small
-			// push out a packet
-			if (available_ether_buffer() < 60) {
-				send_packet();
-			}
-		}
+	log_comma = false;
+	if (log_scan(start, end, typemask, server_log_emit, log_limit ? &cursor : NULL)) {
+		if (log_limit) bfill.emit_p(PSTR("],\"next\":\"\"}"));
+		else bfill.emit_p(PSTR("]"));
+	} else {
+		bfill.emit_p(PSTR("],\"next\":\"$L.$L\"}"), cursor.day, cursor.index);
 	}
-
-	bfill.emit_p(PSTR("]"));
 	handle_return(HTML_OK);
 }
 /**
@@ -2057,6 +2174,254 @@ void server_delete_log() {
 	handle_return(HTML_SUCCESS);
 }
 
+static byte rollup_kind;	// 0: stations, 1: programs, 2: flow sensor
+static bool rollup_comma;
+
+static void server_rollup_emit(uint16_t key, const RollupEntry *e) {
+	byte kind = (key==ROLLUP_KEY_FLOW) ? 2 : ((key&ROLLUP_KEY_PROGRAM) ? 1 : 0);
+	if (kind != rollup_kind) return;
+	if (rollup_comma) bfill.emit_p(PSTR(","));
+	else rollup_comma = true;
+	if (kind < 2) bfill.emit_p(PSTR("[$L,"), (ulong)(key&~ROLLUP_KEY_PROGRAM));
+	else bfill.emit_p(PSTR("["));
+	bfill.emit_p(PSTR("$L,$L,$L.$D$D]"), (ulong)e->seconds, (ulong)e->runs,
+							 (ulong)(e->volume/100), (int)((e->volume/10)%10), (int)(e->volume%10));
+}
+
+/**
+ * Get watering rollups
+ * Command: /jr?pw=xxx&agg=x&t=x&n=x
+ *
+ * pw:	password
+ * agg: day or month
+ * t:		time (epoch time) in the last period (optional, default is now)
+ * n:		number of periods, at most 31 days or 12 months (optional, default is 1)
+ *
+ * For each period, stations and programs are listed as [id,seconds,runs,volume]
+ * and the flow sensor as [seconds,records,volume]
+ */
+void server_json_rollups() {
+#if defined(ESP8266) || defined(ESP32)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;
+#else
+	char *p = get_buffer;
+#endif
+
+	if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("agg"), true)) handle_return(HTML_DATA_MISSING);
+	bool month;
+	if (!strcmp_P(tmp_buffer, PSTR("day"))) month = false;
+	else if (!strcmp_P(tmp_buffer, PSTR("month"))) month = true;
+	else handle_return(HTML_DATA_OUTOFBOUND);
+
+	ulong day = os.now_tz() / 86400L;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("t"), true)) {
+		day = strtoul(tmp_buffer, NULL, 10) / 86400L;
+	}
+	int n = 1;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("n"), true)) {
+		n = atoi(tmp_buffer);
+		if (n < 1 || n > (month ? 12 : 31)) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+#if defined(ESP8266) || defined(ESP32)
+	rewind_ether_buffer();
+#endif
+	print_json_header();
+	bfill.emit_p(PSTR("\"agg\":\"$S\",\"periods\":["), month ? "month" : "day");
+	for (int i=n-1; i>=0; i--) {
+		ulong start = month ? rollup_month_start(day, -i) : day-i;
+		bfill.emit_p(PSTR("{\"t\":$L"), start*86400L);
+		for (rollup_kind=0; rollup_kind<3; rollup_kind++) {
+			if (rollup_kind==0) bfill.emit_p(PSTR(",\"stations\":["));
+			else if (rollup_kind==1) bfill.emit_p(PSTR(",\"programs\":["));
+			else bfill.emit_p(PSTR(",\"flow\":["));
+			rollup_comma = false;
+			rollup_scan(start, month, server_rollup_emit);
+			bfill.emit_p(PSTR("]"));
+		}
+		bfill.emit_p(i ? PSTR("},") : PSTR("}"));
+	}
+	bfill.emit_p(PSTR("]}"));
+	handle_return(HTML_OK);
+}
+
+#if !defined(ARDUINO)
+/**
+ * Export raw log files (Linux only)
+ * Command: /xl?pw=xxx&start=x&end=x
+ *
+ * pw:    password
+ * start: start time (epoch time, optional)
+ * end:   end time (epoch time, optional)
+ *        if unspecified, all log files are exported
+ *
+ * The body starts with a manifest line:
+ *   {"files":[["19723.bin",316],["19726.seg",140],["202401.sum",1552]],"bytes":2008}
+ * followed by the content of the listed files in that order, without
+ * separators. The file contents are sent by the kernel with sendfile().
+ */
+void server_export_log() {
+	char *p = get_buffer;
+	ulong start = 0, end = 0xFFFFFFFFUL;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true))
+		start = strtoul(tmp_buffer, NULL, 10) / 86400L;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true))
+		end = strtoul(tmp_buffer, NULL, 10) / 86400L;
+	if (start>end) handle_return(HTML_DATA_OUTOFBOUND);
+
+	log_flush();	// so that pending records are exported too
+	uint16_t n;
+	LogExportFile *files = log_export_files(start, end, &n);
+
+	// manifest: file names without the folder, and sizes
+	ulong bytes = 0;
+	size_t mlen = 32;
+	for (uint16_t i=0; i<n; i++) {
+		bytes += files[i].size;
+		mlen += LOG_FILENAME_SIZE+16;
+	}
+	char *manifest = (char*)malloc(mlen);
+	if (!manifest) {
+		free(files);
+		handle_return(HTML_DATA_OUTOFBOUND);
+	}
+	int k = sprintf(manifest, "{\"files\":[");
+	for (uint16_t i=0; i<n; i++) {
+		const char *name = strrchr(files[i].fn, '/');
+		k += sprintf(manifest+k, "%s[\"%s\",%lu]", i ? "," : "", name ? name+1 : files[i].fn, files[i].size);
+	}
+	k += sprintf(manifest+k, "],\"bytes\":%lu}\n", bytes);
+
+	char header[128];
+	int h = snprintf(header, sizeof(header),
+									 "Content-Type: application/octet-stream\r\nContent-Length: %lu\r\nConnection: close\r\n",
+									 (ulong)k+bytes);
+	m_client->write((const uint8_t *)html200OK, strlen(html200OK));
+	m_client->write((const uint8_t *)header, h);
+	m_client->write((const uint8_t *)htmlNoCache, strlen(htmlNoCache));
+	m_client->write((const uint8_t *)htmlAccessControl, strlen(htmlAccessControl));
+	m_client->write((const uint8_t *)"\r\n", 2);
+	m_client->write((const uint8_t *)manifest, k);
+	free(manifest);
+
+	// the file contents go from the page cache to the socket without being copied here,
+	// if a file cannot be sent in full (e.g. EPIPE, the client is gone) the transfer ends
+	// and the connection is closed short of Content-Length
+	int sock = m_client->GetSocket();
+	for (uint16_t i=0; i<n; i++) {
+		int fd = open(get_filename_fullpath(files[i].fn), O_RDONLY);
+		if (fd<0) break;
+		off_t off = 0;
+		while (off<(off_t)files[i].size) {
+			ssize_t r = sendfile(sock, fd, &off, files[i].size-off);
+			if (r<0 && errno==EINTR) continue;
+			if (r<=0) break;
+		}
+		close(fd);
+		if (off<(off_t)files[i].size) break;
+	}
+	free(files);
+	rewind_ether_buffer();
+	handle_return(HTML_OK);
+}
+#endif
+
+#if defined(SESSION_TOKENS)
+/**
+ * Get a session token
+ * Command: /tk?pw=xxx
+ *
+ * pw: password (a session token cannot be used to get a new token)
+ *
+ * Returns {"token":"xxx","ttl":600}. Until it expires, the token can be
+ * passed as tk=xxx in place of pw=xxx to any other command.
+ */
+void server_session_token() {
+#if defined(ESP8266) || defined(ESP32)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;
+#else
+	char *p = get_buffer;
+#endif
+
+	if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("pw"), true)) handle_return(HTML_DATA_MISSING);
+	urlDecode(tmp_buffer);
+	if (!os.iopts[IOPT_IGNORE_PASSWORD] && !os.password_verify(tmp_buffer)) handle_return(HTML_UNAUTHORIZED);
+
+#if defined(ESP8266) || defined(ESP32)
+	rewind_ether_buffer();
+#endif
+	print_json_header();
+	bfill.emit_p(PSTR("\"token\":\"$S\",\"ttl\":$D}"), session_create(), SESSION_TTL);
+	handle_return(HTML_OK);
+}
+#endif
+
+static ulong preview_start;
+static bool preview_comma;
+
+static void server_preview_emit(RuntimeQueueStruct *q) {
+	bfill.emit_p(PSTR("$S[$D,$D,$L,$L]"), preview_comma?",":"", q->sid, q->pid, q->st-preview_start, q->dur);
+	preview_comma = true;
+}
+
+/**
+ * Preview the watering timeline
+ * Command: /pv?pw=xxx&day=xxx&n=x
+ *
+ * pw: password
+ * day: day (local epoch time / 86400), default is today
+ * n: number of days (1 to 7), default is 1
+ * Output: {"day":x,"sn":x,"tl":[[sid,pid,st,dur],...]}
+ * st is the start time in seconds from the beginning of the day,
+ * pid is the 1-based program index
+ * Runs cancelled by the current rain delay or a disabled controller are left out,
+ * sn is 1 if a rain or soil sensor is active (its runs are still listed)
+ */
+void server_preview() {
+#if defined(ESP8266) || defined(ESP32)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;
+#else
+	char *p = get_buffer;
+#endif
+
+	ulong day = os.now_tz() / 86400L;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("day"), true)) {
+		day = atol(tmp_buffer);
+	}
+	int n = 1;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("n"), true)) {
+		n = atoi(tmp_buffer);
+		if (n < 1 || n > 7) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+#if defined(ESP8266) || defined(ESP32)
+	rewind_ether_buffer();
+#endif
+	// sensors are not simulated, tell the app if one is active now
+	byte sn = 0;
+	byte t1 = os.iopts[IOPT_SENSOR1_TYPE], t2 = os.iopts[IOPT_SENSOR2_TYPE];
+	if ((t1==SENSOR_TYPE_RAIN || t1==SENSOR_TYPE_SOIL) && os.status.sensor1_active) sn = 1;
+	if ((t2==SENSOR_TYPE_RAIN || t2==SENSOR_TYPE_SOIL) && os.status.sensor2_active) sn = 1;
+	print_json_header();
+	bfill.emit_p(PSTR("\"day\":$L,\"sn\":$D,\"tl\":["), day, sn);
+	preview_start = day*86400L;
+	preview_comma = false;
+	if (!preview_timeline(preview_start, preview_start+n*86400L, server_preview_emit)) {
+		DEBUG_PRINTLN(F("preview: out of memory"));
+	}
+	bfill.emit_p(PSTR("]}"));
+	handle_return(HTML_OK);
+}
+
 /** Output all JSON data, including jc, jp, jo, js, jn */
 void server_json_all() {
 #if defined(ESP8266) || defined(ESP32)
@@ -2066,22 +2431,94 @@ void server_json_all() {
 	print_json_header();
 	bfill.emit_p(PSTR("\"settings\":{"));
 	server_json_controller_main();
-	send_packet();
 	bfill.emit_p(PSTR(",\"programs\":{"));
 	server_json_programs_main();
-	send_packet();
 	bfill.emit_p(PSTR(",\"options\":{"));
 	server_json_options_main();
-	send_packet();
 	bfill.emit_p(PSTR(",\"status\":{"));
 	server_json_status_main();
-	send_packet();
 	bfill.emit_p(PSTR(",\"stations\":{"));
 	server_json_stations_main();
 	bfill.emit_p(PSTR("}"));
 	handle_return(HTML_OK);
 }
 
+#if defined(CHANGE_JOURNAL)
+static const char change_kind_names[][9] PROGMEM = {"programs", "stations", "options", "sopts", "nvdata"};
+
+/**
+ * Output the changes since a sequence number
+ * Command: /jh?pw=xxx&since=x&boot=x
+ *
+ * pw:    password
+ * since: sequence number of the last sync (seq of the previous /jh)
+ * boot:  boot id of the last sync (optional)
+ *
+ * If the journal no longer holds all changes after since, or the controller
+ * has rebooted, returns {"seq":x,"boot":x,"resync":1} and the client must
+ * reload everything (e.g. with /ja). Otherwise returns "resync":0, the changes
+ * as [seq,"kind",id] (id is -1 if the whole kind changed), and the sections of
+ * /ja (settings, programs, options, stations) whose data changed.
+ */
+void server_json_changes() {
+#if defined(ESP8266) || defined(ESP32)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;
+#else
+	char *p = get_buffer;
+#endif
+
+	if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("since"), true)) handle_return(HTML_DATA_MISSING);
+	ulong since = strtoul(tmp_buffer, NULL, 10);
+	bool resync = (since<os.change_floor || since>os.change_seq);
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("boot"), true)) {
+		if (strtoul(tmp_buffer, NULL, 10)!=os.change_boot) resync = true;
+	}
+
+#if defined(ESP8266) || defined(ESP32)
+	rewind_ether_buffer();
+#endif
+	print_json_header();
+	bfill.emit_p(PSTR("\"seq\":$L,\"boot\":$L,\"resync\":$D"), os.change_seq, os.change_boot, resync?1:0);
+	if (resync) {
+		bfill.emit_p(PSTR("}"));
+		handle_return(HTML_OK);
+	}
+
+	byte kinds = 0;	// bit i is set if data of kind i changed
+	bfill.emit_p(PSTR(",\"changes\":["));
+	bool comma = false;
+	for (byte i=0; i<os.nchanges; i++) {
+		const ChangeRecord *c = os.changes+i;
+		if (c->seq<=since) continue;
+		kinds |= 1<<c->kind;
+		bfill.emit_p(PSTR("$S[$L,\"$F\",$D]"), comma?",":"", c->seq, change_kind_names[c->kind], (c->id==CHANGE_ID_ALL)?-1:(int)c->id);
+		comma = true;
+	}
+	bfill.emit_p(PSTR("]"));
+	if (kinds & ((1<<CHANGE_IOPTS)|(1<<CHANGE_SOPT)|(1<<CHANGE_NVDATA))) {
+		bfill.emit_p(PSTR(",\"settings\":{"));
+		server_json_controller_main();
+	}
+	if (kinds & (1<<CHANGE_PROGRAM)) {
+		bfill.emit_p(PSTR(",\"programs\":{"));
+		server_json_programs_main();
+	}
+	if (kinds & (1<<CHANGE_IOPTS)) {
+		bfill.emit_p(PSTR(",\"options\":{"));
+		server_json_options_main();
+	}
+	if (kinds & (1<<CHANGE_STATION)) {
+		bfill.emit_p(PSTR(",\"stations\":{"));
+		server_json_stations_main();
+	}
+	bfill.emit_p(PSTR("}"));
+	handle_return(HTML_OK);
+}
+#endif
+
 #if defined(ARDUINO) && (!defined(ESP8266) && !defined(ESP32))
 static int freeHeap () {
   extern int __heap_start, *__brkval; 
@@ -2097,17 +2534,24 @@ void server_json_debug() {
 	bfill.emit_p(PSTR("\"date\":\"$S\",\"time\":\"$S\",\"heap\":$D"), __DATE__, __TIME__,
 	#if defined(ESP8266) || defined(ESP32)
 	(uint16_t)ESP.getFreeHeap());
+	// largest free heap block, which shrinks as the heap fragments
+	#if defined(ESP8266)
+	bfill.emit_p(PSTR(",\"maxblk\":$L"), (ulong)ESP.getMaxFreeBlockSize());
+	#elif defined(ESP32)
+	bfill.emit_p(PSTR(",\"maxblk\":$L"), (ulong)ESP.getMaxAllocHeap());
+	#endif
 	#if defined(ESP8266)
   	FSInfo fs_info;
-	SPIFFS.info(fs_info);
-	bfill.emit_p(PSTR(",\"flash\":$D,\"used\":$D}"), fs_info.totalBytes, fs_info.usedBytes);
+	FILESYSTEM.info(fs_info);
+	bfill.emit_p(PSTR(",\"flash\":$D,\"used\":$D"), fs_info.totalBytes, fs_info.usedBytes);
 	#elif defined(ESP32)
-	bfill.emit_p(PSTR(",\"flash\":$D,\"used\":$D}"), SPIFFS.totalBytes(), SPIFFS.usedBytes());
+	bfill.emit_p(PSTR(",\"flash\":$D,\"used\":$D"), FILESYSTEM.totalBytes(), FILESYSTEM.usedBytes());
 	#endif 
 	#else
 	(uint16_t)freeHeap());
-	bfill.emit_p(PSTR("}"));
 	#endif
+	// log storage: bytes used, budget (0: no limit) and oldest day
+	bfill.emit_p(PSTR(",\"logs\":$L,\"logbgt\":$L,\"logday\":$L}"), log_usage(), log_budget(), log_oldest_day());
 	handle_return(HTML_OK);
 }
 #endif
@@ -2142,9 +2586,20 @@ const char _url_keys[] PROGMEM =
 	"su"
 	"cu"
 	"ja"
+	"pv"
+	"jr"
 #if defined(ARDUINO)  
   "db"
 #endif	
+#if !defined(ARDUINO)
+	"xl"
+#endif
+#if defined(SESSION_TOKENS)
+	"tk"
+#endif
+#if defined(CHANGE_JOURNAL)
+	"jh"
+#endif
 	;
 
 // Server function handlers
@@ -2170,21 +2625,30 @@ URLHandler urls[] = {
 	server_view_scripturl,	// su
 	server_change_scripturl,// cu
 	server_json_all,				// ja
+	server_preview,					// pv
+	server_json_rollups,		// jr
 #if defined(ARDUINO)  
   server_json_debug,			// db
 #endif	
+#if !defined(ARDUINO)
+	server_export_log,			// xl
+#endif
+#if defined(SESSION_TOKENS)
+	server_session_token,		// tk
+#endif
+#if defined(CHANGE_JOURNAL)
+	server_json_changes,		// jh
+#endif
 };
 
 // handle Ethernet request
 #if defined(ESP8266) || defined(ESP32)
 void on_ap_update() {
-	String html = FPSTR(ap_update_html);
-	server_send_html(html);
+	server_send_html_P(ap_update_html);
 }
 
 void on_sta_update() {
-	String html = FPSTR(sta_update_html);
-	server_send_html(html);
+	server_send_html_P(sta_update_html);
 }
 
 void on_sta_upload_fin() {
@@ -2305,9 +2769,9 @@ void start_server_client() {
 void start_server_ap() {
 	if(!wifi_server) return;
 	
-	scanned_ssids = scan_network();
-	String ap_ssid = get_ap_ssid();
-	start_network_ap(ap_ssid.c_str(), NULL);
+	if(!scanned) scanned = (ScannedNetwork*)malloc(SCAN_MAX_NETWORKS*sizeof(ScannedNetwork));
+	nscanned = scanned ? scan_network(scanned, SCAN_MAX_NETWORKS) : 0;
+	start_network_ap(get_ap_ssid(), NULL);
 	delay(500);
 	wifi_server->on("/", on_ap_home);
 	wifi_server->on("/jsap", on_ap_scan);
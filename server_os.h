@@ -27,16 +27,90 @@
 #if !defined(ARDUINO)
 #include <stdarg.h>
 #endif
+#include "OpenSprinkler.h"
+
+/** Session tokens (ESP8266/ESP32 and Linux)
+ * /tk?pw=xxx returns a random token that can be passed as tk=xxx instead
+ * of the password for SESSION_TTL seconds. At most SESSION_MAX tokens are
+ * kept, a new token replaces the oldest one. Changing the password drops
+ * all tokens.
+ */
+#if !defined(ARDUINO) || defined(ESP8266) || defined(ESP32)
+	#define SESSION_TOKENS
+#endif
+#define SESSION_MAX        4
+#define SESSION_TTL        600	// seconds
+#define SESSION_TOKEN_SIZE 16	// hex characters
 
 char dec2hexchar(byte dec);
 void server_change_manual(void);
 
+/** Buffer filler
+ * emit_p() appends to a buffer of a given size, following a format string:
+ * $D int, $L unsigned long, $X byte in hex, $S string, $E string escaped for
+ * JSON, $F string in PROGMEM, $O string option. Output never goes past the end
+ * of the buffer, and the buffer always ends with a 0.
+ * A filler with a flush function (bfill, which holds the HTTP response) calls it
+ * once less than BUFFER_FLUSH_MARGIN bytes are left, or when the buffer is full,
+ * so handlers do not check the space left themselves. Without a flush function,
+ * output that does not fit is dropped.
+ */
+#define BUFFER_FLUSH_MARGIN 250
+
+typedef void (*BufferFlush)();
+
 class BufferFiller {
 	char *start; //!< Pointer to start of buffer
 	char *ptr; //!< Pointer to cursor position
+	char *limit; //!< Pointer to the last byte of the buffer, kept for the ending 0
+	BufferFlush flush; //!< Sends out and rewinds the buffer, NULL if the buffer is not streamed
+
+	/** Make room for n bytes, returns false if there is not enough room */
+	bool reserve(uint16_t n) {
+		if (ptr+n <= limit) return true;
+		if (!flush || ptr==start) return false;
+		*ptr = 0;
+		flush();
+		return ptr+n <= limit;
+	}
+
+	void put(char c) {
+		if (ptr<limit || reserve(1)) *ptr++ = c;
+	}
+
+	void put_str(const char *s) {
+		while (*s) put(*s++);
+	}
+
+	void put_json(const char *s) {
+		for (; *s; s++) {
+			byte c = *s;
+			if (c=='"' || c=='\\') { put('\\'); put(c); }
+			else if (c=='\n') { put('\\'); put('n'); }
+			else if (c=='\r') { put('\\'); put('r'); }
+			else if (c=='\t') { put('\\'); put('t'); }
+			else if (c<0x20) {
+				put('\\'); put('u'); put('0'); put('0');
+				put(dec2hexchar(c>>4)); put(dec2hexchar(c&0x0F));
+			}
+			else put(c);
+		}
+	}
+
+	void put_ulong(unsigned long v) {
+		char digits[20];
+		byte n = 0;
+		do {
+			digits[n++] = '0' + v%10;
+			v /= 10;
+		} while (v);
+		if (!reserve(n)) return;
+		while (n) *ptr++ = digits[--n];
+	}
+
 public:
 	BufferFiller () {}
-	BufferFiller (char *buf) : start (buf), ptr (buf) {}
+	BufferFiller (char *buf, uint16_t size, BufferFlush f=NULL) : start (buf), ptr (buf), limit (buf+size-1), flush (f) {}
 
 	void emit_p(PGM_P fmt, ...) {
 		va_list ap;
@@ -46,48 +120,72 @@ public:
 			if (c == 0)
 				break;
 			if (c != '$') {
-				*ptr++ = c;
+				put(c);
 				continue;
 			}
 			c = pgm_read_byte(fmt++);
 			switch (c) {
-			case 'D':
-				//wtoa(va_arg(ap, uint16_t), (char*) ptr);
-				itoa(va_arg(ap, int), (char*) ptr, 10);  // ray
+			case 'D': {
+				int d = va_arg(ap, int);
+				if (d<0) {
+					put('-');
+					put_ulong(-(long)d);
+				} else {
+					put_ulong(d);
+				}
+			}
 				break;
 			case 'L':
-				//ltoa(va_arg(ap, long), (char*) ptr, 10);
-				ultoa(va_arg(ap, long), (char*) ptr, 10); // ray
+				put_ulong(va_arg(ap, unsigned long));
 				break;
 			case 'S':
-				strcpy((char*) ptr, va_arg(ap, const char*));
+				put_str(va_arg(ap, const char*));
+				break;
+			case 'E':
+				put_json(va_arg(ap, const char*));
 				break;
 			case 'X': {
 				char d = va_arg(ap, int);
-				*ptr++ = dec2hexchar((d >> 4) & 0x0F);
-				*ptr++ = dec2hexchar(d & 0x0F);
+				put(dec2hexchar((d >> 4) & 0x0F));
+				put(dec2hexchar(d & 0x0F));
 			}
-				continue;
+				break;
 			case 'F': {
 				PGM_P s = va_arg(ap, PGM_P);
 				char d;
 				while ((d = pgm_read_byte(s++)) != 0)
-						*ptr++ = d;
-				continue;
+					put(d);
 			}
+				break;
 			case 'O': {
 				uint16_t oid = va_arg(ap, int);
-				file_read_block(SOPTS_FILENAME, (char*) ptr, oid*MAX_SOPTS_SIZE, MAX_SOPTS_SIZE);
+#if defined(SOPTS_CACHE)
+				if (OpenSprinkler::sopts_cache[oid]) {
+					put_str(OpenSprinkler::sopts_cache[oid]);
+					break;
+				}
+#endif
+				// the option is loaded in place, up to MAX_SOPTS_SIZE bytes and the ending 0
+				if (reserve(MAX_SOPTS_SIZE)) {
+					OpenSprinkler::sopt_load(oid, ptr);
+					ptr += strlen(ptr);
+				}
 			}
 				break;
 			default:
-				*ptr++ = c;
-				continue;
+				put(c);
+				break;
 			}
-			ptr += strlen((char*) ptr);
 		}
-		*(ptr)=0;				 
+		*ptr = 0;
 		va_end(ap);
+		if (flush && limit-ptr < BUFFER_FLUSH_MARGIN) flush();
+	}
+
+	/** Move the cursor back to the start of the buffer */
+	void rewind() {
+		ptr = start;
+		*ptr = 0;
 	}
 
 	char* buffer () const { return start; }
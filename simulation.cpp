@@ -0,0 +1,385 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Time-warp simulation (DEMO build only)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(DEMO)
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "OpenSprinkler.h"
+#include "program.h"
+#include "simulation.h"
+#include "logs.h"
+
+extern OpenSprinkler os;
+extern ProgramData pd;
+extern EthernetClient *m_client;
+extern char ether_buffer[];
+
+void do_setup();
+void do_loop();
+void handle_web_request(char *p);
+
+/** Scenario event: a command to apply at a given (controller local) time */
+struct SimEvent {
+	time_t t;
+	char *cmd;
+};
+
+static bool sim_on = false;
+static uint64_t sim_clock_ms;	// virtual UTC time in milliseconds
+static uint64_t sim_boot_ms;	// virtual time at start up, millis() counts from here
+static time_t sim_start, sim_end;	// simulated period (controller local time)
+static SimEvent *sim_events = NULL;
+static int sim_nevents = 0;
+static byte sim_sensor[2] = {0, 0};	// whether the scenario has activated sensor 1 / 2
+static float sim_flow_gpm = 0;	// flow rate while any station is running
+
+struct SimTimer {
+	const char *name;
+	struct timespec t0;	// wall time when the timed part was entered
+	double us;	// total wall time
+	double max_us;	// longest call
+	ulong calls;
+};
+static SimTimer sim_timers[SIM_NUM_TIMERS] = {{"scheduler"}, {"queue walk"}};
+
+bool sim_active() {
+	return sim_on;
+}
+
+time_t sim_now() {
+	return sim_on ? (time_t)(sim_clock_ms/1000) : time(0);
+}
+
+unsigned long sim_millis() {
+	return (unsigned long)(sim_clock_ms - sim_boot_ms);
+}
+
+void sim_delay(unsigned long ms) {
+	sim_clock_ms += ms;
+}
+
+static double sim_elapsed_us(const struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e6 + (t1.tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+/** Time spent in a part of the firmware (SIM_TIMER_xxx) */
+void sim_timer_start(unsigned char t) {
+	if (sim_on) clock_gettime(CLOCK_MONOTONIC, &sim_timers[t].t0);
+}
+
+void sim_timer_stop(unsigned char t) {
+	if (!sim_on) return;
+	SimTimer *st = sim_timers + t;
+	double us = sim_elapsed_us(&st->t0);
+	st->us += us;
+	if (us > st->max_us) st->max_us = us;
+	st->calls++;
+}
+
+static bool sim_station_running() {
+	return station_bits_count(os.station_bits, os.nboards) > 0;
+}
+
+/** Sensor input levels are derived from the scenario state */
+unsigned char sim_digital_read(int pin) {
+	if (pin == PIN_SENSOR1 && os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
+		// square wave with one pulse per gallon, while any station is running
+		if (sim_flow_gpm <= 0 || !sim_station_running()) return HIGH;
+		uint64_t period = (uint64_t)(60000 / sim_flow_gpm);
+		if (period < 2) period = 2;
+		return (sim_clock_ms % period < period/2) ? HIGH : LOW;
+	}
+	// the sensor reads active if the input differs from its normal (open/closed) state
+	if (pin == PIN_SENSOR1) {
+		return sim_sensor[0] ? !os.iopts[IOPT_SENSOR1_OPTION] : os.iopts[IOPT_SENSOR1_OPTION];
+	}
+	if (pin == PIN_SENSOR2) {
+		return sim_sensor[1] ? !os.iopts[IOPT_SENSOR2_OPTION] : os.iopts[IOPT_SENSOR2_OPTION];
+	}
+	return 0;
+}
+
+/** Parse a time in the form of YYYY-MM-DD HH:MM[:SS]
+ * rest is set to the text following the time
+ */
+static bool sim_parse_time(const char *s, time_t *t, const char **rest) {
+	struct tm tm;
+	int n = 0, m = 0;
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%d-%d-%d %d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &n) < 5) return false;
+	s += n;
+	if (sscanf(s, ":%d%n", &tm.tm_sec, &m) == 1) s += m;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*t = timegm(&tm);
+	while (*s == ' ' || *s == '\t') s++;
+	*rest = s;
+	return true;
+}
+
+/** Load a scenario file
+ * start <time>          begin of the simulated period
+ * end <time>            end of the simulated period
+ * <time> <command>      apply a command at the given time
+ * Times are the controller's local time, events must be in chronological order.
+ */
+static bool sim_load(const char *filename) {
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "sim: cannot open %s\n", filename);
+		return false;
+	}
+	char line[SIM_MAX_LINE];
+	int lineno = 0;
+	bool ok = true;
+	sim_start = sim_end = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char *p = line + strlen(line);
+		while (p > line && (p[-1] == '\n' || p[-1] == '\r' || p[-1] == ' ')) *--p = 0;
+		p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p || *p == '#') continue;
+
+		const char *rest;
+		time_t t;
+		if (!strncmp(p, "start ", 6) || !strncmp(p, "end ", 4)) {
+			bool start = (p[0] == 's');
+			if (!sim_parse_time(p + (start ? 6 : 4), &t, &rest)) { ok = false; break; }
+			if (start) sim_start = t;
+			else sim_end = t;
+			continue;
+		}
+		if (!sim_parse_time(p, &t, &rest) || !*rest) { ok = false; break; }
+		if (sim_nevents && t < sim_events[sim_nevents-1].t) {
+			fprintf(stderr, "sim: line %d: events must be in chronological order\n", lineno);
+			fclose(fp);
+			return false;
+		}
+		sim_events = (SimEvent*)realloc(sim_events, (sim_nevents+1)*sizeof(SimEvent));
+		sim_events[sim_nevents].t = t;
+		sim_events[sim_nevents].cmd = strdup(rest);
+		sim_nevents++;
+	}
+	fclose(fp);
+	if (!ok) {
+		fprintf(stderr, "sim: line %d: syntax error\n", lineno);
+		return false;
+	}
+	if (!sim_start || sim_end <= sim_start) {
+		fprintf(stderr, "sim: missing or invalid start / end time\n");
+		return false;
+	}
+	return true;
+}
+
+/** Send an HTTP GET request to the web server
+ * The response goes to fd, which is closed afterwards
+ */
+static void sim_request(const char *url, int fd) {
+	snprintf(ether_buffer, ETHER_BUFFER_SIZE, "GET %s HTTP/1.1\r\n\r\n", url);
+	EthernetClient client(fd);
+	m_client = &client;
+	handle_web_request(ether_buffer);
+	m_client = 0;
+}
+
+/** Time n requests of a URL, mostly the cost of rendering the response with emit_p
+ * The response size is measured once through a socket pair, the timed responses are discarded.
+ */
+static void sim_bench(int n, const char *url) {
+	long bytes = 0;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+		int size = 1<<22;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		fcntl(sv[0], F_SETFL, O_NONBLOCK);
+		sim_request(url, sv[0]);
+		char buf[4096];
+		ssize_t r;
+		while ((r = read(sv[1], buf, sizeof(buf))) > 0) bytes += r;
+		close(sv[1]);
+	}
+	struct timeval t0, t1;
+	gettimeofday(&t0, NULL);
+	for (int i = 0; i < n; i++) {
+		sim_request(url, open("/dev/null", O_WRONLY));
+	}
+	gettimeofday(&t1, NULL);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+	printf("sim: bench %s: %ld bytes, %d requests in %.3f s, %.1f us per request, %.1f MB/s\n",
+				 url, bytes, n, secs, secs * 1e6 / n, bytes * n / secs / 1e6);
+}
+
+/** Time block writes and reads on each storage backend
+ * n blocks of len bytes are written to a scratch file, cycling over
+ * SIM_STORAGE_BLOCKS positions, then read back. Each block is timed on its own.
+ */
+#define SIM_STORAGE_BLOCKS	64
+#define SIM_STORAGE_FILE	"storage_bench.dat"
+
+static void sim_storage_bench(int n, int len) {
+	const char *prev = storage_name();
+	byte *buf = (byte*)malloc(len);
+	if (!buf) return;
+	for (byte b = 0; storage_backend_name(b); b++) {
+		storage_select(storage_backend_name(b));
+		remove_file(SIM_STORAGE_FILE);
+		double us[2] = {0, 0}, max_us[2] = {0, 0};
+		struct timespec t0;
+		for (int op = 0; op < 2; op++) {
+			for (int i = 0; i < n; i++) {
+				ulong pos = (ulong)(i % SIM_STORAGE_BLOCKS) * len;
+				memset(buf, i, len);
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				if (op == 0) file_write_block(SIM_STORAGE_FILE, buf, pos, len);
+				else file_read_block(SIM_STORAGE_FILE, buf, pos, len);
+				double t = sim_elapsed_us(&t0);
+				us[op] += t;
+				if (t > max_us[op]) max_us[op] = t;
+			}
+		}
+		remove_file(SIM_STORAGE_FILE);
+		printf("sim: storage %-6s %d x %d bytes: write %.2f us per block (max %.1f), read %.2f us per block (max %.1f)\n",
+					 storage_backend_name(b), n, len, us[0] / n, max_us[0], us[1] / n, max_us[1]);
+	}
+	storage_select(prev);
+	free(buf);
+}
+
+/** Apply a scenario command
+ * get <url>             send an HTTP GET request, e.g. get /cv?pw=xxx&rd=24
+ * bench <n> <url>       time n GET requests of a URL
+ * storage <n> <len>     time n block writes and reads of len bytes on each storage backend
+ * sensor1 on|off        activate / deactivate sensor 1 (rain or soil sensor)
+ * sensor2 on|off        activate / deactivate sensor 2
+ * flow <gpm>            flow rate measured while stations are running
+ */
+static void sim_apply(const char *cmd) {
+	if (!strncmp(cmd, "get ", 4)) {
+		cmd += 4;
+		while (*cmd == ' ') cmd++;
+		// the response is discarded
+		sim_request(cmd, open("/dev/null", O_WRONLY));
+	} else if (!strncmp(cmd, "bench ", 6)) {
+		int n = atoi(cmd+6);
+		const char *url = strchr(cmd+6, ' ');
+		if (n > 0 && url) sim_bench(n, url+1);
+		else fprintf(stderr, "sim: bench: missing count or url\n");
+	} else if (!strncmp(cmd, "storage ", 8)) {
+		int n = 0, len = 0;
+		if (sscanf(cmd+8, "%d %d", &n, &len) == 2 && n > 0 && len > 0) sim_storage_bench(n, len);
+		else fprintf(stderr, "sim: storage: missing count or block size\n");
+	} else if (!strncmp(cmd, "sensor1 ", 8) || !strncmp(cmd, "sensor2 ", 8)) {
+		sim_sensor[cmd[6]-'1'] = !strcmp(cmd+8, "on");
+	} else if (!strncmp(cmd, "flow ", 5)) {
+		sim_flow_gpm = atof(cmd+5);
+	} else {
+		fprintf(stderr, "sim: unknown command: %s\n", cmd);
+	}
+}
+
+/** Virtual time of the next loop iteration
+ * The loop runs once every minute (when programs may start), at the next
+ * state change of the runtime queue, and every second while a sensor or
+ * rain delay change is pending. Flow pulses are sampled every 100 ms.
+ */
+static uint64_t sim_next_step(int next_event) {
+	time_t curr_time = os.now_tz();
+	int32_t tz_offset = curr_time - now();
+	bool flow = (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW);
+	uint64_t step = 60000L;
+	if (os.status.program_busy && flow) {
+		step = (sim_flow_gpm > 0) ? 100 : 1000;
+	} else if ((os.status.rain_delayed && os.nvdata.rd_stop_time <= (ulong)curr_time+60) ||
+						 os.status.sensor1 != os.status.sensor1_active ||
+						 os.status.sensor2 != os.status.sensor2_active) {
+		step = 1000;
+	}
+	uint64_t next = (sim_clock_ms/step+1)*step;
+	if (os.status.program_busy && pd.next_event_time < ULONG_MAX) {
+		// the runtime queue tells when the next station or master changes state
+		uint64_t t = (uint64_t)(pd.next_event_time - tz_offset)*1000;
+		if (t <= sim_clock_ms) t = (sim_clock_ms/1000+1)*1000;
+		if (t < next) next = t;
+	}
+	// do not skip over the next scenario event
+	if (next_event < sim_nevents) {
+		uint64_t t = (uint64_t)(sim_events[next_event].t - tz_offset)*1000;
+		if (t > sim_clock_ms && t < next) next = t;
+	}
+	return next;
+}
+
+/** Run a scenario
+ * Log files are written to the runtime path as in normal operation,
+ * so the simulation should be started in an empty directory.
+ */
+int sim_main(const char *scenario) {
+	if (!sim_load(scenario)) return 1;
+	sim_on = true;
+	sim_clock_ms = sim_boot_ms = (uint64_t)sim_start*1000;
+	do_setup();
+	// scenario times are the controller's local time
+	sim_clock_ms -= (uint64_t)(os.now_tz() - now())*1000;
+	sim_boot_ms = sim_clock_ms;
+
+	struct timeval t0, t1;
+	gettimeofday(&t0, NULL);
+	ulong loops = 0;
+	int ei = 0;
+	while (true) {
+		time_t curr_time = os.now_tz();
+		while (ei < sim_nevents && sim_events[ei].t <= curr_time) {
+			sim_apply(sim_events[ei++].cmd);
+		}
+		if (curr_time >= sim_end) break;
+		do_loop();
+		loops++;
+		uint64_t next = sim_next_step(ei);
+		if (next > sim_clock_ms) sim_clock_ms = next;
+	}
+	log_flush();
+	os.config_flush();
+	gettimeofday(&t1, NULL);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+	double days = (sim_end - sim_start) / 86400.0;
+	printf("sim: %.1f days in %.3f s, %lu loops, %.1f us per simulated day\n",
+				 days, secs, loops, secs * 1e6 / days);
+	for (SimTimer *st = sim_timers; st < sim_timers + SIM_NUM_TIMERS; st++) {
+		printf("sim: %s %lu calls, %.3f ms total, %.2f us per call, %.2f us max\n",
+					 st->name, st->calls, st->us / 1e3, st->calls ? st->us / st->calls : 0, st->max_us);
+	}
+	return 0;
+}
+
+#endif	// DEMO
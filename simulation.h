@@ -0,0 +1,53 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Time-warp simulation header file (DEMO build only)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMULATION_H
+#define _SIMULATION_H
+
+#if defined(DEMO)
+
+#include <time.h>
+
+#define SIM_MAX_LINE	1024	// maximum length of a scenario line
+
+/** Simulation mode
+ * A virtual clock replaces now() and millis(), sensor inputs are driven
+ * by a scenario file and do_loop() runs without waiting for real time.
+ * See examples/simulation for the scenario format.
+ */
+bool sim_active();
+time_t sim_now();
+unsigned long sim_millis();
+void sim_delay(unsigned long ms);
+unsigned char sim_digital_read(int pin);
+int sim_main(const char *scenario);
+
+/** Timed parts of the firmware, reported at the end of the simulation */
+#define SIM_TIMER_SCHED	0	// schedule_all_stations()
+#define SIM_TIMER_QUEUE	1	// a walk of the runtime queue, once per station or master transition
+#define SIM_NUM_TIMERS	2
+void sim_timer_start(unsigned char t);
+void sim_timer_stop(unsigned char t);
+
+#endif	// DEMO
+
+#endif	// _SIMULATION_H
@@ -9,12 +9,12 @@ void scan_i2C();
 void SPIFFS_list_dir() {
  
  
-  if (!SPIFFS.begin(true)) {
+  if (!FILESYSTEM.begin(true)) {
     DEBUG_PRINTLN("An Error has occurred while mounting SPIFFS");
     return;
   }
  
-  File root = SPIFFS.open("/");
+  File root = FILESYSTEM.open("/");
  
   File file = root.openNextFile();
  
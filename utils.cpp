@@ -23,6 +23,7 @@
 
 #include "utils.h"
 #include "OpenSprinkler.h"
+#include "simulation.h"
 extern OpenSprinkler os;
 
 #if defined(ARDUINO)	// Arduino
@@ -38,6 +39,9 @@ extern OpenSprinkler os;
 
 #else // RPI/BBB
 
+	#include <fcntl.h>
+	#include <sys/mman.h>
+
 char* get_runtime_path() {
 	static char path[PATH_MAX];
 	static byte query = 1;
@@ -47,6 +51,14 @@ char* get_runtime_path() {
 		return path;
 	#endif
 
+	#if defined(DEMO)
+	// simulation runs keep their data and log files in the current directory
+	if (sim_active()) {
+		strcpy(path, "./");
+		return path;
+	}
+	#endif
+
 	if(query) {
 		if(readlink("/proc/self/exe", path, PATH_MAX ) <= 0) {
 			return NULL;
@@ -71,6 +83,9 @@ char* get_filename_fullpath(const char *filename) {
 
 void delay(ulong howLong)
 {
+#if defined(DEMO)
+	if (sim_active()) { sim_delay(howLong); return; }
+#endif
 	struct timespec sleeper, dummy ;
 
 	sleeper.tv_sec	= (time_t)(howLong / 1000) ;
@@ -123,6 +138,9 @@ void initialiseEpoch()
 
 ulong millis (void)
 {
+#if defined(DEMO)
+	if (sim_active()) return sim_millis();
+#endif
 	struct timeval tv ;
 	uint64_t now ;
 
@@ -134,6 +152,9 @@ ulong millis (void)
 
 ulong micros (void)
 {
+#if defined(DEMO)
+	if (sim_active()) return sim_millis()*1000;
+#endif
 	struct timeval tv ;
 	uint64_t now ;
 
@@ -170,23 +191,336 @@ unsigned int detect_rpi_rev() {
 
 #endif
 
-void write_to_file(const char *fn, const char *data, ulong size, ulong pos, bool trunc) {
+#if !defined(ARDUINO)
+/** Mapped data files (Linux)
+ * Files accessed by block are kept open and mapped in memory, so that a block
+ * read or write is a memory copy instead of an fopen/fseek/fclose sequence.
+ * A write is followed by msync(MS_ASYNC): as with fclose, the data is in the
+ * page cache at once and written back by the kernel. The mappings are shared,
+ * so the stream functions see the same data. A mapping is dropped when its
+ * file is removed, renamed or truncated.
+ */
+#define MMAP_FILES 12	// maximum number of files mapped at a time
+
+struct MappedFile {
+	char *path;	// full path, NULL if the entry is free
+	int fd;
+	byte *addr;
+	ulong size;	// size of the mapping, i.e. of the file when it was mapped
+};
+
+static MappedFile mapped_files[MMAP_FILES];
+static byte mapped_evict = 0;	// next entry to reuse when all entries are in use
+
+static void mmap_close(MappedFile *m) {
+	if(m->addr) munmap(m->addr, m->size);
+	close(m->fd);
+	free(m->path);
+	m->path = NULL;
+	m->addr = NULL;
+	m->size = 0;
+}
+
+/** Map the file again if its size changed */
+static bool mmap_refresh(MappedFile *m) {
+	struct stat st;
+	if(fstat(m->fd, &st)) return false;
+	if((ulong)st.st_size==m->size) return true;
+	if(m->addr) munmap(m->addr, m->size);
+	m->addr = NULL;
+	m->size = 0;
+	if(st.st_size==0) return true;
+	void *addr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if(addr==MAP_FAILED) return false;
+	m->addr = (byte*)addr;
+	m->size = st.st_size;
+	return true;
+}
+
+/** Get the mapping of a file, the file is created if create is set
+ * Returns NULL if the file cannot be opened or mapped.
+ */
+static MappedFile *mmap_get(const char *fn, bool create) {
+	const char *path = get_filename_fullpath(fn);
+	MappedFile *m, *slot = NULL;
+	for(m=mapped_files; m<mapped_files+MMAP_FILES; m++) {
+		if(!m->path) { if(!slot) slot = m; }
+		else if(strcmp(m->path, path)==0) return m;
+	}
+	int fd = open(path, create ? (O_RDWR|O_CREAT) : O_RDWR, 0666);
+	if(fd<0) return NULL;
+	if(!slot) {
+		slot = mapped_files+mapped_evict;
+		mapped_evict = (mapped_evict+1)%MMAP_FILES;
+		mmap_close(slot);
+	}
+	slot->path = strdup(path);
+	slot->fd = fd;
+	if(!slot->path || !mmap_refresh(slot)) {
+		mmap_close(slot);
+		return NULL;
+	}
+	return slot;
+}
+
+/** Drop the mapping of a file, if it is mapped */
+static void mmap_drop(const char *fn) {
+	const char *path = get_filename_fullpath(fn);
+	for(MappedFile *m=mapped_files; m<mapped_files+MMAP_FILES; m++) {
+		if(m->path && strcmp(m->path, path)==0) mmap_close(m);
+	}
+}
+
+/** Drop all mappings, e.g. when switching to another storage backend */
+static void mmap_drop_all() {
+	for(MappedFile *m=mapped_files; m<mapped_files+MMAP_FILES; m++) {
+		if(m->path) mmap_close(m);
+	}
+}
+
+/** Storage backends (Linux)
+ * The file functions below go through the selected backend:
+ *   stdio   a stdio stream is opened, positioned and closed for each call
+ *   mmap    files accessed by block are kept mapped (see above), the default
+ *           unless built with -DSTORAGE_STDIO
+ *   memory  files are kept in RAM only, for tests and benchmarks
+ * Log files (logs.cpp) always use stdio streams.
+ * On ESP8266/ESP32 the file system (SPIFFS, LittleFS or FFat) is chosen at
+ * build time, as only one of them is mounted.
+ */
+struct StorageBackend {
+	const char *name;
+	ulong (*read)(const char *fn, void *dst, ulong pos, ulong len);	// returns the number of bytes read
+	ulong (*write)(const char *fn, const void *src, ulong pos, ulong len);	// returns the number of bytes written, creates the file
+	bool (*exists)(const char *fn);
+	ulong (*size)(const char *fn);
+	void (*remove)(const char *fn);
+	bool (*rename)(const char *from, const char *to);	// replaces an existing file
+	bool (*sync)(const char *fn);	// returns once the file content is on disk
+};
+
+static ulong stdio_read(const char *fn, void *dst, ulong pos, ulong len) {
+	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
+	if(!fp) return 0;
+	fseek(fp, pos, SEEK_SET);
+	ulong n = fread(dst, 1, len, fp);
+	fclose(fp);
+	return n;
+}
+
+static ulong stdio_write(const char *fn, const void *src, ulong pos, ulong len) {
+	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
+	if(!fp) {
+		fp = fopen(get_filename_fullpath(fn), "wb+");
+	}
+	if(!fp) return 0;
+	fseek(fp, pos, SEEK_SET); //this fails silently without the above change
+	ulong n = fwrite(src, 1, len, fp);
+	if(fclose(fp)) n = 0;
+	return n;
+}
+
+static bool stdio_exists(const char *fn) {
+	FILE *file;
+	file = fopen(get_filename_fullpath(fn), "rb");
+	if(file) {fclose(file); return true;}
+	else {return false;}
+}
+
+static ulong stdio_size(const char *fn) {
+	struct stat st;
+	if(stat(get_filename_fullpath(fn), &st)) return 0;
+	return st.st_size;
+}
+
+static void stdio_remove(const char *fn) {
+	remove(get_filename_fullpath(fn));
+}
+
+static bool stdio_rename(const char *from, const char *to) {
+	char path[PATH_MAX];
+	strcpy(path, get_filename_fullpath(from));
+	return rename(path, get_filename_fullpath(to))==0;
+}
+
+static bool stdio_sync(const char *fn) {
+	int fd = open(get_filename_fullpath(fn), O_RDONLY);
+	if(fd<0) return false;
+	bool ok = (fsync(fd)==0);
+	close(fd);
+	return ok;
+}
+
+static ulong mmap_read(const char *fn, void *dst, ulong pos, ulong len) {
+	MappedFile *m = mmap_get(fn, false);
+	if(!m) return stdio_read(fn, dst, pos, len);
+	if(pos+len>m->size) mmap_refresh(m);	// the file may have grown
+	if(pos>=m->size) return 0;
+	if(pos+len>m->size) len = m->size-pos;
+	memcpy(dst, m->addr+pos, len);
+	return len;
+}
+
+static ulong mmap_write(const char *fn, const void *src, ulong pos, ulong len) {
+	MappedFile *m = mmap_get(fn, true);
+	if(m && pos+len>m->size) {
+		// extend the file, unless it already grew
+		mmap_refresh(m);
+		if(pos+len>m->size && (ftruncate(m->fd, pos+len) || !mmap_refresh(m))) m = NULL;
+	}
+	if(!m) return stdio_write(fn, src, pos, len);
+	if(len) {
+		memcpy(m->addr+pos, src, len);
+		ulong page = pos & ~((ulong)sysconf(_SC_PAGESIZE)-1);
+		msync(m->addr+page, pos+len-page, MS_ASYNC);
+	}
+	return len;
+}
+
+static void mmap_remove(const char *fn) {
+	mmap_drop(fn);
+	stdio_remove(fn);
+}
+
+static bool mmap_rename(const char *from, const char *to) {
+	mmap_drop(from);
+	mmap_drop(to);
+	return stdio_rename(from, to);
+}
+
+/** Files of the memory backend, in a list */
+struct MemoryFile {
+	char *name;
+	byte *data;
+	ulong size;
+	MemoryFile *next;
+};
+
+static MemoryFile *memory_files = NULL;
+
+static MemoryFile **memory_find(const char *fn) {
+	MemoryFile **f;
+	for(f=&memory_files; *f && strcmp((*f)->name, fn); f=&(*f)->next);
+	return f;
+}
+
+static ulong memory_read(const char *fn, void *dst, ulong pos, ulong len) {
+	MemoryFile *f = *memory_find(fn);
+	if(!f || pos>=f->size) return 0;
+	if(pos+len>f->size) len = f->size-pos;
+	memcpy(dst, f->data+pos, len);
+	return len;
+}
+
+static ulong memory_write(const char *fn, const void *src, ulong pos, ulong len) {
+	MemoryFile **p = memory_find(fn), *f = *p;
+	if(!f) {
+		f = (MemoryFile*)calloc(1, sizeof(MemoryFile));
+		if(!f) return 0;
+		f->name = strdup(fn);
+		if(!f->name) { free(f); return 0; }
+		*p = f;
+	}
+	if(pos+len>f->size) {
+		byte *data = (byte*)realloc(f->data, pos+len);
+		if(!data) return 0;
+		memset(data+f->size, 0, pos+len-f->size);
+		f->data = data;
+		f->size = pos+len;
+	}
+	memcpy(f->data+pos, src, len);
+	return len;
+}
+
+static bool memory_exists(const char *fn) {
+	return *memory_find(fn)!=NULL;
+}
+
+static ulong memory_size(const char *fn) {
+	MemoryFile *f = *memory_find(fn);
+	return f ? f->size : 0;
+}
+
+static void memory_remove(const char *fn) {
+	MemoryFile **p = memory_find(fn), *f = *p;
+	if(!f) return;
+	*p = f->next;
+	free(f->name);
+	free(f->data);
+	free(f);
+}
+
+static bool memory_rename(const char *from, const char *to) {
+	MemoryFile *f = *memory_find(from);
+	if(!f) return false;
+	char *name = strdup(to);
+	if(!name) return false;
+	if(strcmp(from, to)) memory_remove(to);
+	free(f->name);
+	f->name = name;
+	return true;
+}
+
+static bool memory_sync(const char *fn) {
+	return memory_exists(fn);
+}
+
+static const StorageBackend storage_backends[] = {
+	{"stdio",  stdio_read,  stdio_write,  stdio_exists,  stdio_size,  stdio_remove,  stdio_rename,  stdio_sync},
+	{"mmap",   mmap_read,   mmap_write,   stdio_exists,  stdio_size,  mmap_remove,   mmap_rename,   stdio_sync},
+	{"memory", memory_read, memory_write, memory_exists, memory_size, memory_remove, memory_rename, memory_sync},
+};
+#define NUM_STORAGE_BACKENDS (sizeof(storage_backends)/sizeof(StorageBackend))
+
+#if defined(STORAGE_STDIO)
+static const StorageBackend *storage = storage_backends;
+#else
+static const StorageBackend *storage = storage_backends+1;
+#endif
+
+/** Select a storage backend by name, returns false if there is none with this name
+ * Files are not carried over from the previous backend.
+ */
+bool storage_select(const char *name) {
+	for(byte i=0; i<NUM_STORAGE_BACKENDS; i++) {
+		if(strcmp(storage_backends[i].name, name)) continue;
+		if(storage!=storage_backends+i) mmap_drop_all();
+		storage = storage_backends+i;
+		return true;
+	}
+	return false;
+}
+
+/** Name of the selected storage backend */
+const char* storage_name() {
+	return storage->name;
+}
+
+/** Name of the i-th storage backend, NULL past the last one */
+const char* storage_backend_name(byte i) {
+	return (i<NUM_STORAGE_BACKENDS) ? storage_backends[i].name : NULL;
+}
+#endif
+
+/** Write data to a file, this returns the number of bytes written */
+ulong write_to_file(const char *fn, const char *data, ulong size, ulong pos, bool trunc) {
+	ulong n = 0;
 
 #if defined(ESP8266)
 
 	File f;
 	if(trunc) {
-		f = SPIFFS.open(fn, "w");
+		f = FILESYSTEM.open(fn, "w");
 	} else {
-		f = SPIFFS.open(fn, "r+");
-		if(!f) f = SPIFFS.open(fn, "w");
+		f = FILESYSTEM.open(fn, "r+");
+		if(!f) f = FILESYSTEM.open(fn, "w");
 	}		 
-	if(!f) return;
+	if(!f) return 0;
 	if(pos) f.seek(pos, SeekSet);
 	if(size==0) {
 		f.write((byte*)" ", 1);  // hack to circumvent SPIFFS bug involving writing empty file
 	} else {
-		f.write((byte*)data, size);
+		n = f.write((byte*)data, size);
 	}
 	f.close();
 
@@ -195,18 +529,18 @@ void write_to_file(const char *fn, const char *data, ulong size, ulong pos, bool
   DEBUG_PRINT("write_to_file() "); DEBUG_PRINTLN(fn);
   File f;
   if(trunc) {
-    f = SPIFFS.open(fn, "w");
+    f = FILESYSTEM.open(fn, "w");
   } else {
-    f = SPIFFS.open(fn, "r+");
-    if(!f) f = SPIFFS.open(fn, "w");
+    f = FILESYSTEM.open(fn, "r+");
+    if(!f) f = FILESYSTEM.open(fn, "w");
   }    
-  if(!f) return;
+  if(!f) return 0;
   f.seek(0, SeekSet);
   if(pos) f.seek(pos, SeekSet);
   if(size==0) {
     f.write((byte*)" ", 1);  // hack to circumvent SPIFFS bug involving writing empty file
   } else {
-    f.write((byte*)data, size);
+    n = f.write((byte*)data, size);
   }
   f.close();
 
@@ -217,32 +551,25 @@ void write_to_file(const char *fn, const char *data, ulong size, ulong pos, bool
 	int flag = O_CREAT | O_RDWR;
 	if(trunc) flag |= O_TRUNC;
 	int ret = file.open(fn, flag);
-	if(!ret) return;
+	if(!ret) return 0;
 	file.seekSet(pos);
-	file.write(data, size);
+	int r = file.write(data, size);
+	if(r>0) n = r;
 	file.close();
 	
 #else
 
-	FILE *file;
-	if(trunc) {
-		file = fopen(get_filename_fullpath(fn), "wb");
-	} else {
-		file = fopen(get_filename_fullpath(fn), "r+b");
-		if(!file) file = fopen(get_filename_fullpath(fn), "wb");
-	}
-	if(!file)  return;
-	fseek(file, pos, SEEK_SET);
-	fwrite(data, 1, size, file);
-	fclose(file);
-	
+	if(trunc) storage->remove(fn);
+	n = storage->write(fn, data, pos, size);
+
 #endif
+	return n;
 }
 
 void read_from_file(const char *fn, char *data, ulong maxsize, ulong pos) {
 #if defined(ESP8266)
 
-	File f = SPIFFS.open(fn, "r");
+	File f = FILESYSTEM.open(fn, "r");
 	if(!f) {
 		data[0]=0;
 		return;  // return with empty string
@@ -258,7 +585,7 @@ void read_from_file(const char *fn, char *data, ulong maxsize, ulong pos) {
 #elif defined(ESP32)
 
   DEBUG_PRINT("read_from_file() "); DEBUG_PRINTLN(fn);
-  File f = SPIFFS.open(fn, "r");
+  File f = FILESYSTEM.open(fn, "r");
   if(!f) {
     data[0]=0;
     return;  // return with empty string
@@ -289,26 +616,11 @@ void read_from_file(const char *fn, char *data, ulong maxsize, ulong pos) {
 
 #else
 
-	FILE *file;
-	file = fopen(get_filename_fullpath(fn), "rb");
-	if(!file) {
-		data[0] = 0;
-		return;
-	}
-
-	int res;
-	fseek(file, pos, SEEK_SET);
-	if(fgets(data, maxsize, file)) {
-		res = strlen(data);
-	} else {
-		res = 0;
-	}
-	if (res <= 0) {
-		data[0] = 0;
-	}
-
-	data[maxsize-1]=0;
-	fclose(file);
+	// read a line as fgets does: up to maxsize-1 bytes, including the newline
+	ulong len = storage->read(fn, data, pos, maxsize-1);
+	data[len] = 0;
+	char *eol = (char*)memchr(data, '\n', len);
+	if(eol) eol[1] = 0;
 	return;
 
 #endif
@@ -317,8 +629,8 @@ void read_from_file(const char *fn, char *data, ulong maxsize, ulong pos) {
 void remove_file(const char *fn) {
 #if defined(ESP8266) || defined(ESP32)
 
-	if(!SPIFFS.exists(fn)) return;
-	SPIFFS.remove(fn);
+	if(!FILESYSTEM.exists(fn)) return;
+	FILESYSTEM.remove(fn);
 
 #elif defined(ARDUINO)
 
@@ -328,15 +640,149 @@ void remove_file(const char *fn) {
 
 #else
 
-	remove(get_filename_fullpath(fn));
+	storage->remove(fn);
+
+#endif
+}
+
+/** Rename a file, an existing file with the new name is replaced */
+bool rename_file(const char *from, const char *to) {
+#if defined(ESP8266) || defined(ESP32)
+
+	if(FILESYSTEM.exists(to)) FILESYSTEM.remove(to);
+	return FILESYSTEM.rename(from, to);
+
+#elif defined(ARDUINO)
+
+	sd.chdir("/");
+	if (sd.exists(to)) sd.remove(to);
+	return sd.rename(from, to);
+
+#else
+
+	return storage->rename(from, to);
+
+#endif
+}
+
+/** Temporary file name used by file_replace: the extension becomes .tmp */
+static void make_tmp_name(const char *fn, char *tmp) {
+	strcpy(tmp, fn);
+	char *ext = strrchr(tmp, '.');
+	if(!ext) ext = tmp+strlen(tmp);
+	strcpy_P(ext, PSTR(".tmp"));
+}
+
+/** Trailer appended to the data by file_replace
+ * file_recover only renames a temporary file whose trailer matches its data.
+ * The trailer stays at the end of the file, readers only read the data before it.
+ */
+struct ReplaceTrailer {
+	uint32_t len;
+	uint16_t sum;
+	uint16_t magic;
+};
+#define REPLACE_MAGIC 0x5AE1
+
+/** Size of a file, 0 if it does not exist */
+ulong file_size(const char *fn) {
+#if defined(ESP8266) || defined(ESP32)
+
+	File f = FILESYSTEM.open(fn, "r");
+	if(!f) return 0;
+	ulong size = f.size();
+	f.close();
+	return size;
+
+#elif defined(ARDUINO)
+
+	sd.chdir("/");
+	SdFile file;
+	if(!file.open(fn, O_READ)) return 0;
+	ulong size = file.fileSize();
+	file.close();
+	return size;
+
+#else
+
+	return storage->size(fn);
+
+#endif
+}
 
+/** Replace the content of a file
+ * The content is written to a temporary file first, followed by a trailer
+ * with its length and checksum, which is then renamed, so an interruption
+ * leaves either the old or the new file, never a partial one.
+ * A short write removes the temporary file and keeps the old file.
+ */
+bool file_replace(const char *fn, const void *src, ulong len) {
+	char tmp[24];
+	ReplaceTrailer t;
+	make_tmp_name(fn, tmp);
+	t.len = len;
+	t.sum = 0;
+	checksum_update(&t.sum, src, len);
+	t.magic = REPLACE_MAGIC;
+	if(write_to_file(tmp, (const char*)src, len)!=len ||
+		 write_to_file(tmp, (const char*)&t, sizeof(t), len, false)!=sizeof(t)) {
+		remove_file(tmp);
+		return false;
+	}
+#if !defined(ARDUINO)
+	// the data has to be on disk before the rename is
+	if(!storage->sync(tmp)) {
+		remove_file(tmp);
+		return false;
+	}
 #endif
+	return rename_file(tmp, fn);
+}
+
+/** Check the trailer of a temporary file written by file_replace */
+static bool file_replace_complete(const char *tmp) {
+	ReplaceTrailer t;
+	byte buf[16];
+	ulong size = file_size(tmp), pos, n;
+	if(size<sizeof(t)) return false;
+	file_read_block(tmp, &t, size-sizeof(t), sizeof(t));
+	if(t.magic!=REPLACE_MAGIC || t.len!=size-sizeof(t)) return false;
+	uint16_t sum = 0;
+	for(pos=0; pos<t.len; pos+=n) {
+		n = (t.len-pos<sizeof(buf)) ? t.len-pos : sizeof(buf);
+		file_read_block(tmp, buf, pos, n);
+		checksum_update(&sum, buf, n);
+	}
+	return sum==t.sum;
+}
+
+/** Finish or undo a file_replace interrupted by a power loss or reboot
+ * A temporary file is renamed if its trailer shows that it is complete,
+ * otherwise it is dropped and the old file, if any, is kept.
+ */
+void file_recover(const char *fn) {
+	char tmp[24];
+	make_tmp_name(fn, tmp);
+	if(!file_exists(tmp)) return;
+	if(file_replace_complete(tmp)) rename_file(tmp, fn);
+	else remove_file(tmp);
+}
+
+/** Running checksum (Fletcher-16 without the modulo) */
+void checksum_update(uint16_t *sum, const void *data, ulong len) {
+	const byte *p = (const byte*)data;
+	byte s1 = *sum & 0xFF, s2 = *sum >> 8;
+	while(len--) {
+		s1 += *p++;
+		s2 += s1;
+	}
+	*sum = s1 | ((uint16_t)s2<<8);
 }
 
 bool file_exists(const char *fn) {
 #if defined(ESP8266) || defined(ESP32)
 
-	return SPIFFS.exists(fn);
+	return FILESYSTEM.exists(fn);
 
 #elif defined(ARDUINO)
 
@@ -345,10 +791,7 @@ bool file_exists(const char *fn) {
 
 #else
 
-	FILE *file;
-	file = fopen(get_filename_fullpath(fn), "rb");
-	if(file) {fclose(file); return true;}
-	else {return false;}
+	return storage->exists(fn);
 
 #endif
 }
@@ -358,7 +801,7 @@ void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 #if defined(ESP8266)
 
 	// do not use File.readBytes or readBytesUntil because it's very slow  
-	File f = SPIFFS.open(fn, "r");
+	File f = FILESYSTEM.open(fn, "r");
 	if(f) {
 		f.seek(pos, SeekSet);
 		f.read((byte*)dst, len);
@@ -367,7 +810,7 @@ void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 
 #elif defined(ESP32)
   
-	File f = SPIFFS.open(fn, "r");
+	File f = FILESYSTEM.open(fn, "r");
 	if(f) {
 		f.seek(0, SeekSet);
 		f.seek(pos, SeekSet);
@@ -387,12 +830,7 @@ void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
-	if(fp) {
-		fseek(fp, pos, SEEK_SET);
-		fread(dst, 1, len, fp);
-		fclose(fp);
-	}  
+	storage->read(fn, dst, pos, len);
 
 #endif
 }
@@ -400,8 +838,8 @@ void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 void file_write_block(const char *fn, const void *src, ulong pos, ulong len) {
 #if defined(ESP8266)
 
-	File f = SPIFFS.open(fn, "r+");
-	if(!f) f = SPIFFS.open(fn, "w");
+	File f = FILESYSTEM.open(fn, "r+");
+	if(!f) f = FILESYSTEM.open(fn, "w");
 	if(f) {
 		f.seek(pos, SeekSet);
 		f.write((byte*)src, len);
@@ -413,10 +851,10 @@ void file_write_block(const char *fn, const void *src, ulong pos, ulong len) {
 //  DEBUG_PRINT("file_write_block() "); DEBUG_PRINTLN(fn);
 	File f;
 	
-	if(SPIFFS.exists(fn))
-		f = SPIFFS.open(fn, "r+");
+	if(FILESYSTEM.exists(fn))
+		f = FILESYSTEM.open(fn, "r+");
 	else
-		f = SPIFFS.open(fn, "w");
+		f = FILESYSTEM.open(fn, "w");
 	
 	if(f) {
 		f.seek(0,SeekSet);
@@ -437,15 +875,7 @@ void file_write_block(const char *fn, const void *src, ulong pos, ulong len) {
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
-	if(!fp) {
-		fp = fopen(get_filename_fullpath(fn), "wb+");
-	}
-	if(fp) {
-		fseek(fp, pos, SEEK_SET); //this fails silently without the above change
-		fwrite(src, 1, len, fp);
-		fclose(fp);
-	}
+	storage->write(fn, src, pos, len);
 
 #endif
 
@@ -457,7 +887,7 @@ void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp)
 	if(tmp==NULL) { return; }
 #if defined(ESP8266)
 
-	File f = SPIFFS.open(fn, "r+");
+	File f = FILESYSTEM.open(fn, "r+");
 	if(!f) return;
 	f.seek(from, SeekSet);
 	f.read((byte*)tmp, len);
@@ -467,7 +897,7 @@ void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp)
 
 #elif defined(ESP32)
 
-	File f = SPIFFS.open(fn, "r+");
+	File f = FILESYSTEM.open(fn, "r+");
 	if(!f) return;
 	f.seek(0,SeekSet);
 	f.seek(from, SeekSet);
@@ -490,13 +920,9 @@ void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp)
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
-	if(!fp) return;
-	fseek(fp, from, SEEK_SET);
-	fread(tmp, 1, len, fp);
-	fseek(fp, to, SEEK_SET);
-	fwrite(tmp, 1, len, fp);
-	fclose(fp);
+	if(!storage->exists(fn)) return;
+	len = storage->read(fn, tmp, from, len);
+	storage->write(fn, tmp, to, len);
 
 #endif
 
@@ -506,7 +932,7 @@ void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp)
 byte file_cmp_block(const char *fn, const char *buf, ulong pos) {
 #if defined(ESP8266)
 
-	File f = SPIFFS.open(fn, "r");
+	File f = FILESYSTEM.open(fn, "r");
 	if(f) {
 		f.seek(pos, SeekSet);
 		char c = f.read();
@@ -520,7 +946,7 @@ byte file_cmp_block(const char *fn, const char *buf, ulong pos) {
 
 #elif defined(ESP32)
 
-  File f = SPIFFS.open(fn, "r");
+  File f = FILESYSTEM.open(fn, "r");
   if(f) {
     f.seek(0, SeekSet);
     f.seek(pos, SeekSet);
@@ -550,17 +976,14 @@ byte file_cmp_block(const char *fn, const char *buf, ulong pos) {
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
-	if(fp) {
-		fseek(fp, pos, SEEK_SET);
-		char c = fgetc(fp);
-		while(*buf && (c==*buf)) {
-			buf++;
-			c=fgetc(fp);
-		}
-		fclose(fp);
-		return (*buf==c)?0:1;
-	}  
+	// the file has to match the string including its terminating 0
+	char chunk[32];
+	ulong len = strlen(buf)+1, n;
+	for(; len; len-=n, buf+=n, pos+=n) {
+		n = (len<sizeof(chunk)) ? len : sizeof(chunk);
+		if(storage->read(fn, chunk, pos, n)!=n || memcmp(chunk, buf, n)) return 1;
+	}
+	return 0;
 
 #endif
 	return 1;
@@ -617,6 +1040,38 @@ int16_t water_time_decode_signed(byte i) {
 	return ((int16_t)i-120)*5;
 }
 
+/** Find the first set bit of a station bitset at or after sid
+ * Returns n if there is none. Boards without set bits are skipped
+ * a byte at a time (four bytes at a time on Linux).
+ */
+sid_t station_bits_next(const byte *bits, sid_t sid, sid_t n) {
+	while (sid < n) {
+		byte b = bits[sid>>3] >> (sid&0x07);
+		if (b) {
+			sid += __builtin_ctz(b);
+			return (sid < n) ? sid : n;
+		}
+		sid = (sid|0x07)+1;
+#if !defined(ARDUINO)
+		uint32_t w;
+		while (sid+32 <= n) {
+			memcpy(&w, bits+(sid>>3), sizeof(w));
+			if (w) break;
+			sid += 32;
+		}
+#endif
+	}
+	return n;
+}
+
+/** Count the set bits of a station bitset */
+sid_t station_bits_count(const byte *bits, byte nboards) {
+	sid_t count = 0;
+	for(byte bid=0;bid<nboards;bid++) {
+		if (bits[bid]) count += __builtin_popcount(bits[bid]);
+	}
+	return count;
+}
 
 /** Convert a single hex digit character to its integer value */
 static unsigned char h2int(char c) {
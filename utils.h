@@ -31,14 +31,28 @@
 	#include <limits.h>
 	#include <sys/time.h>
 
+	/** Data files are read and written by block through memory mappings,
+	 * build with -DSTORAGE_STDIO to start with stdio streams instead,
+	 * see storage_select() */
+
 #endif
 #include "defines.h"
 
 // File reading/writing functions
-void write_to_file(const char *fname, const char *data, ulong size, ulong pos=0, bool trunc=true);
+ulong write_to_file(const char *fname, const char *data, ulong size, ulong pos=0, bool trunc=true);
 void read_from_file(const char *fname, char *data, ulong maxsize=TMP_BUFFER_SIZE, int pos=0);
 void remove_file(const char *fname);
 bool file_exists(const char *fname);
+bool rename_file(const char *from, const char *to);
+bool file_replace(const char *fname, const void *src, ulong len);
+void file_recover(const char *fname);
+ulong file_size(const char *fname);
+void checksum_update(uint16_t *sum, const void *data, ulong len);
+#if !defined(ARDUINO)
+bool storage_select(const char *name);
+const char* storage_name();
+const char* storage_backend_name(byte i);
+#endif
 
 void file_read_block (const char *fname, void *dst, ulong pos, ulong len);
 void file_write_block(const char *fname, const void *src, ulong pos, ulong len);
@@ -55,6 +69,10 @@ int16_t water_time_decode_signed(byte i);
 void urlDecode(char *);
 void peel_http_header(char*);
 
+// station bitset functions (one byte per board: bit s of byte bid is station bid*8+s)
+sid_t station_bits_next(const byte *bits, sid_t sid, sid_t n);
+sid_t station_bits_count(const byte *bits, byte nboards);
+
 #if defined(ARDUINO)
 
 #else // Arduino compatible functions for RPI/BBB
@@ -146,7 +146,7 @@ void GetWeather() {
 	}
 #endif
 	// use temp buffer to construct get command
-	BufferFiller bf = tmp_buffer;
+	BufferFiller bf(tmp_buffer, TMP_BUFFER_SIZE);
 	bf.emit_p(PSTR("$D?loc=$O&wto=$O&fwv=$D"),
 								(int) os.iopts[IOPT_USE_WEATHER],
 								SOPT_LOCATION,